@@ -0,0 +1,543 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+// Benchmarks run on synthetic MNIST-shaped data generated from a fixed seed, so results are comparable across commits
+// on a machine without the real data. Every result is the distribution of the time per call over the samples; a
+// sample repeats the call until it takes at least BENCH_MIN_SAMPLE seconds.
+#define BENCH_MAX_RESULTS 64
+#define BENCH_MIN_SAMPLE 0.002
+#define BENCH_NAME_LEN 64
+#define BENCH_SAMPLES 21
+#define BENCH_MACRO_SAMPLES 5
+#define BENCH_SEED 20240601
+#define BENCH_STROKES 3
+#define BENCH_STROKE_WIDTH 2.0f
+#define BENCH_TEST_COUNT 10000
+#define BENCH_TRAINING_COUNT 60000
+
+typedef void (*Bench_Function)(void *context);
+
+// Times are seconds per call. items (images) and flops are per call, 0 when they do not apply. baseline is the median
+// read from the baseline file, 0 when the benchmark is not in it.
+typedef struct {
+  char name[BENCH_NAME_LEN];
+  size_t iterations;
+  size_t samples;
+  double median;
+  double p10;
+  double p90;
+  double p99;
+  double min;
+  double max;
+  double items;
+  double flops;
+  double baseline;
+} Bench_Result;
+
+void bench_generate(char *path, size_t *arch, size_t arch_count);
+void bench_run(size_t *arch, size_t arch_count, size_t threads, char *baseline_path);
+
+#endif // BENCH_H_
+
+#ifdef BENCH_IMPLEMENTATION
+
+typedef struct {
+  Matrix dst;
+  Matrix a;
+  Matrix b;
+  NN nn;
+  NN gradient;
+  Matrix delta;
+  float learning_rate;
+  char *images_path;
+  char *labels_path;
+  char *model_path;
+  char *save_path;
+  size_t *arch;
+  size_t arch_count;
+  Pool *pool;
+  Dataset dataset;
+  NN_Evaluator evaluator;
+  Render_Cache *render_cache;
+} Bench_Context;
+
+static void bench_prototypes(float *prototypes)
+{
+  for (size_t d = 0; d < DIGITS; ++d) {
+    float strokes[BENCH_STROKES][4];
+    for (size_t s = 0; s < BENCH_STROKES; ++s) {
+      for (size_t c = 0; c < 4; ++c) {
+        strokes[s][c] = 6 + rand_float() * (IMAGE_WIDTH - 12);
+      }
+    }
+
+    float *prototype = &prototypes[d * IMAGE_UNIT_LEN];
+    for (size_t y = 0; y < IMAGE_HEIGHT; ++y) {
+      for (size_t x = 0; x < IMAGE_WIDTH; ++x) {
+        float value = 0;
+        for (size_t s = 0; s < BENCH_STROKES; ++s) {
+          float dx = strokes[s][2] - strokes[s][0];
+          float dy = strokes[s][3] - strokes[s][1];
+          float t = ((x - strokes[s][0]) * dx + (y - strokes[s][1]) * dy) / (dx * dx + dy * dy + 1e-6f);
+          t = t < 0 ? 0 : (t > 1 ? 1 : t);
+          float ex = strokes[s][0] + t * dx - x;
+          float ey = strokes[s][1] + t * dy - y;
+          value = fmaxf(value, 1 - sqrtf(ex * ex + ey * ey) / BENCH_STROKE_WIDTH);
+        }
+        prototype[y * IMAGE_WIDTH + x] = value;
+      }
+    }
+  }
+}
+
+// Every image is the stroke prototype of its label, shifted by up to one pixel and scaled in brightness, so the
+// data is as sparse as MNIST and a network can learn it.
+static void bench_write_dataset(char *images_path, char *labels_path, size_t count, const float *prototypes)
+{
+  uint8_t *images = malloc(count * IMAGE_UNIT_LEN);
+  assert(images != NULL);
+  uint8_t *labels = malloc(count);
+  assert(labels != NULL);
+
+  for (size_t i = 0; i < count; ++i) {
+    labels[i] = rand_float() * DIGITS;
+    int shift_x = (int) (rand_float() * 3) - 1;
+    int shift_y = (int) (rand_float() * 3) - 1;
+    float scale = MAX_BRIGHTNESS * (0.6f + 0.4f * rand_float());
+    const float *prototype = &prototypes[labels[i] * IMAGE_UNIT_LEN];
+    uint8_t *image = &images[i * IMAGE_UNIT_LEN];
+    for (int y = 0; y < IMAGE_HEIGHT; ++y) {
+      for (int x = 0; x < IMAGE_WIDTH; ++x) {
+        int sx = x - shift_x;
+        int sy = y - shift_y;
+        float value = (sx >= 0) && (sx < IMAGE_WIDTH) && (sy >= 0) && (sy < IMAGE_HEIGHT) ?
+                      prototype[sy * IMAGE_WIDTH + sx] : 0;
+        image[y * IMAGE_WIDTH + x] = value > 0 ? value * scale : 0;
+      }
+    }
+  }
+
+  size_t image_dims[] = {count, IMAGE_HEIGHT, IMAGE_WIDTH};
+  idx_write(images_path, IDX_IMAGES_TYPE, image_dims, ARRAY_LEN(image_dims), images);
+  idx_write(labels_path, IDX_LABELS_TYPE, &count, 1, labels);
+  free(labels);
+  free(images);
+}
+
+// Writes training and test IDX files with the MNIST shapes and a model with the widths in arch to path.
+void bench_generate(char *path, size_t *arch, size_t arch_count)
+{
+  printf("Generating the synthetic data...\n");
+  nn_rng_seed(BENCH_SEED);
+
+  float *prototypes = malloc(sizeof(*prototypes) * DIGITS * IMAGE_UNIT_LEN);
+  assert(prototypes != NULL);
+  bench_prototypes(prototypes);
+
+  char images_path[MAX_FILEPATH_LEN];
+  char labels_path[MAX_FILEPATH_LEN];
+  snprintf(images_path, sizeof(images_path), "%straining_images", path);
+  snprintf(labels_path, sizeof(labels_path), "%straining_labels", path);
+  bench_write_dataset(images_path, labels_path, BENCH_TRAINING_COUNT, prototypes);
+  snprintf(images_path, sizeof(images_path), "%stest_images", path);
+  snprintf(labels_path, sizeof(labels_path), "%stest_labels", path);
+  bench_write_dataset(images_path, labels_path, BENCH_TEST_COUNT, prototypes);
+  free(prototypes);
+
+  char model_path[MAX_FILEPATH_LEN];
+  snprintf(model_path, sizeof(model_path), "%smodel", path);
+  NN nn = nn_alloc(arch, arch_count);
+  nn_init(nn);
+  nn_save_file(nn, model_path);
+  nn_free(nn);
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static double bench_percentile(const double *sorted, size_t count, double percent)
+{
+  size_t rank = ceil(percent / 100 * count);
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void bench_measure(Bench_Result *result, size_t samples, Bench_Function function, void *context)
+{
+  double start = prof_now();
+  function(context);
+  double once = prof_now() - start;
+  result->iterations = once >= BENCH_MIN_SAMPLE ? 1 : ceil(BENCH_MIN_SAMPLE / (once > 1e-9 ? once : 1e-9));
+  result->samples = samples;
+
+  double times[BENCH_SAMPLES > BENCH_MACRO_SAMPLES ? BENCH_SAMPLES : BENCH_MACRO_SAMPLES];
+  assert(samples <= ARRAY_LEN(times));
+  for (size_t s = 0; s < samples; ++s) {
+    start = prof_now();
+    for (size_t i = 0; i < result->iterations; ++i) {
+      function(context);
+    }
+    times[s] = (prof_now() - start) / result->iterations;
+  }
+
+  qsort(times, samples, sizeof(*times), bench_compare);
+  result->median = bench_percentile(times, samples, 50);
+  result->p10 = bench_percentile(times, samples, 10);
+  result->p90 = bench_percentile(times, samples, 90);
+  result->p99 = bench_percentile(times, samples, 99);
+  result->min = times[0];
+  result->max = times[samples - 1];
+}
+
+static void bench_dot(void *context)
+{
+  Bench_Context *ctx = context;
+  matrix_dot(ctx->dst, ctx->a, ctx->b);
+}
+
+static void bench_sig(void *context)
+{
+  Bench_Context *ctx = context;
+  matrix_sig(ctx->a);
+}
+
+static void bench_softmax(void *context)
+{
+  Bench_Context *ctx = context;
+  matrix_softmax(ctx->a);
+}
+
+static void bench_forward(void *context)
+{
+  Bench_Context *ctx = context;
+  nn_forward(ctx->nn);
+}
+
+// The backward pass overwrites the output delta, so it is restored on every call.
+static void bench_batch_gradient(void *context)
+{
+  Bench_Context *ctx = context;
+  matrix_copy(NN_OUTPUT(ctx->gradient), ctx->delta);
+  nn_get_batch_gradient(ctx->nn, ctx->gradient);
+}
+
+static void bench_total_gradient(void *context)
+{
+  Bench_Context *ctx = context;
+  nn_get_total_gradient(ctx->nn, ctx->gradient);
+}
+
+static void bench_update_weights(void *context)
+{
+  Bench_Context *ctx = context;
+  nn_update_weights(ctx->nn, ctx->gradient, ctx->learning_rate);
+}
+
+static void bench_dataset_load(void *context)
+{
+  Bench_Context *ctx = context;
+  dataset_free(dataset_open("benchmark", ctx->images_path, ctx->labels_path));
+}
+
+static void bench_save(void *context)
+{
+  Bench_Context *ctx = context;
+  nn_save_file(ctx->nn, ctx->save_path);
+}
+
+static void bench_load(void *context)
+{
+  Bench_Context *ctx = context;
+  NN nn;
+  if (!nn_load_file(ctx->model_path, ctx->arch, ctx->arch_count, &nn)) {
+    exit(1);
+  }
+  nn_free(nn);
+}
+
+static void bench_render(void *context)
+{
+  Bench_Context *ctx = context;
+  nn_render(olivec_canvas(canvas_pixels, RENDER_WIDTH, RENDER_HEIGHT, RENDER_WIDTH), ctx->nn);
+}
+
+static void bench_render_cache(void *context)
+{
+  Bench_Context *ctx = context;
+  Olivec_Canvas canvas = olivec_canvas(canvas_pixels, RENDER_WIDTH, RENDER_HEIGHT, RENDER_WIDTH);
+  render_cache_draw(ctx->render_cache, ctx->pool, canvas, ctx->nn);
+}
+
+// The weights are initialized again, so every sample trains the same epoch.
+static void bench_train(void *context)
+{
+  Bench_Context *ctx = context;
+  nn_rng_seed(BENCH_SEED);
+  nn_init(ctx->nn);
+  Optimizer optimizer = optim_alloc(OPTIM_SGD, OPTIM_CONSTANT, ctx->learning_rate, 1, 0, ctx->nn.param_count,
+                                    ctx->dataset.count / TRAINING_BATCH);
+  nn_train(ctx->nn, ctx->gradient, ctx->pool, ctx->dataset, &optimizer, NULL, 0);
+  optim_free(optimizer);
+}
+
+static void bench_test(void *context)
+{
+  Bench_Context *ctx = context;
+  NN_Evaluation evaluation;
+  nn_evaluate(&ctx->evaluator, ctx->dataset, &evaluation);
+}
+
+static Bench_Result *bench_add(Bench_Result *results, size_t *count, double items, double flops,
+                               const char *format, ...) __attribute__((format(printf, 5, 6)));
+
+static Bench_Result *bench_add(Bench_Result *results, size_t *count, double items, double flops,
+                               const char *format, ...)
+{
+  assert(*count < BENCH_MAX_RESULTS);
+  Bench_Result *result = &results[(*count)++];
+  memset(result, 0, sizeof(*result));
+  va_list args;
+  va_start(args, format);
+  vsnprintf(result->name, sizeof(result->name), format, args);
+  va_end(args);
+  result->items = items;
+  result->flops = flops;
+  return result;
+}
+
+// The baseline is a file written by an earlier run: one benchmark object per line, matched by name.
+static void bench_read_baseline(char *path, Bench_Result *results, size_t count)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Error opening the baseline.");
+    exit(1);
+  }
+  char line[1024];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char *name = strstr(line, "{\"name\":\"");
+    char *median = strstr(line, "\"median\":");
+    if ((name == NULL) || (median == NULL)) {
+      continue;
+    }
+    name += strlen("{\"name\":\"");
+    char *end = strchr(name, '"');
+    for (size_t r = 0; (end != NULL) && (r < count); ++r) {
+      if ((strlen(results[r].name) == (size_t) (end - name)) && (strncmp(results[r].name, name, end - name) == 0)) {
+        results[r].baseline = strtod(median + strlen("\"median\":"), NULL);
+      }
+    }
+  }
+  fclose(file);
+}
+
+static void bench_format_time(char *buf, size_t len, double seconds)
+{
+  if (seconds < 1e-6) {
+    snprintf(buf, len, "%7.1f ns", seconds * 1e9);
+  } else if (seconds < 1e-3) {
+    snprintf(buf, len, "%7.2f us", seconds * 1e6);
+  } else if (seconds < 1) {
+    snprintf(buf, len, "%7.2f ms", seconds * 1e3);
+  } else {
+    snprintf(buf, len, "%7.3f s ", seconds);
+  }
+}
+
+static void bench_print(const Bench_Result *results, size_t count)
+{
+  printf("\n%-32s %10s %10s %10s %10s %12s %8s %9s\n", "benchmark", "median", "p10", "p90", "p99", "images/s",
+         "GFLOP/s", "baseline");
+  for (size_t r = 0; r < count; ++r) {
+    const Bench_Result *result = &results[r];
+    char median[16], p10[16], p90[16], p99[16], items[16], flops[16], baseline[16];
+    bench_format_time(median, sizeof(median), result->median);
+    bench_format_time(p10, sizeof(p10), result->p10);
+    bench_format_time(p90, sizeof(p90), result->p90);
+    bench_format_time(p99, sizeof(p99), result->p99);
+    snprintf(items, sizeof(items), result->items > 0 ? "%.0f" : "-", result->items / result->median);
+    snprintf(flops, sizeof(flops), result->flops > 0 ? "%.2f" : "-", result->flops / result->median * 1e-9);
+    snprintf(baseline, sizeof(baseline), result->baseline > 0 ? "%+.1f %%" : "-",
+             (result->median / result->baseline - 1) * MAX_PERCENT);
+    printf("%-32s %10s %10s %10s %10s %12s %8s %9s\n", result->name, median, p10, p90, p99, items, flops, baseline);
+  }
+}
+
+static void bench_write(char *path, const Bench_Result *results, size_t count, size_t threads)
+{
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Error opening the file.");
+    exit(1);
+  }
+  time_t current_time = time(NULL);
+  char date_string[32];
+  strftime(date_string, sizeof(date_string), "%Y-%m-%dT%H:%M:%S", localtime(&current_time));
+  fprintf(file, "{\"date\":\"%s\",\"threads\":%zu,\"gemm\":\"%s\",\"qnn\":\"%s\",\"benchmarks\":[\n", date_string,
+          threads, gemm_kernel_name(), qnn_kernel_name());
+  for (size_t r = 0; r < count; ++r) {
+    const Bench_Result *result = &results[r];
+    fprintf(file, "{\"name\":\"%s\",\"iterations\":%zu,\"samples\":%zu,\"median\":%.9g,\"p10\":%.9g,\"p90\":%.9g,"
+            "\"p99\":%.9g,\"min\":%.9g,\"max\":%.9g,\"images_per_sec\":%.1f,\"gflops\":%.3f}%s\n", result->name,
+            result->iterations, result->samples, result->median, result->p10, result->p90, result->p99, result->min,
+            result->max, result->items / result->median, result->flops / result->median * 1e-9,
+            (r + 1) < count ? "," : "");
+  }
+  fprintf(file, "]}\n");
+  if (fclose(file) != 0) {
+    fprintf(stderr, "Error writing the file.");
+    exit(1);
+  }
+}
+
+// Runs the micro benchmarks on the layer shapes of arch, then one training epoch and a full test, prints the results
+// and writes them to BENCH_PATH as JSON. With a baseline file the medians are compared to it.
+void bench_run(size_t *arch, size_t arch_count, size_t threads, char *baseline_path)
+{
+  bench_generate(BENCH_PATH, arch, arch_count);
+  printf("Running the benchmarks (%s kernels, %zu thread(s))...\n", gemm_kernel_name(), threads);
+
+  Bench_Result results[BENCH_MAX_RESULTS];
+  size_t count = 0;
+  Bench_Context ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  char images_path[MAX_FILEPATH_LEN];
+  char labels_path[MAX_FILEPATH_LEN];
+  char model_path[MAX_FILEPATH_LEN];
+  char save_path[MAX_FILEPATH_LEN];
+  snprintf(images_path, sizeof(images_path), "%straining_images", BENCH_PATH);
+  snprintf(labels_path, sizeof(labels_path), "%straining_labels", BENCH_PATH);
+  snprintf(model_path, sizeof(model_path), "%smodel", BENCH_PATH);
+  snprintf(save_path, sizeof(save_path), "%smodel_saved", BENCH_PATH);
+  ctx.images_path = images_path;
+  ctx.labels_path = labels_path;
+  ctx.model_path = model_path;
+  ctx.save_path = save_path;
+  ctx.arch = arch;
+  ctx.arch_count = arch_count;
+  ctx.learning_rate = LEARNING_RATE;
+
+  Dataset training = dataset_open("training", images_path, labels_path);
+  NN model;
+  if (!nn_load_file(model_path, arch, arch_count, &model)) {
+    exit(1);
+  }
+
+  size_t batch_sizes[] = {TRAINING_BATCH, EVALUATION_BATCH};
+  for (size_t b = 0; b < ARRAY_LEN(batch_sizes); ++b) {
+    for (size_t l = 0; l + 1 < arch_count; ++l) {
+      ctx.a = matrix_alloc(batch_sizes[b], arch[l]);
+      matrix_from_bytes(ctx.a, training.images);
+      ctx.b = model.ws[l];
+      ctx.dst = matrix_alloc(batch_sizes[b], arch[l+1]);
+      double flops = 2.0 * batch_sizes[b] * arch[l] * arch[l+1];
+      bench_measure(bench_add(results, &count, 0, flops, "matrix_dot %zux%zux%zu", batch_sizes[b], arch[l],
+                              arch[l+1]), BENCH_SAMPLES, bench_dot, &ctx);
+      free(ctx.dst.items);
+      free(ctx.a.items);
+    }
+  }
+
+  ctx.a = matrix_alloc(TRAINING_BATCH, arch[1]);
+  matrix_rand(ctx.a, -4, 4);
+  bench_measure(bench_add(results, &count, 0, 0, "matrix_sig %zux%zu", ctx.a.rows, ctx.a.cols), BENCH_SAMPLES,
+                bench_sig, &ctx);
+  free(ctx.a.items);
+  ctx.a = matrix_alloc(EVALUATION_BATCH, arch[arch_count-1]);
+  matrix_rand(ctx.a, -4, 4);
+  bench_measure(bench_add(results, &count, 0, 0, "matrix_softmax %zux%zu", ctx.a.rows, ctx.a.cols), BENCH_SAMPLES,
+                bench_softmax, &ctx);
+  free(ctx.a.items);
+
+  double forward_flops = 0;
+  for (size_t l = 0; l + 1 < arch_count; ++l) {
+    forward_flops += 2.0 * arch[l] * arch[l+1];
+  }
+  ctx.nn = nn_alloc_activations(model, TRAINING_BATCH);
+  matrix_from_bytes(NN_INPUT(ctx.nn), training.images);
+  bench_measure(bench_add(results, &count, TRAINING_BATCH, TRAINING_BATCH * forward_flops, "nn_forward %zu",
+                          (size_t) TRAINING_BATCH), BENCH_SAMPLES, bench_forward, &ctx);
+
+  ctx.gradient = nn_alloc_batch(arch, arch_count, TRAINING_BATCH);
+  ctx.delta = matrix_alloc(TRAINING_BATCH, arch[arch_count-1]);
+  matrix_copy(ctx.delta, NN_OUTPUT(ctx.nn));
+  for (size_t i = 0; i < TRAINING_BATCH; ++i) {
+    MATRIX_AT(ctx.delta, i, training.labels[i]) -= MAX_ACTIVATION;
+  }
+  bench_measure(bench_add(results, &count, TRAINING_BATCH, TRAINING_BATCH * 2 * forward_flops,
+                          "nn_get_batch_gradient %zu", (size_t) TRAINING_BATCH), BENCH_SAMPLES,
+                bench_batch_gradient, &ctx);
+
+  ctx.learning_rate = LEARNING_RATE / TRAINING_BATCH;
+  bench_measure(bench_add(results, &count, 0, 0, "nn_update_weights"), BENCH_SAMPLES, bench_update_weights, &ctx);
+  ctx.learning_rate = LEARNING_RATE;
+  nn_free(ctx.gradient);
+  nn_free_activations(ctx.nn);
+
+  ctx.nn = nn_alloc_activations(model, 1);
+  matrix_from_bytes(NN_INPUT(ctx.nn), training.images);
+  nn_forward(ctx.nn);
+  ctx.gradient = nn_alloc_batch(arch, arch_count, 1);
+  matrix_copy(NN_OUTPUT(ctx.gradient), matrix_rows(ctx.delta, 0, 1));
+  bench_measure(bench_add(results, &count, 1, 2 * forward_flops, "nn_get_total_gradient 1"), BENCH_SAMPLES,
+                bench_total_gradient, &ctx);
+  nn_free(ctx.gradient);
+  nn_free_activations(ctx.nn);
+  free(ctx.delta.items);
+
+  ctx.nn = model;
+  bench_measure(bench_add(results, &count, 0, 0, "dataset_load"), BENCH_SAMPLES, bench_dataset_load, &ctx);
+  bench_measure(bench_add(results, &count, 0, 0, "nn_load"), BENCH_SAMPLES, bench_load, &ctx);
+  bench_measure(bench_add(results, &count, 0, 0, "nn_save"), BENCH_SAMPLES, bench_save, &ctx);
+  bench_measure(bench_add(results, &count, 0, 0, "nn_render"), BENCH_MACRO_SAMPLES, bench_render, &ctx);
+
+  ctx.pool = pool_create(threads);
+  ctx.render_cache = render_cache_create(olivec_canvas(canvas_pixels, RENDER_WIDTH, RENDER_HEIGHT, RENDER_WIDTH),
+                                         ctx.nn);
+  bench_measure(bench_add(results, &count, 0, 0, "render_cache_draw"), BENCH_SAMPLES, bench_render_cache, &ctx);
+  render_cache_free(ctx.render_cache);
+
+  ctx.nn = nn_alloc(arch, arch_count);
+  ctx.gradient = nn_alloc_batch(arch, arch_count, TRAINING_BATCH);
+  ctx.dataset = training;
+  size_t images = training.count / TRAINING_BATCH * TRAINING_BATCH;
+  bench_measure(bench_add(results, &count, images, images * 3 * forward_flops, "train epoch"), BENCH_MACRO_SAMPLES,
+                bench_train, &ctx);
+
+  snprintf(images_path, sizeof(images_path), "%stest_images", BENCH_PATH);
+  snprintf(labels_path, sizeof(labels_path), "%stest_labels", BENCH_PATH);
+  ctx.dataset = dataset_open("test", images_path, labels_path);
+  ctx.evaluator = nn_evaluator_alloc(nn_model(&ctx.nn), ctx.pool);
+  bench_measure(bench_add(results, &count, ctx.dataset.count, ctx.dataset.count * forward_flops, "test"),
+                BENCH_MACRO_SAMPLES, bench_test, &ctx);
+  NN_Evaluation evaluation;
+  nn_evaluate(&ctx.evaluator, ctx.dataset, &evaluation);
+  printf("Test accuracy after one synthetic epoch: %.2f %%\n",
+         (float) evaluation.correct * MAX_PERCENT / evaluation.count);
+
+  if (baseline_path != NULL) {
+    bench_read_baseline(baseline_path, results, count);
+  }
+  bench_print(results, count);
+
+  char results_path[MAX_FILEPATH_LEN];
+  time_t current_time = time(NULL);
+  char date_string[32];
+  strftime(date_string, sizeof(date_string), "%Y%m%d%H%M%S", localtime(&current_time));
+  snprintf(results_path, sizeof(results_path), "%s%s.json", BENCH_PATH, date_string);
+  bench_write(results_path, results, count, threads);
+  printf("The results have been saved to %s.\n", results_path);
+
+  nn_evaluator_free(ctx.evaluator);
+  dataset_free(ctx.dataset);
+  dataset_free(training);
+  nn_free(ctx.gradient);
+  nn_free(ctx.nn);
+  nn_free(model);
+  pool_destroy(ctx.pool);
+}
+
+#endif // BENCH_IMPLEMENTATION
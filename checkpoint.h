@@ -0,0 +1,297 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+// A checkpoint is a v2 model file whose tensors are the weights and biases, the optimizer state buffers and a
+// Checkpoint_State record, so it is checked and mapped by the same code as a model.
+typedef struct {
+  uint32_t optimizer;
+  uint32_t schedule;
+  float learning_rate;
+  uint32_t reserved;
+  uint64_t epochs;
+  uint64_t warmup;
+  uint64_t steps_per_epoch;
+  uint64_t step;
+  uint64_t rng;
+} Checkpoint_State;
+
+// Writes checkpoints on a background thread. The trainer copies the parameters and optimizer state into the payload
+// buffer and returns; the thread writes it to a temporary file and renames it over the checkpoint. While a write is in
+// flight further snapshots are postponed, never waited for.
+typedef struct {
+  char path[MAX_FILEPATH_LEN];
+  char temp_path[MAX_FILEPATH_LEN];
+  double interval;
+  double last;
+  uint32_t *arch;
+  size_t layer_count;
+  NN_Model_Tensor *tensors;
+  size_t tensor_count;
+  uint8_t *payload;
+  size_t payload_size;
+  size_t state_offset;
+  int pending;
+  int busy;
+  int stop;
+  size_t written;
+  size_t postponed;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t ready;
+} Checkpoint_Worker;
+
+Checkpoint_Worker *checkpoint_worker_create(NN nn, const Optimizer *optimizer, char *path, double interval);
+void checkpoint_worker_submit(void *context, NN nn, const Optimizer *optimizer);
+void checkpoint_worker_destroy(Checkpoint_Worker *worker);
+int checkpoint_load(char *path, size_t *arch, size_t arch_count, NN *nn, Optimizer *optimizer);
+
+#endif // CHECKPOINT_H_
+
+#ifdef CHECKPOINT_IMPLEMENTATION
+
+static double checkpoint_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void checkpoint_tensor(NN_Model_Tensor *tensor, uint32_t dtype, size_t rows, size_t cols, size_t item_size,
+                              size_t *offset)
+{
+  tensor->dtype = dtype;
+  tensor->rows = rows;
+  tensor->cols = cols;
+  tensor->offset = *offset;
+  tensor->size = rows * cols * item_size;
+  *offset = nn_model_align(*offset + tensor->size);
+}
+
+static void *checkpoint_worker_run(void *arg)
+{
+  Checkpoint_Worker *worker = arg;
+  NN_Model_Tensor *tensors = malloc(sizeof(*tensors) * worker->tensor_count);
+  assert(tensors != NULL);
+
+  pthread_mutex_lock(&worker->mutex);
+  for (;;) {
+    while (!worker->pending && !worker->stop) {
+      pthread_cond_wait(&worker->ready, &worker->mutex);
+    }
+    if (!worker->pending) {
+      break;
+    }
+    worker->pending = 0;
+    pthread_mutex_unlock(&worker->mutex);
+
+    double start = prof_now();
+    memcpy(tensors, worker->tensors, sizeof(*tensors) * worker->tensor_count);
+    nn_model_write_payload(worker->temp_path, NN_DTYPE_F32, worker->arch, worker->layer_count, tensors,
+                           worker->tensor_count, worker->payload, worker->payload_size);
+    if (rename(worker->temp_path, worker->path) != 0) {
+      fprintf(stderr, "Error saving the checkpoint.");
+      exit(1);
+    }
+    prof_emit("\"checkpoint\",\"path\":%s,\"bytes\":%zu,\"seconds\":%.6f", prof_quote(worker->path),
+              worker->payload_size, prof_now() - start);
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->busy = 0;
+    worker->written += 1;
+  }
+  pthread_mutex_unlock(&worker->mutex);
+  free(tensors);
+  return NULL;
+}
+
+// The payload mirrors the parameter arena first, so a snapshot is one copy per buffer. A checkpoint is due every
+// interval seconds.
+Checkpoint_Worker *checkpoint_worker_create(NN nn, const Optimizer *optimizer, char *path, double interval)
+{
+  Checkpoint_Worker *worker = calloc(1, sizeof(*worker));
+  assert(worker != NULL);
+  snprintf(worker->path, sizeof(worker->path), "%s", path);
+  snprintf(worker->temp_path, sizeof(worker->temp_path), "%s.tmp", path);
+  worker->interval = interval;
+  worker->last = checkpoint_now();
+
+  worker->layer_count = nn.count + 1;
+  worker->arch = malloc(sizeof(*worker->arch) * worker->layer_count);
+  assert(worker->arch != NULL);
+  for (size_t l = 0; l < worker->layer_count; ++l) {
+    worker->arch[l] = l == 0 ? nn.ws[0].rows : nn.ws[l-1].cols;
+  }
+
+  worker->tensor_count = 2 * nn.count + (optimizer->velocity != NULL) + (optimizer->second_moment != NULL) + 1;
+  worker->tensors = calloc(worker->tensor_count, sizeof(*worker->tensors));
+  assert(worker->tensors != NULL);
+  size_t t = 0;
+  for (; t < 2 * nn.count; ++t) {
+    Matrix matrix = (t % 2) == 0 ? nn.ws[t/2] : nn.bs[t/2];
+    size_t offset = (matrix.items - nn.params) * sizeof(float);
+    checkpoint_tensor(&worker->tensors[t], NN_DTYPE_F32, matrix.rows, matrix.cols, sizeof(float), &offset);
+  }
+  size_t offset = nn.param_count * sizeof(float);
+  if (optimizer->velocity != NULL) {
+    checkpoint_tensor(&worker->tensors[t++], NN_DTYPE_F32, 1, optimizer->count, sizeof(float), &offset);
+  }
+  if (optimizer->second_moment != NULL) {
+    checkpoint_tensor(&worker->tensors[t++], NN_DTYPE_F32, 1, optimizer->count, sizeof(float), &offset);
+  }
+  worker->state_offset = offset;
+  checkpoint_tensor(&worker->tensors[t++], NN_DTYPE_U8, 1, sizeof(Checkpoint_State), 1, &offset);
+  worker->payload_size = offset;
+  worker->payload = calloc(worker->payload_size, 1);
+  assert(worker->payload != NULL);
+
+  pthread_mutex_init(&worker->mutex, NULL);
+  pthread_cond_init(&worker->ready, NULL);
+  if (pthread_create(&worker->thread, NULL, checkpoint_worker_run, worker) != 0) {
+    fprintf(stderr, "Error creating a thread.");
+    exit(1);
+  }
+  return worker;
+}
+
+void checkpoint_worker_submit(void *context, NN nn, const Optimizer *optimizer)
+{
+  Checkpoint_Worker *worker = context;
+  if ((checkpoint_now() - worker->last) < worker->interval) {
+    return;
+  }
+
+  pthread_mutex_lock(&worker->mutex);
+  int busy = worker->busy;
+  worker->busy = 1;
+  pthread_mutex_unlock(&worker->mutex);
+  if (busy) {
+    worker->postponed += 1;
+    return;
+  }
+
+  size_t t = 2 * nn.count;
+  memcpy(worker->payload, nn.params, sizeof(float) * nn.param_count);
+  if (optimizer->velocity != NULL) {
+    memcpy(worker->payload + worker->tensors[t++].offset, optimizer->velocity, sizeof(float) * optimizer->count);
+  }
+  if (optimizer->second_moment != NULL) {
+    memcpy(worker->payload + worker->tensors[t++].offset, optimizer->second_moment, sizeof(float) * optimizer->count);
+  }
+  Checkpoint_State state;
+  memset(&state, 0, sizeof(state));
+  state.optimizer = optimizer->kind;
+  state.schedule = optimizer->schedule;
+  state.learning_rate = optimizer->learning_rate;
+  state.epochs = optimizer->epochs;
+  state.warmup = optimizer->warmup;
+  state.steps_per_epoch = optimizer->steps_per_epoch;
+  state.step = optimizer->step;
+  state.rng = nn_rng_state();
+  memcpy(worker->payload + worker->state_offset, &state, sizeof(state));
+  worker->last = checkpoint_now();
+
+  pthread_mutex_lock(&worker->mutex);
+  worker->pending = 1;
+  pthread_cond_signal(&worker->ready);
+  pthread_mutex_unlock(&worker->mutex);
+}
+
+// Finishes the write in flight, if any.
+void checkpoint_worker_destroy(Checkpoint_Worker *worker)
+{
+  pthread_mutex_lock(&worker->mutex);
+  worker->stop = 1;
+  pthread_cond_signal(&worker->ready);
+  pthread_mutex_unlock(&worker->mutex);
+  pthread_join(worker->thread, NULL);
+
+  printf("Wrote %zu checkpoint(s), postponed %zu.\n", worker->written, worker->postponed);
+
+  pthread_cond_destroy(&worker->ready);
+  pthread_mutex_destroy(&worker->mutex);
+  free(worker->payload);
+  free(worker->tensors);
+  free(worker->arch);
+  free(worker);
+}
+
+// Restores the weights, the optimizer and the random generator. The network must have the widths in arch.
+int checkpoint_load(char *path, size_t *arch, size_t arch_count, NN *result, Optimizer *optimizer)
+{
+  int file_descriptor = open(path, O_RDONLY);
+  if (file_descriptor == -1) {
+    fprintf(stderr, "Error loading the checkpoint.");
+    return 0;
+  }
+  struct stat st;
+  NN_Model_Header header;
+  if ((fstat(file_descriptor, &st) == -1) || !nn_model_header(file_descriptor, st.st_size, &header) ||
+      (header.dtype != NN_DTYPE_F32) || (header.layer_count != arch_count)) {
+    fprintf(stderr, "Invalid checkpoint.");
+    close(file_descriptor);
+    return 0;
+  }
+  size_t file_len = st.st_size;
+  uint8_t *map = nn_model_map(file_descriptor, file_len, header);
+  close(file_descriptor);
+  if (map == NULL) {
+    return 0;
+  }
+
+  const uint32_t *widths = (const uint32_t *) (map + sizeof(header));
+  const NN_Model_Tensor *tensors = (const NN_Model_Tensor *) (widths + header.layer_count);
+  const NN_Model_Tensor *state_tensor = &tensors[header.tensor_count - 1];
+  size_t layers = arch_count - 1;
+  int valid = (header.tensor_count >= 2 * layers + 1) &&
+              nn_model_tensor_check(header, state_tensor, NN_DTYPE_U8, 1, sizeof(Checkpoint_State), 1);
+  for (size_t l = 0; valid && (l < arch_count); ++l) {
+    valid = widths[l] == arch[l];
+  }
+
+  Checkpoint_State state;
+  if (valid) {
+    memcpy(&state, map + state_tensor->offset, sizeof(state));
+    valid = (state.optimizer < ARRAY_LEN(optim_kinds)) && (state.schedule < ARRAY_LEN(optim_schedules)) &&
+            (state.steps_per_epoch > 0) &&
+            (header.tensor_count == 2 * layers + (state.optimizer != OPTIM_SGD) + (state.optimizer == OPTIM_ADAM) + 1);
+  }
+  if (!valid) {
+    fprintf(stderr, "The checkpoint does not match the network.");
+    munmap(map, file_len);
+    return 0;
+  }
+
+  NN nn = nn_alloc(arch, arch_count);
+  Optimizer restored = optim_alloc(state.optimizer, state.schedule, state.learning_rate, state.epochs, state.warmup,
+                                   nn.param_count, state.steps_per_epoch);
+  float *buffers[] = {restored.velocity, restored.second_moment};
+  size_t t = 0;
+  for (; valid && (t < 2 * layers); ++t) {
+    Matrix matrix = (t % 2) == 0 ? nn.ws[t/2] : nn.bs[t/2];
+    valid = nn_model_tensor_check(header, &tensors[t], NN_DTYPE_F32, matrix.rows, matrix.cols, sizeof(float));
+    if (valid) {
+      memcpy(matrix.items, map + tensors[t].offset, tensors[t].size);
+    }
+  }
+  for (size_t b = 0; valid && (b < ARRAY_LEN(buffers)) && (buffers[b] != NULL); ++b, ++t) {
+    valid = nn_model_tensor_check(header, &tensors[t], NN_DTYPE_F32, 1, restored.count, sizeof(float));
+    if (valid) {
+      memcpy(buffers[b], map + tensors[t].offset, tensors[t].size);
+    }
+  }
+  munmap(map, file_len);
+  if (!valid) {
+    fprintf(stderr, "Invalid checkpoint tensor.");
+    optim_free(restored);
+    nn_free(nn);
+    return 0;
+  }
+
+  restored.step = state.step;
+  nn_rng_seed(state.rng);
+  *result = nn;
+  *optimizer = restored;
+  return 1;
+}
+
+#endif // CHECKPOINT_IMPLEMENTATION
@@ -0,0 +1,333 @@
+#ifndef CLASSIFY_H_
+#define CLASSIFY_H_
+
+// Bulk inference: classifies every image of a source and writes one result per image, in the order of the source.
+// The source is a directory of PGM files (P2 or P5, taken in name order), an IDX image file, or - for a stream of raw
+// IMAGE_UNIT_LEN byte frames on stdin. Each round every pool thread reads and decodes one batch, predicts it in a
+// single forward pass and formats its results, then the main thread writes the batches out in order.
+//
+// CSV output has one "image,digit,probability,..." row per image with the top digits first, the image being the file
+// name or the index in the source. Binary output is CLASSIFY_MAGIC and the top count as a uint32, then per image the
+// top digits as bytes followed by their probabilities as floats. An image that cannot be decoded is reported on stderr
+// and gets the digit -1 (255 in binary) with probability 0.
+#define CLASSIFY_MAGIC "NNCLASS"
+#define CLASSIFY_CSV 0
+#define CLASSIFY_BINARY 1
+#define CLASSIFY_ROW_LEN (2 * MAX_FILEPATH_LEN + 2 + DIGITS * 16)
+#define CLASSIFY_OUTPUT_BUFFER (1 << 20)
+
+void classify_run(NN nn, char *source, char *output_path, int format, size_t top, size_t threads);
+
+#endif // CLASSIFY_H_
+
+#ifdef CLASSIFY_IMPLEMENTATION
+
+typedef struct {
+  NN batch;
+  uint8_t *pixels;
+  uint8_t *valid;
+  size_t start;
+  size_t count;
+  char *out;
+  size_t out_len;
+} Classify_Batch;
+
+// names and directory are set for a directory source; images holds the frames from image images_start on otherwise.
+typedef struct {
+  Classify_Batch *batches;
+  char *directory;
+  char **names;
+  const uint8_t *images;
+  size_t images_start;
+  int format;
+  size_t top;
+} Classify;
+
+static int classify_name_compare(const void *a, const void *b)
+{
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+// The .pgm files of directory, sorted by name.
+static char **classify_list(char *directory, size_t *count)
+{
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    fprintf(stderr, "Error opening %s.", directory);
+    exit(1);
+  }
+  size_t cap = 1024;
+  char **names = malloc(sizeof(*names) * cap);
+  assert(names != NULL);
+  *count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    size_t len = strlen(entry->d_name);
+    if ((entry->d_name[0] == '.') || (len < 4) || (strcmp(entry->d_name + len - 4, ".pgm") != 0)) {
+      continue;
+    }
+    if (*count == cap) {
+      cap *= 2;
+      names = realloc(names, sizeof(*names) * cap);
+      assert(names != NULL);
+    }
+    names[*count] = strdup(entry->d_name);
+    assert(names[*count] != NULL);
+    *count += 1;
+  }
+  closedir(dir);
+  qsort(names, *count, sizeof(*names), classify_name_compare);
+  return names;
+}
+
+// Indices of the top digits of probabilities, most likely first.
+static void classify_top(const float *probabilities, size_t top, uint8_t *digits)
+{
+  uint8_t order[DIGITS];
+  for (size_t i = 0; i < DIGITS; ++i) {
+    order[i] = i;
+  }
+  for (size_t i = 0; i < top; ++i) {
+    size_t best = i;
+    for (size_t j = i + 1; j < DIGITS; ++j) {
+      if (probabilities[order[j]] > probabilities[order[best]]) {
+        best = j;
+      }
+    }
+    uint8_t swap = order[i];
+    order[i] = order[best];
+    order[best] = swap;
+    digits[i] = order[i];
+  }
+}
+
+// Writes text as a CSV field, quoted with its quotes doubled when it holds a separator, a quote or a line break.
+static size_t classify_csv_field(char *out, const char *text)
+{
+  if (strpbrk(text, ",\"\r\n") == NULL) {
+    return sprintf(out, "%s", text);
+  }
+  size_t len = 0;
+  out[len++] = '"';
+  for (; *text != '\0'; ++text) {
+    if (*text == '"') {
+      out[len++] = '"';
+    }
+    out[len++] = *text;
+  }
+  out[len++] = '"';
+  return len;
+}
+
+static void classify_format(Classify *classify, Classify_Batch *batch, size_t i, const float *probabilities)
+{
+  uint8_t digits[DIGITS];
+  size_t top = classify->top;
+  char *out = batch->out + batch->out_len;
+  if (batch->valid[i]) {
+    classify_top(probabilities, top, digits);
+  }
+
+  if (classify->format == CLASSIFY_BINARY) {
+    for (size_t t = 0; t < top; ++t) {
+      float probability = batch->valid[i] ? probabilities[digits[t]] : 0.0f;
+      out[t] = batch->valid[i] ? digits[t] : UINT8_MAX;
+      memcpy(out + top + t * sizeof(probability), &probability, sizeof(probability));
+    }
+    batch->out_len += top * (1 + sizeof(float));
+    return;
+  }
+
+  size_t len;
+  if (classify->names != NULL) {
+    len = classify_csv_field(out, classify->names[batch->start + i]);
+  } else {
+    len = snprintf(out, CLASSIFY_ROW_LEN, "%zu", batch->start + i);
+  }
+  for (size_t t = 0; t < top; ++t) {
+    if (batch->valid[i]) {
+      len += snprintf(out + len, CLASSIFY_ROW_LEN - len, ",%d,%.6f", digits[t], probabilities[digits[t]]);
+    } else {
+      len += snprintf(out + len, CLASSIFY_ROW_LEN - len, ",-1,0");
+    }
+  }
+  out[len++] = '\n';
+  batch->out_len += len;
+}
+
+static void classify_task(void *context, size_t thread_index, size_t thread_count)
+{
+  Classify *classify = context;
+  Classify_Batch *batch = &classify->batches[thread_index];
+  batch->out_len = 0;
+  if (batch->count == 0) {
+    return;
+  }
+
+  const uint8_t *pixels = batch->pixels;
+  if (classify->names != NULL) {
+    for (size_t i = 0; i < batch->count; ++i) {
+      char path[MAX_FILEPATH_LEN];
+      snprintf(path, sizeof(path), "%s/%s", classify->directory, classify->names[batch->start + i]);
+      uint8_t *image = &batch->pixels[i * IMAGE_UNIT_LEN];
+      batch->valid[i] = pgm_read(path, image, IMAGE_WIDTH, IMAGE_HEIGHT);
+      if (!batch->valid[i]) {
+        memset(image, 0, IMAGE_UNIT_LEN);
+      }
+    }
+  } else {
+    pixels = &classify->images[(batch->start - classify->images_start) * IMAGE_UNIT_LEN];
+    memset(batch->valid, 1, batch->count);
+  }
+
+  NN view = nn_rows(batch->batch, 0, batch->count);
+  matrix_from_bytes(NN_INPUT(view), pixels);
+  nn_predict(view);
+  for (size_t i = 0; i < batch->count; ++i) {
+    classify_format(classify, batch, i, &MATRIX_AT(NN_OUTPUT(view), i, 0));
+  }
+  free(view.as);
+}
+
+// Reads up to count frames from stdin, returning how many were whole.
+static size_t classify_read_frames(uint8_t *frames, size_t count)
+{
+  size_t len = fread(frames, 1, count * IMAGE_UNIT_LEN, stdin);
+  if ((len % IMAGE_UNIT_LEN) != 0) {
+    fprintf(stderr, "Ignoring a trailing partial frame of %zu bytes.\n", len % IMAGE_UNIT_LEN);
+  }
+  return len / IMAGE_UNIT_LEN;
+}
+
+void classify_run(NN nn, char *source, char *output_path, int format, size_t top, size_t threads)
+{
+  assert((top > 0) && (top <= DIGITS));
+  Classify classify;
+  memset(&classify, 0, sizeof(classify));
+  classify.format = format;
+  classify.top = top;
+
+  int from_stdin = strcmp(source, "-") == 0;
+  size_t total = 0;
+  Idx_File idx;
+  memset(&idx, 0, sizeof(idx));
+  struct stat st;
+  if (from_stdin) {
+    total = SIZE_MAX;
+  } else if ((stat(source, &st) == 0) && S_ISDIR(st.st_mode)) {
+    classify.directory = source;
+    classify.names = classify_list(source, &total);
+  } else {
+    idx = idx_open(source, IDX_IMAGES_TYPE);
+    if ((idx.dims_count != 3) || ((idx.dims[1] * idx.dims[2]) != IMAGE_UNIT_LEN)) {
+      fprintf(stderr, "%s does not hold %dx%d images.", source, IMAGE_WIDTH, IMAGE_HEIGHT);
+      exit(1);
+    }
+    classify.images = idx.data;
+    total = idx.dims[0];
+  }
+
+  FILE *output = stdout;
+  if (strcmp(output_path, "-") != 0) {
+    output = fopen(output_path, "wb");
+    if (output == NULL) {
+      fprintf(stderr, "Error opening %s.", output_path);
+      exit(1);
+    }
+  }
+  setvbuf(output, NULL, _IOFBF, CLASSIFY_OUTPUT_BUFFER);
+  FILE *log = output == stdout ? stderr : stdout;
+  if (format == CLASSIFY_BINARY) {
+    uint32_t top_count = top;
+    fwrite(CLASSIFY_MAGIC, 1, sizeof(CLASSIFY_MAGIC), output);
+    fwrite(&top_count, sizeof(top_count), 1, output);
+  } else {
+    fprintf(output, "image");
+    for (size_t t = 1; t <= top; ++t) {
+      fprintf(output, ",digit_%zu,probability_%zu", t, t);
+    }
+    fprintf(output, "\n");
+  }
+
+  Pool *pool = pool_create(threads);
+  classify.batches = calloc(pool->count, sizeof(*classify.batches));
+  assert(classify.batches != NULL);
+  for (size_t t = 0; t < pool->count; ++t) {
+    Classify_Batch *batch = &classify.batches[t];
+    batch->batch = nn_alloc_activations(nn, EVALUATION_BATCH);
+    batch->pixels = malloc(EVALUATION_BATCH * IMAGE_UNIT_LEN);
+    assert(batch->pixels != NULL);
+    batch->valid = malloc(EVALUATION_BATCH);
+    assert(batch->valid != NULL);
+    batch->out = malloc(EVALUATION_BATCH * CLASSIFY_ROW_LEN);
+    assert(batch->out != NULL);
+  }
+  size_t round_len = pool->count * EVALUATION_BATCH;
+  uint8_t *frames = NULL;
+  if (from_stdin) {
+    frames = malloc(round_len * IMAGE_UNIT_LEN);
+    assert(frames != NULL);
+    classify.images = frames;
+  }
+
+  double start = prof_now();
+  size_t done = 0;
+  size_t failed = 0;
+  while (done < total) {
+    size_t count = total - done < round_len ? total - done : round_len;
+    if (from_stdin) {
+      count = classify_read_frames(frames, round_len);
+      classify.images_start = done;
+      if (count == 0) {
+        break;
+      }
+    }
+    for (size_t t = 0; t < pool->count; ++t) {
+      size_t offset = t * EVALUATION_BATCH;
+      classify.batches[t].start = done + offset;
+      classify.batches[t].count = offset < count ? (count - offset < EVALUATION_BATCH ? count - offset :
+                                                    EVALUATION_BATCH) : 0;
+    }
+    pool_run(pool, classify_task, &classify);
+    for (size_t t = 0; t < pool->count; ++t) {
+      Classify_Batch *batch = &classify.batches[t];
+      for (size_t i = 0; (classify.names != NULL) && (i < batch->count); ++i) {
+        if (!batch->valid[i]) {
+          fprintf(stderr, "Error reading %s/%s.\n", classify.directory, classify.names[batch->start + i]);
+          failed += 1;
+        }
+      }
+      fwrite(batch->out, 1, batch->out_len, output);
+    }
+    done += count;
+  }
+  if ((fflush(output) != 0) || ((output != stdout) && (fclose(output) != 0))) {
+    fprintf(stderr, "Error writing %s.", output_path);
+    exit(1);
+  }
+  double seconds = prof_now() - start;
+  prof_emit("\"classify\",\"images\":%zu,\"failed\":%zu,\"seconds\":%.6f,\"images_per_sec\":%.1f", done, failed,
+            seconds, done / seconds);
+  fprintf(log, "Classified %zu image(s), %zu unreadable, in %.3f s (%.0f images/s).\n", done, failed, seconds,
+          done / seconds);
+
+  free(frames);
+  for (size_t t = 0; t < pool->count; ++t) {
+    Classify_Batch *batch = &classify.batches[t];
+    nn_free_activations(batch->batch);
+    free(batch->pixels);
+    free(batch->valid);
+    free(batch->out);
+  }
+  free(classify.batches);
+  for (size_t i = 0; (classify.names != NULL) && (i < total); ++i) {
+    free(classify.names[i]);
+  }
+  free(classify.names);
+  if (idx.map != NULL) {
+    munmap(idx.map, idx.map_len);
+  }
+  pool_destroy(pool);
+}
+
+#endif // CLASSIFY_IMPLEMENTATION
@@ -0,0 +1,618 @@
+#ifndef DATASET_H_
+#define DATASET_H_
+
+#define PREFETCH_SLOTS 3
+#define STREAM_CHUNK (8 << 20)
+
+// A streamed dataset has no images or labels in memory: window > 0 is the number of samples its shuffle window holds
+// and the samples are read from the files while training.
+typedef struct {
+  size_t count;
+  size_t image_len;
+  const uint8_t *images;
+  const uint8_t *labels;
+  void *images_map;
+  size_t images_map_len;
+  void *labels_map;
+  size_t labels_map_len;
+  char *images_path;
+  char *labels_path;
+  size_t window;
+} Dataset;
+
+typedef struct {
+  const uint8_t *data;
+  size_t dims[3];
+  size_t dims_count;
+  void *map;
+  size_t map_len;
+} Idx_File;
+
+uint32_t idx_u32(const uint8_t *bytes);
+Idx_File idx_open(char *path, uint32_t type);
+void idx_write(char *path, uint32_t type, const size_t *dims, size_t dims_count, const uint8_t *data);
+Dataset dataset_open(char *dataset_name, char *images_path, char *labels_path);
+Dataset dataset_load(char *dataset_name);
+Dataset dataset_stream(char *dataset_name, char *images_path, char *labels_path, size_t window_bytes);
+void dataset_free(Dataset dataset);
+
+// Reads a streamed dataset sequentially in STREAM_CHUNK pieces and hands out its samples in the order of a shuffle
+// window: every draw takes a random sample of the window and refills its place with the next sample of the files.
+typedef struct {
+  Dataset dataset;
+  int images_fd;
+  int labels_fd;
+  size_t images_start;
+  size_t labels_start;
+  uint8_t *images_chunk;
+  uint8_t *labels_chunk;
+  size_t chunk_capacity;
+  size_t chunk_count;
+  size_t chunk_next;
+  size_t read;
+  uint8_t *window_images;
+  uint8_t *window_labels;
+  size_t window_count;
+  uint64_t rng;
+} Dataset_Stream;
+
+// A training batch staged for the trainer: batch_size input rows already scaled to floats and their labels.
+typedef struct {
+  float *inputs;
+  uint8_t *labels;
+} Prefetch_Slot;
+
+// Gathers shuffled training batches on a background thread into a ring of PREFETCH_SLOTS staging buffers while the
+// trainer computes. Every epoch visits the images in a new permutation drawn from the seed and the epoch number, or
+// through the shuffle window of a streamed dataset, so a run resumed at any step sees the same batches. Steps are
+// counted from the start of training; the slot of a step stays valid until it is released.
+typedef struct {
+  Dataset dataset;
+  size_t batch_size;
+  size_t steps_per_epoch;
+  uint64_t seed;
+  size_t *permutation;
+  size_t permutation_epoch;
+  Dataset_Stream *stream;
+  Prefetch_Slot slots[PREFETCH_SLOTS];
+  size_t produced;
+  size_t consumed;
+  size_t end;
+  int stop;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+} Prefetcher;
+
+Prefetcher *prefetch_create(Dataset dataset, size_t batch_size, uint64_t seed, size_t step, size_t end);
+Prefetch_Slot *prefetch_acquire(Prefetcher *prefetcher);
+void prefetch_release(Prefetcher *prefetcher);
+void prefetch_destroy(Prefetcher *prefetcher);
+
+#endif // DATASET_H_
+
+#ifdef DATASET_IMPLEMENTATION
+
+uint32_t idx_u32(const uint8_t *bytes)
+{
+  return ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | (uint32_t) bytes[3];
+}
+
+Idx_File idx_open(char *path, uint32_t type)
+{
+  Idx_File idx;
+  memset(&idx, 0, sizeof(idx));
+
+  int file_descriptor = open(path, O_RDONLY);
+  if (file_descriptor == -1) {
+    fprintf(stderr, "Error opening %s.", path);
+    exit(1);
+  }
+
+  struct stat st;
+  if ((fstat(file_descriptor, &st) == -1) || (st.st_size < 4)) {
+    fprintf(stderr, "Error reading %s.", path);
+    exit(1);
+  }
+  idx.map_len = st.st_size;
+  idx.map = mmap(NULL, idx.map_len, PROT_READ, MAP_SHARED, file_descriptor, 0);
+  close(file_descriptor);
+  if (idx.map == MAP_FAILED) {
+    fprintf(stderr, "Error mapping %s.", path);
+    exit(1);
+  }
+
+  const uint8_t *bytes = idx.map;
+  if (idx_u32(bytes) != type) {
+    fprintf(stderr, "%s is not an IDX file of the expected type.", path);
+    exit(1);
+  }
+  idx.dims_count = bytes[3];
+  size_t header_len = 4 + (4 * idx.dims_count);
+  if ((idx.dims_count > ARRAY_LEN(idx.dims)) || (idx.map_len < header_len)) {
+    fprintf(stderr, "Invalid IDX header in %s.", path);
+    exit(1);
+  }
+
+  size_t data_len = 1;
+  for (size_t i = 0; i < idx.dims_count; ++i) {
+    idx.dims[i] = idx_u32(&bytes[4 + (4 * i)]);
+    data_len *= idx.dims[i];
+  }
+  if ((idx.map_len - header_len) < data_len) {
+    fprintf(stderr, "%s is truncated.", path);
+    exit(1);
+  }
+  idx.data = &bytes[header_len];
+  return idx;
+}
+
+void idx_write(char *path, uint32_t type, const size_t *dims, size_t dims_count, const uint8_t *data)
+{
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "Error opening %s.", path);
+    exit(1);
+  }
+
+  // The low byte of the type is the number of dimensions, as idx_open expects.
+  assert(((type & 0xFF) == dims_count) && (dims_count <= 3));
+  uint8_t header[4 + 4 * 3];
+  size_t header_len = 4 + (4 * dims_count);
+  size_t data_len = 1;
+  for (size_t i = 0; i <= dims_count; ++i) {
+    uint32_t value = i == 0 ? type : dims[i-1];
+    header[4*i] = value >> 24;
+    header[4*i+1] = value >> 16;
+    header[4*i+2] = value >> 8;
+    header[4*i+3] = value;
+    if (i > 0) {
+      data_len *= dims[i-1];
+    }
+  }
+  if ((fwrite(header, 1, header_len, file) != header_len) || (fwrite(data, 1, data_len, file) != data_len) ||
+      (fclose(file) != 0)) {
+    fprintf(stderr, "Error writing %s.", path);
+    exit(1);
+  }
+}
+
+Dataset dataset_open(char *dataset_name, char *images_path, char *labels_path)
+{
+  double start = prof_now();
+  Idx_File images = idx_open(images_path, IDX_IMAGES_TYPE);
+  Idx_File labels = idx_open(labels_path, IDX_LABELS_TYPE);
+
+  if ((images.dims[1] * images.dims[2]) != IMAGE_UNIT_LEN) {
+    fprintf(stderr, "Unexpected image size %zux%zu.", images.dims[1], images.dims[2]);
+    exit(1);
+  }
+  if (images.dims[0] != labels.dims[0]) {
+    fprintf(stderr, "The images and labels counts do not match.");
+    exit(1);
+  }
+  for (size_t i = 0; i < labels.dims[0]; ++i) {
+    if (labels.data[i] >= DIGITS) {
+      fprintf(stderr, "Invalid label %d.", labels.data[i]);
+      exit(1);
+    }
+  }
+
+  Dataset dataset;
+  memset(&dataset, 0, sizeof(dataset));
+  dataset.count = images.dims[0];
+  dataset.image_len = IMAGE_UNIT_LEN;
+  dataset.images = images.data;
+  dataset.labels = labels.data;
+  dataset.images_map = images.map;
+  dataset.images_map_len = images.map_len;
+  dataset.labels_map = labels.map;
+  dataset.labels_map_len = labels.map_len;
+  dataset.images_path = images_path;
+  dataset.labels_path = labels_path;
+  prof_emit("\"dataset_load\",\"dataset\":%s,\"images\":%zu,\"seconds\":%.6f", prof_quote(dataset_name),
+            dataset.count, prof_now() - start);
+  return dataset;
+}
+
+Dataset dataset_load(char *dataset_name)
+{
+  if (strcmp(dataset_name, "training") == 0) {
+    return dataset_open(dataset_name, TRAINING_IMAGES_PATH, TRAINING_LABELS_PATH);
+  } else if (strcmp(dataset_name, "test") == 0) {
+    return dataset_open(dataset_name, TEST_IMAGES_PATH, TEST_LABELS_PATH);
+  }
+  fprintf(stderr, "Unknown dataset.");
+  exit(1);
+}
+
+// Reads and checks the header of an IDX file without mapping it and returns the header length.
+static size_t idx_read_header(int file_descriptor, char *path, uint32_t type, size_t *dims)
+{
+  uint8_t header[4 + 4 * 3];
+  size_t dims_count = type & 0xFF;
+  size_t header_len = 4 + (4 * dims_count);
+  assert(dims_count <= 3);
+  struct stat st;
+  if ((fstat(file_descriptor, &st) == -1) || (pread(file_descriptor, header, header_len, 0) != (ssize_t) header_len)) {
+    fprintf(stderr, "Error reading %s.", path);
+    exit(1);
+  }
+  if (idx_u32(header) != type) {
+    fprintf(stderr, "%s is not an IDX file of the expected type.", path);
+    exit(1);
+  }
+  size_t data_len = 1;
+  for (size_t i = 0; i < dims_count; ++i) {
+    dims[i] = idx_u32(&header[4 + (4 * i)]);
+    data_len *= dims[i];
+  }
+  if (((size_t) st.st_size - header_len) < data_len) {
+    fprintf(stderr, "%s is truncated.", path);
+    exit(1);
+  }
+  return header_len;
+}
+
+static int idx_open_fd(char *path)
+{
+  int file_descriptor = open(path, O_RDONLY);
+  if (file_descriptor == -1) {
+    fprintf(stderr, "Error opening %s.", path);
+    exit(1);
+  }
+  return file_descriptor;
+}
+
+// Checks the headers of a dataset too large to map. The shuffle window holds as many samples as fit in window_bytes.
+Dataset dataset_stream(char *dataset_name, char *images_path, char *labels_path, size_t window_bytes)
+{
+  double start = prof_now();
+  size_t image_dims[3], label_dims[1];
+  int images_fd = idx_open_fd(images_path);
+  int labels_fd = idx_open_fd(labels_path);
+  idx_read_header(images_fd, images_path, IDX_IMAGES_TYPE, image_dims);
+  idx_read_header(labels_fd, labels_path, IDX_LABELS_TYPE, label_dims);
+  close(images_fd);
+  close(labels_fd);
+
+  if ((image_dims[1] * image_dims[2]) != IMAGE_UNIT_LEN) {
+    fprintf(stderr, "Unexpected image size %zux%zu.", image_dims[1], image_dims[2]);
+    exit(1);
+  }
+  if (image_dims[0] != label_dims[0]) {
+    fprintf(stderr, "The images and labels counts do not match.");
+    exit(1);
+  }
+
+  Dataset dataset;
+  memset(&dataset, 0, sizeof(dataset));
+  dataset.count = image_dims[0];
+  dataset.image_len = IMAGE_UNIT_LEN;
+  dataset.images_path = images_path;
+  dataset.labels_path = labels_path;
+  dataset.window = window_bytes / (IMAGE_UNIT_LEN + 1);
+  if (dataset.window > dataset.count) {
+    dataset.window = dataset.count;
+  }
+  if (dataset.window == 0) {
+    fprintf(stderr, "The shuffle window is too small.");
+    exit(1);
+  }
+  prof_emit("\"dataset_load\",\"dataset\":%s,\"images\":%zu,\"window\":%zu,\"seconds\":%.6f",
+            prof_quote(dataset_name), dataset.count, dataset.window, prof_now() - start);
+  return dataset;
+}
+
+void dataset_free(Dataset dataset)
+{
+  if (dataset.images_map != NULL) {
+    munmap(dataset.images_map, dataset.images_map_len);
+  }
+  if (dataset.labels_map != NULL) {
+    munmap(dataset.labels_map, dataset.labels_map_len);
+  }
+}
+
+static void stream_pread(int file_descriptor, char *path, uint8_t *buf, size_t len, size_t offset)
+{
+  while (len > 0) {
+    ssize_t n = pread(file_descriptor, buf, len, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      fprintf(stderr, "Error reading %s.", path);
+      exit(1);
+    }
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+}
+
+// Reads the next chunk of both files, tells the kernel to drop the pages just copied and to read the next chunk
+// ahead, so the page cache does not grow with the dataset.
+static void stream_fill(Dataset_Stream *stream)
+{
+  Dataset dataset = stream->dataset;
+  size_t count = dataset.count - stream->read;
+  count = count < stream->chunk_capacity ? count : stream->chunk_capacity;
+  size_t images_offset = stream->images_start + stream->read * dataset.image_len;
+  size_t labels_offset = stream->labels_start + stream->read;
+  stream_pread(stream->images_fd, dataset.images_path, stream->images_chunk, count * dataset.image_len, images_offset);
+  stream_pread(stream->labels_fd, dataset.labels_path, stream->labels_chunk, count, labels_offset);
+  posix_fadvise(stream->images_fd, images_offset, count * dataset.image_len, POSIX_FADV_DONTNEED);
+  posix_fadvise(stream->labels_fd, labels_offset, count, POSIX_FADV_DONTNEED);
+  posix_fadvise(stream->images_fd, images_offset + count * dataset.image_len,
+                stream->chunk_capacity * dataset.image_len, POSIX_FADV_WILLNEED);
+  posix_fadvise(stream->labels_fd, labels_offset + count, stream->chunk_capacity, POSIX_FADV_WILLNEED);
+
+  for (size_t i = 0; i < count; ++i) {
+    if (stream->labels_chunk[i] >= DIGITS) {
+      fprintf(stderr, "Invalid label %d.", stream->labels_chunk[i]);
+      exit(1);
+    }
+  }
+  stream->chunk_count = count;
+  stream->chunk_next = 0;
+  stream->read += count;
+}
+
+static int stream_read(Dataset_Stream *stream, const uint8_t **image, uint8_t *label)
+{
+  if (stream->chunk_next == stream->chunk_count) {
+    if (stream->read == stream->dataset.count) {
+      return 0;
+    }
+    stream_fill(stream);
+  }
+  *image = &stream->images_chunk[stream->chunk_next * stream->dataset.image_len];
+  *label = stream->labels_chunk[stream->chunk_next];
+  stream->chunk_next += 1;
+  return 1;
+}
+
+static Dataset_Stream *stream_open(Dataset dataset)
+{
+  Dataset_Stream *stream = calloc(1, sizeof(*stream));
+  assert(stream != NULL);
+  stream->dataset = dataset;
+  stream->images_fd = idx_open_fd(dataset.images_path);
+  stream->labels_fd = idx_open_fd(dataset.labels_path);
+  size_t dims[3];
+  stream->images_start = idx_read_header(stream->images_fd, dataset.images_path, IDX_IMAGES_TYPE, dims);
+  stream->labels_start = idx_read_header(stream->labels_fd, dataset.labels_path, IDX_LABELS_TYPE, dims);
+  posix_fadvise(stream->images_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(stream->labels_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  stream->chunk_capacity = STREAM_CHUNK / dataset.image_len;
+  stream->images_chunk = malloc(stream->chunk_capacity * dataset.image_len);
+  assert(stream->images_chunk != NULL);
+  stream->labels_chunk = malloc(stream->chunk_capacity);
+  assert(stream->labels_chunk != NULL);
+  stream->window_images = malloc(dataset.window * dataset.image_len);
+  assert(stream->window_images != NULL);
+  stream->window_labels = malloc(dataset.window);
+  assert(stream->window_labels != NULL);
+  return stream;
+}
+
+// Starts an epoch: reads from the beginning of the files again and fills the window.
+static void stream_rewind(Dataset_Stream *stream, uint64_t seed)
+{
+  stream->read = 0;
+  stream->chunk_count = 0;
+  stream->chunk_next = 0;
+  stream->rng = seed;
+  stream->window_count = 0;
+  const uint8_t *image;
+  uint8_t label;
+  while ((stream->window_count < stream->dataset.window) && stream_read(stream, &image, &label)) {
+    memcpy(&stream->window_images[stream->window_count * stream->dataset.image_len], image, stream->dataset.image_len);
+    stream->window_labels[stream->window_count] = label;
+    stream->window_count += 1;
+  }
+}
+
+// Takes a random sample out of the window into row and label, or only drops it when row is NULL.
+static void stream_draw(Dataset_Stream *stream, float *row, uint8_t *label)
+{
+  size_t image_len = stream->dataset.image_len;
+  assert(stream->window_count > 0);
+  size_t j = nn_splitmix64(&stream->rng) % stream->window_count;
+  uint8_t *window_image = &stream->window_images[j * image_len];
+  if (row != NULL) {
+    for (size_t p = 0; p < image_len; ++p) {
+      row[p] = (float) window_image[p] / MAX_BRIGHTNESS;
+    }
+    *label = stream->window_labels[j];
+  }
+
+  const uint8_t *image;
+  uint8_t next_label;
+  if (stream_read(stream, &image, &next_label)) {
+    memcpy(window_image, image, image_len);
+    stream->window_labels[j] = next_label;
+  } else {
+    stream->window_count -= 1;
+    memcpy(window_image, &stream->window_images[stream->window_count * image_len], image_len);
+    stream->window_labels[j] = stream->window_labels[stream->window_count];
+  }
+}
+
+static void stream_close(Dataset_Stream *stream)
+{
+  close(stream->images_fd);
+  close(stream->labels_fd);
+  free(stream->images_chunk);
+  free(stream->labels_chunk);
+  free(stream->window_images);
+  free(stream->window_labels);
+  free(stream);
+}
+
+static uint64_t prefetch_epoch_seed(Prefetcher *prefetcher, size_t epoch)
+{
+  return prefetcher->seed ^ (epoch * 0xD1B54A32D192ED03ULL);
+}
+
+// Fisher-Yates with a generator seeded from the epoch, so any epoch can be drawn without the ones before it.
+static void prefetch_shuffle(Prefetcher *prefetcher, size_t epoch)
+{
+  uint64_t state = prefetch_epoch_seed(prefetcher, epoch);
+  size_t count = prefetcher->dataset.count;
+  for (size_t i = 0; i < count; ++i) {
+    prefetcher->permutation[i] = i;
+  }
+  for (size_t i = count - 1; i > 0; --i) {
+    size_t j = nn_splitmix64(&state) % (i + 1);
+    size_t swap = prefetcher->permutation[i];
+    prefetcher->permutation[i] = prefetcher->permutation[j];
+    prefetcher->permutation[j] = swap;
+  }
+  prefetcher->permutation_epoch = epoch;
+}
+
+static void prefetch_gather(Prefetcher *prefetcher, Prefetch_Slot *slot, size_t step)
+{
+  size_t epoch = step / prefetcher->steps_per_epoch;
+  if (prefetcher->stream != NULL) {
+    if (epoch != prefetcher->permutation_epoch) {
+      stream_rewind(prefetcher->stream, prefetch_epoch_seed(prefetcher, epoch));
+      prefetcher->permutation_epoch = epoch;
+    }
+    for (size_t i = 0; i < prefetcher->batch_size; ++i) {
+      stream_draw(prefetcher->stream, &slot->inputs[i * prefetcher->dataset.image_len], &slot->labels[i]);
+    }
+    return;
+  }
+
+  if (epoch != prefetcher->permutation_epoch) {
+    prefetch_shuffle(prefetcher, epoch);
+  }
+  Dataset dataset = prefetcher->dataset;
+  const size_t *indices = &prefetcher->permutation[(step % prefetcher->steps_per_epoch) * prefetcher->batch_size];
+  for (size_t i = 0; i < prefetcher->batch_size; ++i) {
+    const uint8_t *image = &dataset.images[indices[i] * dataset.image_len];
+    float *row = &slot->inputs[i * dataset.image_len];
+    for (size_t p = 0; p < dataset.image_len; ++p) {
+      row[p] = (float) image[p] / MAX_BRIGHTNESS;
+    }
+    slot->labels[i] = dataset.labels[indices[i]];
+  }
+}
+
+static void *prefetch_run(void *arg)
+{
+  Prefetcher *prefetcher = arg;
+
+  // A streamed epoch can only be replayed from its start, so a resumed run draws the batches it already trained on.
+  size_t first = prefetcher->produced;
+  if ((prefetcher->stream != NULL) && (first < prefetcher->end) && ((first % prefetcher->steps_per_epoch) != 0)) {
+    size_t epoch = first / prefetcher->steps_per_epoch;
+    stream_rewind(prefetcher->stream, prefetch_epoch_seed(prefetcher, epoch));
+    prefetcher->permutation_epoch = epoch;
+    for (size_t i = 0; i < (first % prefetcher->steps_per_epoch) * prefetcher->batch_size; ++i) {
+      stream_draw(prefetcher->stream, NULL, NULL);
+    }
+  }
+
+  pthread_mutex_lock(&prefetcher->mutex);
+  while (!prefetcher->stop && (prefetcher->produced < prefetcher->end)) {
+    if ((prefetcher->produced - prefetcher->consumed) == PREFETCH_SLOTS) {
+      pthread_cond_wait(&prefetcher->changed, &prefetcher->mutex);
+      continue;
+    }
+    size_t step = prefetcher->produced;
+    pthread_mutex_unlock(&prefetcher->mutex);
+
+    prefetch_gather(prefetcher, &prefetcher->slots[step % PREFETCH_SLOTS], step);
+
+    pthread_mutex_lock(&prefetcher->mutex);
+    prefetcher->produced += 1;
+    pthread_cond_broadcast(&prefetcher->changed);
+  }
+  pthread_mutex_unlock(&prefetcher->mutex);
+  return NULL;
+}
+
+// Prefetches the steps from step up to end. The images past the last full batch of an epoch are skipped.
+Prefetcher *prefetch_create(Dataset dataset, size_t batch_size, uint64_t seed, size_t step, size_t end)
+{
+  assert((batch_size > 0) && (dataset.count >= batch_size));
+  Prefetcher *prefetcher = calloc(1, sizeof(*prefetcher));
+  assert(prefetcher != NULL);
+  prefetcher->dataset = dataset;
+  prefetcher->batch_size = batch_size;
+  prefetcher->steps_per_epoch = dataset.count / batch_size;
+  prefetcher->seed = seed;
+  if (dataset.window > 0) {
+    prefetcher->stream = stream_open(dataset);
+  } else {
+    prefetcher->permutation = malloc(sizeof(*prefetcher->permutation) * dataset.count);
+    assert(prefetcher->permutation != NULL);
+  }
+  prefetcher->permutation_epoch = SIZE_MAX;
+  for (size_t s = 0; s < PREFETCH_SLOTS; ++s) {
+    prefetcher->slots[s].inputs = nn_arena_alloc(batch_size * dataset.image_len);
+    prefetcher->slots[s].labels = malloc(batch_size);
+    assert(prefetcher->slots[s].labels != NULL);
+  }
+  prefetcher->produced = step;
+  prefetcher->consumed = step;
+  prefetcher->end = end;
+
+  pthread_mutex_init(&prefetcher->mutex, NULL);
+  pthread_cond_init(&prefetcher->changed, NULL);
+  if (pthread_create(&prefetcher->thread, NULL, prefetch_run, prefetcher) != 0) {
+    fprintf(stderr, "Error creating a thread.");
+    exit(1);
+  }
+  return prefetcher;
+}
+
+// Waits for the batch of the next step.
+Prefetch_Slot *prefetch_acquire(Prefetcher *prefetcher)
+{
+  pthread_mutex_lock(&prefetcher->mutex);
+  assert(prefetcher->consumed < prefetcher->end);
+  while (prefetcher->produced == prefetcher->consumed) {
+    pthread_cond_wait(&prefetcher->changed, &prefetcher->mutex);
+  }
+  Prefetch_Slot *slot = &prefetcher->slots[prefetcher->consumed % PREFETCH_SLOTS];
+  pthread_mutex_unlock(&prefetcher->mutex);
+  return slot;
+}
+
+// Hands the slot of the current step back for refilling.
+void prefetch_release(Prefetcher *prefetcher)
+{
+  pthread_mutex_lock(&prefetcher->mutex);
+  prefetcher->consumed += 1;
+  pthread_cond_broadcast(&prefetcher->changed);
+  pthread_mutex_unlock(&prefetcher->mutex);
+}
+
+void prefetch_destroy(Prefetcher *prefetcher)
+{
+  pthread_mutex_lock(&prefetcher->mutex);
+  prefetcher->stop = 1;
+  pthread_cond_broadcast(&prefetcher->changed);
+  pthread_mutex_unlock(&prefetcher->mutex);
+  pthread_join(prefetcher->thread, NULL);
+
+  pthread_cond_destroy(&prefetcher->changed);
+  pthread_mutex_destroy(&prefetcher->mutex);
+  for (size_t s = 0; s < PREFETCH_SLOTS; ++s) {
+    free(prefetcher->slots[s].inputs);
+    free(prefetcher->slots[s].labels);
+  }
+  if (prefetcher->stream != NULL) {
+    stream_close(prefetcher->stream);
+  }
+  free(prefetcher->permutation);
+  free(prefetcher);
+}
+
+#endif // DATASET_IMPLEMENTATION
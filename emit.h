@@ -0,0 +1,129 @@
+#ifndef EMIT_H_
+#define EMIT_H_
+
+void emit_c(NN nn, char *model_name, char *path);
+
+#endif // EMIT_H_
+
+#ifdef EMIT_IMPLEMENTATION
+
+#define EMIT_MACRO_PREFIX "NN_GENERATED"
+#define EMIT_PREFIX "nn_generated"
+#define EMIT_VALUES_PER_LINE 8
+
+static void emit_floats(FILE *out, const float *values, size_t count, float scale)
+{
+  for (size_t i = 0; i < count; ++i) {
+    if ((i % EMIT_VALUES_PER_LINE) == 0) {
+      fprintf(out, "\n   ");
+    }
+    fprintf(out, " %.9ef,", values[i] * scale);
+  }
+}
+
+// Writes a standalone C file with the weights of nn as static const arrays and a forward function whose loops all
+// have constant bounds. The 1 / 255 pixel scale is folded into the first layer, so the function takes the raw bytes.
+void emit_c(NN nn, char *model_name, char *path)
+{
+  printf("Generating the C source...\n");
+
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Error opening the file.");
+    exit(1);
+  }
+
+  size_t inputs = nn.ws[0].rows;
+  size_t outputs = nn.ws[nn.count-1].cols;
+
+  fprintf(out, "// Generated by ./main -emit-c %s\n", model_name);
+  fprintf(out, "// Architecture: %zu", inputs);
+  for (size_t l = 0; l < nn.count; ++l) {
+    fprintf(out, "x%zu", nn.ws[l].cols);
+  }
+  fprintf(out, "\n//\n");
+  fprintf(out, "// void %s_predict(const unsigned char pixels[%zu], float probabilities[%zu]);\n", EMIT_PREFIX,
+          inputs, outputs);
+  fprintf(out, "//\n");
+  fprintf(out, "// Takes the pixels as bytes (0..255) and writes the softmax probabilities of the digits.\n");
+  fprintf(out, "// Needs no allocation, no file access and no global state beyond the weights below.\n\n");
+  fprintf(out, "#include <math.h>\n\n");
+  fprintf(out, "#define %s_INPUTS %zu\n", EMIT_MACRO_PREFIX, inputs);
+  fprintf(out, "#define %s_OUTPUTS %zu\n", EMIT_MACRO_PREFIX, outputs);
+  fprintf(out, "#define %s_ALIGNED __attribute__((aligned(64)))\n\n", EMIT_MACRO_PREFIX);
+
+  for (size_t l = 0; l < nn.count; ++l) {
+    float scale = l == 0 ? 1.0f / MAX_BRIGHTNESS : 1.0f;
+    fprintf(out, "static const float %s_w%zu[%zu][%zu] %s_ALIGNED = {", EMIT_PREFIX, l, nn.ws[l].rows, nn.ws[l].cols,
+            EMIT_MACRO_PREFIX);
+    for (size_t k = 0; k < nn.ws[l].rows; ++k) {
+      fprintf(out, "\n  {");
+      emit_floats(out, &MATRIX_AT(nn.ws[l], k, 0), nn.ws[l].cols, scale);
+      fprintf(out, "\n  },");
+    }
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "static const float %s_b%zu[%zu] %s_ALIGNED = {", EMIT_PREFIX, l, nn.bs[l].cols, EMIT_MACRO_PREFIX);
+    emit_floats(out, nn.bs[l].items, nn.bs[l].cols, 1.0f);
+    fprintf(out, "\n};\n\n");
+  }
+
+  fprintf(out, "void %s_predict(const unsigned char pixels[%zu], float probabilities[%zu])\n", EMIT_PREFIX, inputs,
+          outputs);
+  fprintf(out, "{\n");
+  for (size_t l = 1; l < nn.count; ++l) {
+    fprintf(out, "  float a%zu[%zu] %s_ALIGNED;\n", l, nn.ws[l].rows, EMIT_MACRO_PREFIX);
+  }
+  fprintf(out, "  float *a%zu = probabilities;\n", nn.count);
+
+  for (size_t l = 0; l < nn.count; ++l) {
+    size_t k = nn.ws[l].rows;
+    size_t n = nn.ws[l].cols;
+    fprintf(out, "\n");
+    fprintf(out, "  for (int j = 0; j < %zu; ++j) {\n", n);
+    fprintf(out, "    a%zu[j] = %s_b%zu[j];\n", l + 1, EMIT_PREFIX, l);
+    fprintf(out, "  }\n");
+    fprintf(out, "  for (int k = 0; k < %zu; ++k) {\n", k);
+    if (l == 0) {
+      // Most pixels are background, skipping them saves whole rows of the widest layer.
+      fprintf(out, "    if (pixels[k] == 0) {\n");
+      fprintf(out, "      continue;\n");
+      fprintf(out, "    }\n");
+      fprintf(out, "    const float x = pixels[k];\n");
+    } else {
+      fprintf(out, "    const float x = a%zu[k];\n", l);
+    }
+    fprintf(out, "    for (int j = 0; j < %zu; ++j) {\n", n);
+    fprintf(out, "      a%zu[j] += x * %s_w%zu[k][j];\n", l + 1, EMIT_PREFIX, l);
+    fprintf(out, "    }\n");
+    fprintf(out, "  }\n");
+    if ((l + 1) < nn.count) {
+      fprintf(out, "  for (int j = 0; j < %zu; ++j) {\n", n);
+      fprintf(out, "    a%zu[j] = 1.0f / (1.0f + expf(-a%zu[j]));\n", l + 1, l + 1);
+      fprintf(out, "  }\n");
+    }
+  }
+
+  fprintf(out, "\n");
+  fprintf(out, "  float max_value = a%zu[0];\n", nn.count);
+  fprintf(out, "  for (int j = 1; j < %zu; ++j) {\n", outputs);
+  fprintf(out, "    max_value = a%zu[j] > max_value ? a%zu[j] : max_value;\n", nn.count, nn.count);
+  fprintf(out, "  }\n");
+  fprintf(out, "  float sum = 0.0f;\n");
+  fprintf(out, "  for (int j = 0; j < %zu; ++j) {\n", outputs);
+  fprintf(out, "    a%zu[j] = expf(a%zu[j] - max_value);\n", nn.count, nn.count);
+  fprintf(out, "    sum += a%zu[j];\n", nn.count);
+  fprintf(out, "  }\n");
+  fprintf(out, "  for (int j = 0; j < %zu; ++j) {\n", outputs);
+  fprintf(out, "    a%zu[j] /= sum;\n", nn.count);
+  fprintf(out, "  }\n");
+  fprintf(out, "}\n");
+
+  if (fclose(out) != 0) {
+    fprintf(stderr, "Error writing the file.");
+    exit(1);
+  }
+  printf("The C source has been saved as %s.\n", path);
+}
+
+#endif // EMIT_IMPLEMENTATION
@@ -0,0 +1,683 @@
+#ifndef GEMM_H_
+#define GEMM_H_
+
+// c (m x n) = a (m x k) * b (k x n)
+// a(i, p) is read from a[i * a_rs + p * a_cs], so a transposed operand is just a swap of the two strides.
+// b and c are row-major with row strides ldb and ldc.
+void gemm(size_t m, size_t n, size_t k, const float *a, size_t a_rs, size_t a_cs,
+          const float *b, size_t ldb, float *c, size_t ldc);
+void gemm_fused(size_t m, size_t n, size_t k, const float *a, size_t a_rs, size_t a_cs,
+                const float *b, size_t ldb, float *c, size_t ldc, const float *bias, int activation);
+int gemm_sparse(size_t m, size_t n, size_t k, const float *a, size_t lda, const float *b, size_t ldb, float *c,
+                size_t ldc, const float *bias, int activation);
+int gemm_sparse_at(size_t m, size_t n, size_t k, const float *a, size_t lda, const float *d, size_t ldd, float *c,
+                   size_t ldc);
+void gemm_init(void);
+const char *gemm_kernel_name(void);
+
+#define GEMM_KC 256
+#define GEMM_SPARSE_DENSITY 0.5f
+
+#define GEMM_LINEAR 0
+#define GEMM_SIGMOID 1
+
+#endif // GEMM_H_
+
+#ifdef GEMM_IMPLEMENTATION
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GEMM_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*Gemm_Kernel)(size_t m, size_t n, size_t k, const float *a, size_t a_rs, size_t a_cs,
+                            const float *b, size_t ldb, float *c, size_t ldc, const float *bias, int activation);
+
+// One row of a sparse product, given the count nonzero values of the row of a and their columns: c = activation(sum of
+// values[t] * b row columns[t] + bias) for gather, c row columns[t] += values[t] * d for scatter.
+typedef void (*Gemm_Gather_Kernel)(size_t n, const float *values, const uint32_t *columns, size_t count,
+                                   const float *b, size_t ldb, float *c, const float *bias, int activation);
+typedef void (*Gemm_Scatter_Kernel)(size_t n, const float *values, const uint32_t *columns, size_t count,
+                                    const float *d, float *c, size_t ldc);
+// Writes the nonzero entries of a row of a (k wide) and their columns, returning their count.
+typedef size_t (*Gemm_Compress_Kernel)(size_t k, const float *a, float *values, uint32_t *columns);
+
+static Gemm_Kernel gemm_kernel = NULL;
+static Gemm_Gather_Kernel gemm_gather_kernel = NULL;
+static Gemm_Scatter_Kernel gemm_scatter_kernel = NULL;
+static Gemm_Compress_Kernel gemm_compress_kernel = NULL;
+static const char *gemm_name = "none";
+static float gemm_sparse_density = GEMM_SPARSE_DENSITY;
+
+static void gemm_scalar(size_t m, size_t n, size_t k, const float *a, size_t a_rs, size_t a_cs,
+                        const float *b, size_t ldb, float *c, size_t ldc, const float *bias, int activation)
+{
+  for (size_t i = 0; i < m; ++i) {
+    float *ci = c + i * ldc;
+    for (size_t j = 0; j < n; ++j) {
+      ci[j] = 0;
+    }
+    for (size_t p = 0; p < k; ++p) {
+      float aip = a[i * a_rs + p * a_cs];
+      const float *bp = b + p * ldb;
+      for (size_t j = 0; j < n; ++j) {
+        ci[j] += aip * bp[j];
+      }
+    }
+    for (size_t j = 0; (bias != NULL) && (j < n); ++j) {
+      ci[j] += bias[j];
+    }
+    for (size_t j = 0; (activation == GEMM_SIGMOID) && (j < n); ++j) {
+      ci[j] = vmath_sigmoidf(ci[j]);
+    }
+  }
+}
+
+static void gemm_gather_scalar(size_t n, const float *values, const uint32_t *columns, size_t count,
+                               const float *b, size_t ldb, float *c, const float *bias, int activation)
+{
+  for (size_t j = 0; j < n; ++j) {
+    c[j] = bias != NULL ? bias[j] : 0.0f;
+  }
+  for (size_t t = 0; t < count; ++t) {
+    const float *bp = b + columns[t] * ldb;
+    for (size_t j = 0; j < n; ++j) {
+      c[j] += values[t] * bp[j];
+    }
+  }
+  for (size_t j = 0; (activation == GEMM_SIGMOID) && (j < n); ++j) {
+    c[j] = vmath_sigmoidf(c[j]);
+  }
+}
+
+static size_t gemm_compress_scalar(size_t k, const float *a, float *values, uint32_t *columns)
+{
+  size_t count = 0;
+  for (size_t p = 0; p < k; ++p) {
+    values[count] = a[p];
+    columns[count] = p;
+    count += a[p] != 0.0f;
+  }
+  return count;
+}
+
+static void gemm_scatter_scalar(size_t n, const float *values, const uint32_t *columns, size_t count,
+                                const float *d, float *c, size_t ldc)
+{
+  for (size_t t = 0; t < count; ++t) {
+    float *cp = c + columns[t] * ldc;
+    for (size_t j = 0; j < n; ++j) {
+      cp[j] += values[t] * d[j];
+    }
+  }
+}
+
+#ifdef GEMM_X86
+
+// The epilogues add the bias and apply the activation to a finished tile while it is still in registers.
+__attribute__((target("sse2")))
+static inline __m128 gemm_epilogue_sse2(__m128 acc, const float *bias, int activation)
+{
+  if (bias != NULL) {
+    acc = _mm_add_ps(acc, _mm_loadu_ps(bias));
+  }
+  return activation == GEMM_SIGMOID ? vmath_sigmoid_sse2(acc) : acc;
+}
+
+// 4x8 register tile of two xmm accumulators per row. Column tails narrower than 8 go through gemm_scalar.
+__attribute__((target("sse2")))
+static void gemm_sse2(size_t m, size_t n, size_t k, const float *a, size_t a_rs, size_t a_cs,
+                      const float *b, size_t ldb, float *c, size_t ldc, const float *bias, int activation)
+{
+  size_t n_main = n - (n % 8);
+  for (size_t p0 = 0; p0 < k; p0 += GEMM_KC) {
+    size_t kc = (k - p0) < GEMM_KC ? (k - p0) : GEMM_KC;
+    int last = (p0 + kc) == k;
+    for (size_t j = 0; j < n_main; j += 8) {
+      const float *bj = bias != NULL ? bias + j : NULL;
+      size_t i = 0;
+      for (; (i + 4) <= m; i += 4) {
+        __m128 acc[4][2];
+        for (size_t r = 0; r < 4; ++r) {
+          float *cr = c + (i + r) * ldc + j;
+          acc[r][0] = p0 ? _mm_loadu_ps(cr) : _mm_setzero_ps();
+          acc[r][1] = p0 ? _mm_loadu_ps(cr + 4) : _mm_setzero_ps();
+        }
+        const float *ap = a + i * a_rs + p0 * a_cs;
+        const float *bp = b + p0 * ldb + j;
+        for (size_t p = 0; p < kc; ++p) {
+          __m128 b0 = _mm_loadu_ps(bp);
+          __m128 b1 = _mm_loadu_ps(bp + 4);
+          for (size_t r = 0; r < 4; ++r) {
+            __m128 ar = _mm_set1_ps(ap[r * a_rs]);
+            acc[r][0] = _mm_add_ps(acc[r][0], _mm_mul_ps(ar, b0));
+            acc[r][1] = _mm_add_ps(acc[r][1], _mm_mul_ps(ar, b1));
+          }
+          ap += a_cs;
+          bp += ldb;
+        }
+        for (size_t r = 0; r < 4; ++r) {
+          float *cr = c + (i + r) * ldc + j;
+          if (last) {
+            acc[r][0] = gemm_epilogue_sse2(acc[r][0], bj, activation);
+            acc[r][1] = gemm_epilogue_sse2(acc[r][1], bj != NULL ? bj + 4 : NULL, activation);
+          }
+          _mm_storeu_ps(cr, acc[r][0]);
+          _mm_storeu_ps(cr + 4, acc[r][1]);
+        }
+      }
+      for (; i < m; ++i) {
+        float *cr = c + i * ldc + j;
+        __m128 acc0 = p0 ? _mm_loadu_ps(cr) : _mm_setzero_ps();
+        __m128 acc1 = p0 ? _mm_loadu_ps(cr + 4) : _mm_setzero_ps();
+        const float *ap = a + i * a_rs + p0 * a_cs;
+        const float *bp = b + p0 * ldb + j;
+        for (size_t p = 0; p < kc; ++p) {
+          __m128 ar = _mm_set1_ps(*ap);
+          acc0 = _mm_add_ps(acc0, _mm_mul_ps(ar, _mm_loadu_ps(bp)));
+          acc1 = _mm_add_ps(acc1, _mm_mul_ps(ar, _mm_loadu_ps(bp + 4)));
+          ap += a_cs;
+          bp += ldb;
+        }
+        if (last) {
+          acc0 = gemm_epilogue_sse2(acc0, bj, activation);
+          acc1 = gemm_epilogue_sse2(acc1, bj != NULL ? bj + 4 : NULL, activation);
+        }
+        _mm_storeu_ps(cr, acc0);
+        _mm_storeu_ps(cr + 4, acc1);
+      }
+    }
+  }
+  if (n_main < n) {
+    gemm_scalar(m, n - n_main, k, a, a_rs, a_cs, b + n_main, ldb, c + n_main, ldc,
+                bias != NULL ? bias + n_main : NULL, activation);
+  }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i gemm_avx2_mask(size_t count)
+{
+  return _mm256_cmpgt_epi32(_mm256_set1_epi32((int) count), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 gemm_epilogue_avx2(__m256 acc, const float *bias, __m256i mask, int activation)
+{
+  if (bias != NULL) {
+    acc = _mm256_add_ps(acc, _mm256_maskload_ps(bias, mask));
+  }
+  return activation == GEMM_SIGMOID ? vmath_sigmoid_avx2(acc) : acc;
+}
+
+// 4x16 register tile of two ymm accumulators per row, column tails handled with masked loads and stores.
+__attribute__((target("avx2,fma")))
+static void gemm_avx2(size_t m, size_t n, size_t k, const float *a, size_t a_rs, size_t a_cs,
+                      const float *b, size_t ldb, float *c, size_t ldc, const float *bias, int activation)
+{
+  for (size_t p0 = 0; p0 < k; p0 += GEMM_KC) {
+    size_t kc = (k - p0) < GEMM_KC ? (k - p0) : GEMM_KC;
+    int last = (p0 + kc) == k;
+    for (size_t j = 0; j < n; j += 16) {
+      size_t nr = (n - j) < 16 ? (n - j) : 16;
+      __m256i m0 = gemm_avx2_mask(nr);
+      __m256i m1 = gemm_avx2_mask(nr > 8 ? nr - 8 : 0);
+      const float *bj = bias != NULL ? bias + j : NULL;
+      size_t i = 0;
+      for (; (i + 4) <= m; i += 4) {
+        __m256 acc[4][2];
+        for (size_t r = 0; r < 4; ++r) {
+          float *cr = c + (i + r) * ldc + j;
+          acc[r][0] = p0 ? _mm256_maskload_ps(cr, m0) : _mm256_setzero_ps();
+          acc[r][1] = p0 ? _mm256_maskload_ps(cr + 8, m1) : _mm256_setzero_ps();
+        }
+        const float *ap = a + i * a_rs + p0 * a_cs;
+        const float *bp = b + p0 * ldb + j;
+        for (size_t p = 0; p < kc; ++p) {
+          __m256 b0 = _mm256_maskload_ps(bp, m0);
+          __m256 b1 = _mm256_maskload_ps(bp + 8, m1);
+          for (size_t r = 0; r < 4; ++r) {
+            __m256 ar = _mm256_broadcast_ss(ap + r * a_rs);
+            acc[r][0] = _mm256_fmadd_ps(ar, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(ar, b1, acc[r][1]);
+          }
+          ap += a_cs;
+          bp += ldb;
+        }
+        for (size_t r = 0; r < 4; ++r) {
+          float *cr = c + (i + r) * ldc + j;
+          if (last) {
+            acc[r][0] = gemm_epilogue_avx2(acc[r][0], bj, m0, activation);
+            acc[r][1] = gemm_epilogue_avx2(acc[r][1], bj != NULL ? bj + 8 : NULL, m1, activation);
+          }
+          _mm256_maskstore_ps(cr, m0, acc[r][0]);
+          _mm256_maskstore_ps(cr + 8, m1, acc[r][1]);
+        }
+      }
+      for (; i < m; ++i) {
+        float *cr = c + i * ldc + j;
+        __m256 acc0 = p0 ? _mm256_maskload_ps(cr, m0) : _mm256_setzero_ps();
+        __m256 acc1 = p0 ? _mm256_maskload_ps(cr + 8, m1) : _mm256_setzero_ps();
+        const float *ap = a + i * a_rs + p0 * a_cs;
+        const float *bp = b + p0 * ldb + j;
+        for (size_t p = 0; p < kc; ++p) {
+          __m256 ar = _mm256_broadcast_ss(ap);
+          acc0 = _mm256_fmadd_ps(ar, _mm256_maskload_ps(bp, m0), acc0);
+          acc1 = _mm256_fmadd_ps(ar, _mm256_maskload_ps(bp + 8, m1), acc1);
+          ap += a_cs;
+          bp += ldb;
+        }
+        if (last) {
+          acc0 = gemm_epilogue_avx2(acc0, bj, m0, activation);
+          acc1 = gemm_epilogue_avx2(acc1, bj != NULL ? bj + 8 : NULL, m1, activation);
+        }
+        _mm256_maskstore_ps(cr, m0, acc0);
+        _mm256_maskstore_ps(cr + 8, m1, acc1);
+      }
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+static inline __m512 gemm_epilogue_avx512(__m512 acc, const float *bias, __mmask16 mask, int activation)
+{
+  if (bias != NULL) {
+    acc = _mm512_add_ps(acc, _mm512_maskz_loadu_ps(mask, bias));
+  }
+  return activation == GEMM_SIGMOID ? vmath_sigmoid_avx512(acc) : acc;
+}
+
+// 8x32 register tile of two zmm accumulators per row, column tails handled with mask registers.
+__attribute__((target("avx512f")))
+static void gemm_avx512(size_t m, size_t n, size_t k, const float *a, size_t a_rs, size_t a_cs,
+                        const float *b, size_t ldb, float *c, size_t ldc, const float *bias, int activation)
+{
+  for (size_t p0 = 0; p0 < k; p0 += GEMM_KC) {
+    size_t kc = (k - p0) < GEMM_KC ? (k - p0) : GEMM_KC;
+    int last = (p0 + kc) == k;
+    for (size_t j = 0; j < n; j += 32) {
+      size_t nr = (n - j) < 32 ? (n - j) : 32;
+      __mmask16 m0 = nr >= 16 ? 0xFFFF : (__mmask16) ((1u << nr) - 1);
+      __mmask16 m1 = nr >= 32 ? 0xFFFF : (nr > 16 ? (__mmask16) ((1u << (nr - 16)) - 1) : 0);
+      const float *bj = bias != NULL ? bias + j : NULL;
+      size_t i = 0;
+      for (; (i + 8) <= m; i += 8) {
+        __m512 acc[8][2];
+        for (size_t r = 0; r < 8; ++r) {
+          float *cr = c + (i + r) * ldc + j;
+          acc[r][0] = p0 ? _mm512_maskz_loadu_ps(m0, cr) : _mm512_setzero_ps();
+          acc[r][1] = p0 ? _mm512_maskz_loadu_ps(m1, cr + 16) : _mm512_setzero_ps();
+        }
+        const float *ap = a + i * a_rs + p0 * a_cs;
+        const float *bp = b + p0 * ldb + j;
+        for (size_t p = 0; p < kc; ++p) {
+          __m512 b0 = _mm512_maskz_loadu_ps(m0, bp);
+          __m512 b1 = _mm512_maskz_loadu_ps(m1, bp + 16);
+          for (size_t r = 0; r < 8; ++r) {
+            __m512 ar = _mm512_set1_ps(ap[r * a_rs]);
+            acc[r][0] = _mm512_fmadd_ps(ar, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_ps(ar, b1, acc[r][1]);
+          }
+          ap += a_cs;
+          bp += ldb;
+        }
+        for (size_t r = 0; r < 8; ++r) {
+          float *cr = c + (i + r) * ldc + j;
+          if (last) {
+            acc[r][0] = gemm_epilogue_avx512(acc[r][0], bj, m0, activation);
+            acc[r][1] = gemm_epilogue_avx512(acc[r][1], bj != NULL ? bj + 16 : NULL, m1, activation);
+          }
+          _mm512_mask_storeu_ps(cr, m0, acc[r][0]);
+          _mm512_mask_storeu_ps(cr + 16, m1, acc[r][1]);
+        }
+      }
+      for (; i < m; ++i) {
+        float *cr = c + i * ldc + j;
+        __m512 acc0 = p0 ? _mm512_maskz_loadu_ps(m0, cr) : _mm512_setzero_ps();
+        __m512 acc1 = p0 ? _mm512_maskz_loadu_ps(m1, cr + 16) : _mm512_setzero_ps();
+        const float *ap = a + i * a_rs + p0 * a_cs;
+        const float *bp = b + p0 * ldb + j;
+        for (size_t p = 0; p < kc; ++p) {
+          __m512 ar = _mm512_set1_ps(*ap);
+          acc0 = _mm512_fmadd_ps(ar, _mm512_maskz_loadu_ps(m0, bp), acc0);
+          acc1 = _mm512_fmadd_ps(ar, _mm512_maskz_loadu_ps(m1, bp + 16), acc1);
+          ap += a_cs;
+          bp += ldb;
+        }
+        if (last) {
+          acc0 = gemm_epilogue_avx512(acc0, bj, m0, activation);
+          acc1 = gemm_epilogue_avx512(acc1, bj != NULL ? bj + 16 : NULL, m1, activation);
+        }
+        _mm512_mask_storeu_ps(cr, m0, acc0);
+        _mm512_mask_storeu_ps(cr + 16, m1, acc1);
+      }
+    }
+  }
+}
+
+// The sparse kernels keep a 32 (avx2) or 64 (avx512) column strip of the output row in registers, so a layer up to that
+// wide is one pass over the nonzero columns. Gather takes the columns two at a time into separate accumulators so
+// consecutive fmas do not wait on each other.
+__attribute__((target("avx2,fma")))
+static void gemm_gather_avx2(size_t n, const float *values, const uint32_t *columns, size_t count,
+                             const float *b, size_t ldb, float *c, const float *bias, int activation)
+{
+  for (size_t j = 0; j < n; j += 32) {
+    __m256i mask[4];
+    __m256 acc[4];
+    __m256 odd[4];
+    size_t vectors = (n - j + 7) / 8 < 4 ? (n - j + 7) / 8 : 4;
+    for (size_t v = 0; v < 4; ++v) {
+      size_t left = (n - j) > (8 * v) ? (n - j) - (8 * v) : 0;
+      mask[v] = gemm_avx2_mask(left < 8 ? left : 8);
+      acc[v] = bias != NULL ? _mm256_maskload_ps(bias + j + 8 * v, mask[v]) : _mm256_setzero_ps();
+      odd[v] = _mm256_setzero_ps();
+    }
+    size_t t = 0;
+    for (; t + 2 <= count; t += 2) {
+      __m256 x0 = _mm256_broadcast_ss(&values[t]);
+      __m256 x1 = _mm256_broadcast_ss(&values[t + 1]);
+      const float *b0 = b + columns[t] * ldb + j;
+      const float *b1 = b + columns[t + 1] * ldb + j;
+      for (size_t v = 0; v < vectors; ++v) {
+        acc[v] = _mm256_fmadd_ps(x0, _mm256_maskload_ps(b0 + 8 * v, mask[v]), acc[v]);
+        odd[v] = _mm256_fmadd_ps(x1, _mm256_maskload_ps(b1 + 8 * v, mask[v]), odd[v]);
+      }
+    }
+    for (; t < count; ++t) {
+      __m256 x = _mm256_broadcast_ss(&values[t]);
+      const float *bp = b + columns[t] * ldb + j;
+      for (size_t v = 0; v < vectors; ++v) {
+        acc[v] = _mm256_fmadd_ps(x, _mm256_maskload_ps(bp + 8 * v, mask[v]), acc[v]);
+      }
+    }
+    for (size_t v = 0; v < vectors; ++v) {
+      acc[v] = _mm256_add_ps(acc[v], odd[v]);
+      _mm256_maskstore_ps(c + j + 8 * v, mask[v], activation == GEMM_SIGMOID ? vmath_sigmoid_avx2(acc[v]) : acc[v]);
+    }
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void gemm_scatter_avx2(size_t n, const float *values, const uint32_t *columns, size_t count,
+                              const float *d, float *c, size_t ldc)
+{
+  for (size_t j = 0; j < n; j += 32) {
+    __m256i mask[4];
+    __m256 dv[4];
+    size_t vectors = (n - j + 7) / 8 < 4 ? (n - j + 7) / 8 : 4;
+    for (size_t v = 0; v < 4; ++v) {
+      size_t left = (n - j) > (8 * v) ? (n - j) - (8 * v) : 0;
+      mask[v] = gemm_avx2_mask(left < 8 ? left : 8);
+      dv[v] = _mm256_maskload_ps(d + j + 8 * v, mask[v]);
+    }
+    for (size_t t = 0; t < count; ++t) {
+      __m256 x = _mm256_broadcast_ss(&values[t]);
+      float *cp = c + columns[t] * ldc + j;
+      for (size_t v = 0; v < vectors; ++v) {
+        _mm256_maskstore_ps(cp + 8 * v, mask[v], _mm256_fmadd_ps(x, dv[v], _mm256_maskload_ps(cp + 8 * v, mask[v])));
+      }
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+static void gemm_gather_avx512(size_t n, const float *values, const uint32_t *columns, size_t count,
+                               const float *b, size_t ldb, float *c, const float *bias, int activation)
+{
+  for (size_t j = 0; j < n; j += 64) {
+    __mmask16 mask[4];
+    __m512 acc[4];
+    __m512 odd[4];
+    size_t vectors = (n - j + 15) / 16 < 4 ? (n - j + 15) / 16 : 4;
+    for (size_t v = 0; v < 4; ++v) {
+      size_t left = (n - j) > (16 * v) ? (n - j) - (16 * v) : 0;
+      mask[v] = left >= 16 ? 0xFFFF : (__mmask16) ((1u << left) - 1);
+      acc[v] = bias != NULL ? _mm512_maskz_loadu_ps(mask[v], bias + j + 16 * v) : _mm512_setzero_ps();
+      odd[v] = _mm512_setzero_ps();
+    }
+    size_t t = 0;
+    for (; t + 2 <= count; t += 2) {
+      __m512 x0 = _mm512_set1_ps(values[t]);
+      __m512 x1 = _mm512_set1_ps(values[t + 1]);
+      const float *b0 = b + columns[t] * ldb + j;
+      const float *b1 = b + columns[t + 1] * ldb + j;
+      for (size_t v = 0; v < vectors; ++v) {
+        acc[v] = _mm512_fmadd_ps(x0, _mm512_maskz_loadu_ps(mask[v], b0 + 16 * v), acc[v]);
+        odd[v] = _mm512_fmadd_ps(x1, _mm512_maskz_loadu_ps(mask[v], b1 + 16 * v), odd[v]);
+      }
+    }
+    for (; t < count; ++t) {
+      __m512 x = _mm512_set1_ps(values[t]);
+      const float *bp = b + columns[t] * ldb + j;
+      for (size_t v = 0; v < vectors; ++v) {
+        acc[v] = _mm512_fmadd_ps(x, _mm512_maskz_loadu_ps(mask[v], bp + 16 * v), acc[v]);
+      }
+    }
+    for (size_t v = 0; v < vectors; ++v) {
+      acc[v] = _mm512_add_ps(acc[v], odd[v]);
+      _mm512_mask_storeu_ps(c + j + 16 * v, mask[v],
+                            activation == GEMM_SIGMOID ? vmath_sigmoid_avx512(acc[v]) : acc[v]);
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+static size_t gemm_compress_avx512(size_t k, const float *a, float *values, uint32_t *columns)
+{
+  size_t count = 0;
+  __m512i index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  for (size_t p = 0; p < k; p += 16) {
+    __mmask16 inside = (k - p) >= 16 ? 0xFFFF : (__mmask16) ((1u << (k - p)) - 1);
+    __m512 x = _mm512_maskz_loadu_ps(inside, a + p);
+    __mmask16 nonzero = _mm512_mask_cmp_ps_mask(inside, x, _mm512_setzero_ps(), _CMP_NEQ_UQ);
+    _mm512_mask_compressstoreu_ps(values + count, nonzero, x);
+    _mm512_mask_compressstoreu_epi32(columns + count, nonzero, index);
+    index = _mm512_add_epi32(index, _mm512_set1_epi32(16));
+    count += __builtin_popcount(nonzero);
+  }
+  return count;
+}
+
+__attribute__((target("avx512f")))
+static void gemm_scatter_avx512(size_t n, const float *values, const uint32_t *columns, size_t count,
+                                const float *d, float *c, size_t ldc)
+{
+  for (size_t j = 0; j < n; j += 64) {
+    __mmask16 mask[4];
+    __m512 dv[4];
+    size_t vectors = (n - j + 15) / 16 < 4 ? (n - j + 15) / 16 : 4;
+    for (size_t v = 0; v < 4; ++v) {
+      size_t left = (n - j) > (16 * v) ? (n - j) - (16 * v) : 0;
+      mask[v] = left >= 16 ? 0xFFFF : (__mmask16) ((1u << left) - 1);
+      dv[v] = _mm512_maskz_loadu_ps(mask[v], d + j + 16 * v);
+    }
+    for (size_t t = 0; t < count; ++t) {
+      __m512 x = _mm512_set1_ps(values[t]);
+      float *cp = c + columns[t] * ldc + j;
+      for (size_t v = 0; v < vectors; ++v) {
+        _mm512_mask_storeu_ps(cp + 16 * v, mask[v],
+                              _mm512_fmadd_ps(x, dv[v], _mm512_maskz_loadu_ps(mask[v], cp + 16 * v)));
+      }
+    }
+  }
+}
+
+#endif // GEMM_X86
+
+// NN_GEMM=scalar|sse2|avx2|avx512 forces a kernel, otherwise the widest one the CPU supports is used. The sparse
+// kernels have no sse2 version and use the scalar ones there. NN_SPARSE_DENSITY sets the fraction of nonzero inputs
+// up to which the sparse kernels are used, 0 turning them off.
+void gemm_init(void)
+{
+  if (gemm_kernel != NULL) {
+    return;
+  }
+
+  const char *forced = getenv("NN_GEMM");
+  Gemm_Kernel kernel = gemm_scalar;
+  Gemm_Gather_Kernel gather = gemm_gather_scalar;
+  Gemm_Scatter_Kernel scatter = gemm_scatter_scalar;
+  Gemm_Compress_Kernel compress = gemm_compress_scalar;
+  const char *name = "scalar";
+
+#ifdef GEMM_X86
+  __builtin_cpu_init();
+  int has_avx512 = __builtin_cpu_supports("avx512f");
+  int has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  int has_sse2 = __builtin_cpu_supports("sse2");
+  if (forced != NULL) {
+    has_avx512 = has_avx512 && (strcmp(forced, "avx512") == 0);
+    has_avx2 = has_avx2 && (strcmp(forced, "avx2") == 0);
+    has_sse2 = has_sse2 && (strcmp(forced, "sse2") == 0);
+  }
+  if (has_avx512) {
+    kernel = gemm_avx512;
+    gather = gemm_gather_avx512;
+    scatter = gemm_scatter_avx512;
+    compress = gemm_compress_avx512;
+    name = "avx512";
+  } else if (has_avx2) {
+    kernel = gemm_avx2;
+    gather = gemm_gather_avx2;
+    scatter = gemm_scatter_avx2;
+    name = "avx2";
+  } else if (has_sse2) {
+    kernel = gemm_sse2;
+    name = "sse2";
+  }
+#else
+  (void) forced;
+#endif
+
+  const char *density = getenv("NN_SPARSE_DENSITY");
+  if (density != NULL) {
+    gemm_sparse_density = strtof(density, NULL);
+  }
+
+  gemm_name = name;
+  gemm_gather_kernel = gather;
+  gemm_scatter_kernel = scatter;
+  gemm_compress_kernel = compress;
+  gemm_kernel = kernel;
+}
+
+const char *gemm_kernel_name(void)
+{
+  gemm_init();
+  return gemm_name;
+}
+
+void gemm(size_t m, size_t n, size_t k, const float *a, size_t a_rs, size_t a_cs,
+          const float *b, size_t ldb, float *c, size_t ldc)
+{
+  gemm_fused(m, n, k, a, a_rs, a_cs, b, ldb, c, ldc, NULL, GEMM_LINEAR);
+}
+
+// c = activation(a * b + bias), bias being a row added to every row of c or NULL.
+void gemm_fused(size_t m, size_t n, size_t k, const float *a, size_t a_rs, size_t a_cs,
+                const float *b, size_t ldb, float *c, size_t ldc, const float *bias, int activation)
+{
+  if (gemm_kernel == NULL) {
+    gemm_init();
+  }
+  if (k == 0) {
+    for (size_t i = 0; i < m; ++i) {
+      for (size_t j = 0; j < n; ++j) {
+        float x = bias != NULL ? bias[j] : 0.0f;
+        c[i * ldc + j] = activation == GEMM_SIGMOID ? vmath_sigmoidf(x) : x;
+      }
+    }
+    return;
+  }
+  gemm_kernel(m, n, k, a, a_rs, a_cs, b, ldb, c, ldc, bias, activation);
+}
+
+// Packs the nonzero entries of a (m x k) row after row into per-thread buffers, row i being the entries from
+// offsets[i] up to offsets[i+1]. Gives up and returns 0 as soon as there are more than the sparse density allows.
+static int gemm_sparse_pack(size_t m, size_t k, const float *a, size_t lda, float **values, uint32_t **columns,
+                            size_t **offsets)
+{
+  static __thread float *pack_values = NULL;
+  static __thread uint32_t *pack_columns = NULL;
+  static __thread size_t *pack_offsets = NULL;
+  static __thread size_t pack_rows = 0;
+  static __thread size_t pack_cap = 0;
+  if (m * k > pack_cap) {
+    free(pack_values);
+    free(pack_columns);
+    pack_values = malloc(sizeof(*pack_values) * m * k);
+    assert(pack_values != NULL);
+    pack_columns = malloc(sizeof(*pack_columns) * m * k);
+    assert(pack_columns != NULL);
+    pack_cap = m * k;
+  }
+  if (m + 1 > pack_rows) {
+    free(pack_offsets);
+    pack_offsets = malloc(sizeof(*pack_offsets) * (m + 1));
+    assert(pack_offsets != NULL);
+    pack_rows = m + 1;
+  }
+
+  size_t limit = gemm_sparse_density * m * k;
+  size_t nonzero = 0;
+  pack_offsets[0] = 0;
+  for (size_t i = 0; i < m; ++i) {
+    nonzero += gemm_compress_kernel(k, a + i * lda, pack_values + nonzero, pack_columns + nonzero);
+    if (nonzero > limit) {
+      return 0;
+    }
+    pack_offsets[i + 1] = nonzero;
+  }
+  *values = pack_values;
+  *columns = pack_columns;
+  *offsets = pack_offsets;
+  return 1;
+}
+
+// c (m x n) = activation(a * b + bias) for an a (m x k) that is mostly zeros, such as the pixels entering the first
+// layer: every row of c sums only the rows of b under the nonzero entries of its row of a. Returns 0 and leaves c
+// alone when a is too dense for that to beat gemm_fused.
+int gemm_sparse(size_t m, size_t n, size_t k, const float *a, size_t lda, const float *b, size_t ldb, float *c,
+                size_t ldc, const float *bias, int activation)
+{
+  if (gemm_kernel == NULL) {
+    gemm_init();
+  }
+  float *values;
+  uint32_t *columns;
+  size_t *offsets;
+  if (!gemm_sparse_pack(m, k, a, lda, &values, &columns, &offsets)) {
+    return 0;
+  }
+  for (size_t i = 0; i < m; ++i) {
+    gemm_gather_kernel(n, values + offsets[i], columns + offsets[i], offsets[i + 1] - offsets[i], b, ldb,
+                       c + i * ldc, bias, activation);
+  }
+  return 1;
+}
+
+// c (k x n) = a^T * d for the same kind of a (m x k) and a d (m x n): only the rows of c under nonzero entries of a
+// are accumulated, the others are zeroed. Returns 0 and leaves c alone when a is too dense.
+int gemm_sparse_at(size_t m, size_t n, size_t k, const float *a, size_t lda, const float *d, size_t ldd, float *c,
+                   size_t ldc)
+{
+  if (gemm_kernel == NULL) {
+    gemm_init();
+  }
+  float *values;
+  uint32_t *columns;
+  size_t *offsets;
+  if (!gemm_sparse_pack(m, k, a, lda, &values, &columns, &offsets)) {
+    return 0;
+  }
+  for (size_t p = 0; p < k; ++p) {
+    memset(c + p * ldc, 0, sizeof(*c) * n);
+  }
+  for (size_t i = 0; i < m; ++i) {
+    gemm_scatter_kernel(n, values + offsets[i], columns + offsets[i], offsets[i + 1] - offsets[i], d + i * ldd, c,
+                        ldc);
+  }
+  return 1;
+}
+
+#endif // GEMM_IMPLEMENTATION
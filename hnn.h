@@ -0,0 +1,512 @@
+#ifndef HNN_H_
+#define HNN_H_
+
+// A 16-bit copy of an NN for inference: the weights are stored as bf16 or IEEE fp16, half the bytes of fp32, and
+// widened to fp32 as they are loaded, so the sums and the activations stay fp32 and no calibration is needed. The
+// weights keep the NN layout, one row per input, with the rows padded with zeros to a multiple of HNN_ALIGN bytes.
+typedef struct {
+  size_t count;
+  int dtype;
+  size_t *widths;
+  size_t *strides;
+  uint16_t **ws;
+  float **bs;
+  void *map;
+  size_t map_len;
+} HNN;
+
+#define HNN_ALIGN 32
+
+void hnn_init(void);
+const char *hnn_kernel_name(void);
+const char *hnn_dtype_name(int dtype);
+int hnn_parse_dtype(const char *name);
+HNN hnn_convert(NN nn, int dtype);
+void hnn_free(HNN hnn);
+Matrix *hnn_alloc_batch(HNN hnn, size_t rows);
+void hnn_free_batch(HNN hnn, Matrix *batch);
+void hnn_forward(HNN hnn, Matrix *batch, size_t rows);
+NN_Model hnn_model(const HNN *hnn);
+HNN hnn_load(char *save_path, char *filename);
+void hnn_save(HNN hnn, char *save_path, char *filename);
+
+#endif // HNN_H_
+
+#ifdef HNN_IMPLEMENTATION
+
+// One row of c = activation(a * w + bias) with w in dtype, given the count nonzero values of the row of a and their
+// columns like the sparse gemm kernels. Hidden activations are never zero, so past the first layer that is every input.
+typedef void (*Hnn_Kernel)(int dtype, size_t n, const float *values, const uint32_t *columns, size_t count,
+                           const uint16_t *w, size_t ldw, float *c, const float *bias, int activation);
+
+static Hnn_Kernel hnn_kernel = NULL;
+static const char *hnn_name = "none";
+
+// Round to nearest even, NaNs stay quiet NaNs.
+static uint16_t hnn_bf16_from_f32(float x)
+{
+  uint32_t u;
+  memcpy(&u, &x, sizeof(u));
+  if ((u & 0x7FFFFFFF) > 0x7F800000) {
+    return (u >> 16) | 0x40;
+  }
+  return (u + 0x7FFF + ((u >> 16) & 1)) >> 16;
+}
+
+static float hnn_f32_from_bf16(uint16_t h)
+{
+  uint32_t u = (uint32_t) h << 16;
+  float x;
+  memcpy(&x, &u, sizeof(x));
+  return x;
+}
+
+// Round to nearest even; too large values become infinities and too small ones fp16 subnormals.
+static uint16_t hnn_f16_from_f32(float x)
+{
+  uint32_t u;
+  memcpy(&u, &x, sizeof(u));
+  uint16_t sign = (u >> 16) & 0x8000;
+  uint32_t abs = u & 0x7FFFFFFF;
+  if (abs > 0x7F800000) {
+    return sign | 0x7E00;
+  }
+  if (abs >= 0x477FF000) {
+    return sign | 0x7C00;
+  }
+  if (abs < 0x38800000) {
+    float f;
+    memcpy(&f, &abs, sizeof(f));
+    return sign | (uint16_t) lrintf(f * 16777216.0f);
+  }
+  return sign | ((abs + 0xFFF + ((abs >> 13) & 1) - 0x38000000) >> 13);
+}
+
+static float hnn_f32_from_f16(uint16_t h)
+{
+  uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1F;
+  uint32_t mantissa = h & 0x3FF;
+  uint32_t u;
+  if (exponent == 0) {
+    float x = mantissa / 16777216.0f;
+    memcpy(&u, &x, sizeof(u));
+    u |= sign;
+  } else if (exponent == 0x1F) {
+    u = sign | 0x7F800000 | (mantissa << 13);
+  } else {
+    u = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+  float x;
+  memcpy(&x, &u, sizeof(x));
+  return x;
+}
+
+static inline float hnn_widen(int dtype, uint16_t h)
+{
+  return dtype == NN_DTYPE_BF16 ? hnn_f32_from_bf16(h) : hnn_f32_from_f16(h);
+}
+
+static void hnn_gather_scalar(int dtype, size_t n, const float *values, const uint32_t *columns, size_t count,
+                              const uint16_t *w, size_t ldw, float *c, const float *bias, int activation)
+{
+  for (size_t j = 0; j < n; ++j) {
+    c[j] = bias[j];
+  }
+  for (size_t t = 0; t < count; ++t) {
+    const uint16_t *wp = w + columns[t] * ldw;
+    for (size_t j = 0; j < n; ++j) {
+      c[j] += values[t] * hnn_widen(dtype, wp[j]);
+    }
+  }
+  for (size_t j = 0; (activation == GEMM_SIGMOID) && (j < n); ++j) {
+    c[j] = vmath_sigmoidf(c[j]);
+  }
+}
+
+#ifdef GEMM_X86
+
+// Same strips as the fp32 gather kernels, the weights being widened as they are loaded. The loads stop at the vector
+// holding the last output, which the HNN_ALIGN row padding keeps inside the row.
+__attribute__((target("avx2,fma,f16c")))
+static inline __m256 hnn_load_avx2(int dtype, const uint16_t *w)
+{
+  __m128i h = _mm_loadu_si128((const __m128i *) w);
+  if (dtype == NN_DTYPE_BF16) {
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+  }
+  return _mm256_cvtph_ps(h);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void hnn_gather_avx2(int dtype, size_t n, const float *values, const uint32_t *columns, size_t count,
+                            const uint16_t *w, size_t ldw, float *c, const float *bias, int activation)
+{
+  for (size_t j = 0; j < n; j += 32) {
+    __m256i mask[4];
+    __m256 acc[4];
+    __m256 odd[4];
+    size_t vectors = (n - j + 7) / 8 < 4 ? (n - j + 7) / 8 : 4;
+    for (size_t v = 0; v < 4; ++v) {
+      size_t left = (n - j) > (8 * v) ? (n - j) - (8 * v) : 0;
+      mask[v] = gemm_avx2_mask(left < 8 ? left : 8);
+      acc[v] = _mm256_maskload_ps(bias + j + 8 * v, mask[v]);
+      odd[v] = _mm256_setzero_ps();
+    }
+    size_t t = 0;
+    for (; t + 2 <= count; t += 2) {
+      __m256 x0 = _mm256_broadcast_ss(&values[t]);
+      __m256 x1 = _mm256_broadcast_ss(&values[t + 1]);
+      const uint16_t *w0 = w + columns[t] * ldw + j;
+      const uint16_t *w1 = w + columns[t + 1] * ldw + j;
+      for (size_t v = 0; v < vectors; ++v) {
+        acc[v] = _mm256_fmadd_ps(x0, hnn_load_avx2(dtype, w0 + 8 * v), acc[v]);
+        odd[v] = _mm256_fmadd_ps(x1, hnn_load_avx2(dtype, w1 + 8 * v), odd[v]);
+      }
+    }
+    for (; t < count; ++t) {
+      __m256 x = _mm256_broadcast_ss(&values[t]);
+      const uint16_t *wp = w + columns[t] * ldw + j;
+      for (size_t v = 0; v < vectors; ++v) {
+        acc[v] = _mm256_fmadd_ps(x, hnn_load_avx2(dtype, wp + 8 * v), acc[v]);
+      }
+    }
+    for (size_t v = 0; v < vectors; ++v) {
+      acc[v] = _mm256_add_ps(acc[v], odd[v]);
+      _mm256_maskstore_ps(c + j + 8 * v, mask[v], activation == GEMM_SIGMOID ? vmath_sigmoid_avx2(acc[v]) : acc[v]);
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+static inline __m512 hnn_load_avx512(int dtype, const uint16_t *w)
+{
+  __m256i h = _mm256_loadu_si256((const __m256i *) w);
+  if (dtype == NN_DTYPE_BF16) {
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16));
+  }
+  return _mm512_cvtph_ps(h);
+}
+
+__attribute__((target("avx512f")))
+static void hnn_gather_avx512(int dtype, size_t n, const float *values, const uint32_t *columns, size_t count,
+                              const uint16_t *w, size_t ldw, float *c, const float *bias, int activation)
+{
+  for (size_t j = 0; j < n; j += 64) {
+    __mmask16 mask[4];
+    __m512 acc[4];
+    __m512 odd[4];
+    size_t vectors = (n - j + 15) / 16 < 4 ? (n - j + 15) / 16 : 4;
+    for (size_t v = 0; v < 4; ++v) {
+      size_t left = (n - j) > (16 * v) ? (n - j) - (16 * v) : 0;
+      mask[v] = left >= 16 ? 0xFFFF : (__mmask16) ((1u << left) - 1);
+      acc[v] = _mm512_maskz_loadu_ps(mask[v], bias + j + 16 * v);
+      odd[v] = _mm512_setzero_ps();
+    }
+    size_t t = 0;
+    for (; t + 2 <= count; t += 2) {
+      __m512 x0 = _mm512_set1_ps(values[t]);
+      __m512 x1 = _mm512_set1_ps(values[t + 1]);
+      const uint16_t *w0 = w + columns[t] * ldw + j;
+      const uint16_t *w1 = w + columns[t + 1] * ldw + j;
+      for (size_t v = 0; v < vectors; ++v) {
+        acc[v] = _mm512_fmadd_ps(x0, hnn_load_avx512(dtype, w0 + 16 * v), acc[v]);
+        odd[v] = _mm512_fmadd_ps(x1, hnn_load_avx512(dtype, w1 + 16 * v), odd[v]);
+      }
+    }
+    for (; t < count; ++t) {
+      __m512 x = _mm512_set1_ps(values[t]);
+      const uint16_t *wp = w + columns[t] * ldw + j;
+      for (size_t v = 0; v < vectors; ++v) {
+        acc[v] = _mm512_fmadd_ps(x, hnn_load_avx512(dtype, wp + 16 * v), acc[v]);
+      }
+    }
+    for (size_t v = 0; v < vectors; ++v) {
+      acc[v] = _mm512_add_ps(acc[v], odd[v]);
+      _mm512_mask_storeu_ps(c + j + 16 * v, mask[v],
+                            activation == GEMM_SIGMOID ? vmath_sigmoid_avx512(acc[v]) : acc[v]);
+    }
+  }
+}
+
+#endif // GEMM_X86
+
+// NN_HNN=scalar|avx2|avx512 forces a kernel, otherwise the widest one the CPU supports is used. fp16 needs F16C on
+// avx2; AVX-512F converts fp16 itself and bf16 is a shift on both.
+void hnn_init(void)
+{
+  if (hnn_kernel != NULL) {
+    return;
+  }
+  gemm_init();
+
+  const char *forced = getenv("NN_HNN");
+  Hnn_Kernel kernel = hnn_gather_scalar;
+  const char *name = "scalar";
+
+#ifdef GEMM_X86
+  __builtin_cpu_init();
+  int has_avx512 = __builtin_cpu_supports("avx512f");
+  int has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+  if (forced != NULL) {
+    has_avx512 = has_avx512 && (strcmp(forced, "avx512") == 0);
+    has_avx2 = has_avx2 && (strcmp(forced, "avx2") == 0);
+  }
+  if (has_avx512) {
+    kernel = hnn_gather_avx512;
+    name = "avx512";
+  } else if (has_avx2) {
+    kernel = hnn_gather_avx2;
+    name = "avx2";
+  }
+#else
+  (void) forced;
+#endif
+
+  hnn_name = name;
+  hnn_kernel = kernel;
+}
+
+const char *hnn_kernel_name(void)
+{
+  hnn_init();
+  return hnn_name;
+}
+
+const char *hnn_dtype_name(int dtype)
+{
+  return dtype == NN_DTYPE_BF16 ? "bf16" : "fp16";
+}
+
+// Returns the dtype named name, -1 when there is none.
+int hnn_parse_dtype(const char *name)
+{
+  if (strcmp(name, "bf16") == 0) {
+    return NN_DTYPE_BF16;
+  } else if (strcmp(name, "fp16") == 0) {
+    return NN_DTYPE_F16;
+  }
+  return -1;
+}
+
+static size_t hnn_stride(size_t width)
+{
+  size_t align = HNN_ALIGN / sizeof(uint16_t);
+  return (width + align - 1) & ~(align - 1);
+}
+
+static HNN hnn_alloc(int dtype, size_t *widths, size_t layer_count)
+{
+  HNN hnn;
+  memset(&hnn, 0, sizeof(hnn));
+  hnn.count = layer_count - 1;
+  hnn.dtype = dtype;
+  hnn.widths = malloc(sizeof(*hnn.widths) * layer_count);
+  assert(hnn.widths != NULL);
+  hnn.strides = malloc(sizeof(*hnn.strides) * layer_count);
+  assert(hnn.strides != NULL);
+  hnn.ws = malloc(sizeof(*hnn.ws) * hnn.count);
+  assert(hnn.ws != NULL);
+  hnn.bs = malloc(sizeof(*hnn.bs) * hnn.count);
+  assert(hnn.bs != NULL);
+  for (size_t l = 0; l < layer_count; ++l) {
+    hnn.widths[l] = widths[l];
+    hnn.strides[l] = hnn_stride(widths[l]);
+  }
+  return hnn;
+}
+
+HNN hnn_convert(NN nn, int dtype)
+{
+  printf("Converting the model to %s...\n", hnn_dtype_name(dtype));
+
+  size_t *widths = malloc(sizeof(*widths) * (nn.count + 1));
+  assert(widths != NULL);
+  widths[0] = nn.ws[0].rows;
+  for (size_t l = 0; l < nn.count; ++l) {
+    widths[l+1] = nn.ws[l].cols;
+  }
+  HNN hnn = hnn_alloc(dtype, widths, nn.count + 1);
+  free(widths);
+
+  for (size_t l = 0; l < hnn.count; ++l) {
+    size_t k = hnn.widths[l];
+    size_t n = hnn.widths[l+1];
+    size_t stride = hnn.strides[l+1];
+    hnn.ws[l] = calloc(k * stride, sizeof(*hnn.ws[l]));
+    assert(hnn.ws[l] != NULL);
+    hnn.bs[l] = malloc(sizeof(*hnn.bs[l]) * n);
+    assert(hnn.bs[l] != NULL);
+    for (size_t p = 0; p < k; ++p) {
+      for (size_t j = 0; j < n; ++j) {
+        float w = MATRIX_AT(nn.ws[l], p, j);
+        hnn.ws[l][p * stride + j] = dtype == NN_DTYPE_BF16 ? hnn_bf16_from_f32(w) : hnn_f16_from_f32(w);
+      }
+    }
+    memcpy(hnn.bs[l], nn.bs[l].items, sizeof(*hnn.bs[l]) * n);
+  }
+
+  printf("The model has been converted.\n");
+  return hnn;
+}
+
+void hnn_free(HNN hnn)
+{
+  if (hnn.map != NULL) {
+    munmap(hnn.map, hnn.map_len);
+  } else {
+    for (size_t l = 0; l < hnn.count; ++l) {
+      free(hnn.ws[l]);
+      free(hnn.bs[l]);
+    }
+  }
+  free(hnn.ws);
+  free(hnn.bs);
+  free(hnn.strides);
+  free(hnn.widths);
+}
+
+// The activations of every layer, as[0] being the input.
+Matrix *hnn_alloc_batch(HNN hnn, size_t rows)
+{
+  Matrix *batch = malloc(sizeof(*batch) * (hnn.count + 1));
+  assert(batch != NULL);
+  for (size_t l = 0; l <= hnn.count; ++l) {
+    batch[l] = matrix_alloc(rows, hnn.widths[l]);
+  }
+  return batch;
+}
+
+void hnn_free_batch(HNN hnn, Matrix *batch)
+{
+  for (size_t l = 0; l <= hnn.count; ++l) {
+    free(batch[l].items);
+  }
+  free(batch);
+}
+
+// Forwards the first rows of batch[0]; the last layer is left as logits. Each row of a layer's input is packed into
+// its nonzero values and columns first, so blank pixels cost nothing.
+void hnn_forward(HNN hnn, Matrix *batch, size_t rows)
+{
+  static __thread float *values = NULL;
+  static __thread uint32_t *columns = NULL;
+  static __thread size_t cap = 0;
+  if (hnn_kernel == NULL) {
+    hnn_init();
+  }
+  assert(rows <= batch[0].rows);
+  for (size_t l = 0; l < hnn.count; ++l) {
+    size_t k = hnn.widths[l];
+    if (k > cap) {
+      free(values);
+      free(columns);
+      values = malloc(sizeof(*values) * k);
+      assert(values != NULL);
+      columns = malloc(sizeof(*columns) * k);
+      assert(columns != NULL);
+      cap = k;
+    }
+    int activation = (l + 1) < hnn.count ? GEMM_SIGMOID : GEMM_LINEAR;
+    for (size_t i = 0; i < rows; ++i) {
+      size_t count = gemm_compress_kernel(k, &MATRIX_AT(batch[l], i, 0), values, columns);
+      hnn_kernel(hnn.dtype, hnn.widths[l+1], values, columns, count, hnn.ws[l], hnn.strides[l+1],
+                 &MATRIX_AT(batch[l+1], i, 0), hnn.bs[l], activation);
+    }
+  }
+}
+
+static void *hnn_model_alloc_batch(const void *model, size_t rows)
+{
+  return hnn_alloc_batch(*(const HNN *) model, rows);
+}
+
+static void hnn_model_free_batch(const void *model, void *batch)
+{
+  hnn_free_batch(*(const HNN *) model, batch);
+}
+
+static Matrix hnn_model_forward(const void *model, void *batch, const uint8_t *images, size_t count)
+{
+  const HNN *hnn = model;
+  Matrix *matrices = batch;
+  matrix_from_bytes(matrix_rows(matrices[0], 0, count), images);
+  hnn_forward(*hnn, matrices, count);
+  return matrix_rows(matrices[hnn->count], 0, count);
+}
+
+NN_Model hnn_model(const HNN *hnn)
+{
+  NN_Model model = {hnn, hnn_dtype_name(hnn->dtype), hnn_kernel_name(), hnn->widths[0], hnn->widths[hnn->count], 0,
+                    0, 0, hnn_model_alloc_batch, hnn_model_free_batch, hnn_model_forward};
+  for (size_t l = 0; l < hnn->count; ++l) {
+    size_t n = hnn->widths[l+1];
+    model.bytes += hnn->widths[l] * hnn->strides[l+1] * sizeof(uint16_t) + n * sizeof(float);
+    model.flops += 2 * hnn->widths[l] * n;
+  }
+  return model;
+}
+
+// Tensors per layer: the 16-bit weights and the fp32 biases.
+HNN hnn_load(char *save_path, char *filename)
+{
+  NN_Model_File file = nn_model_open(save_path, filename, (1u << NN_DTYPE_BF16) | (1u << NN_DTYPE_F16), 2, 0);
+  NN_Model_Header header = file.header;
+  const NN_Model_Tensor *tensors = file.tensors;
+  uint8_t *map = file.map;
+  HNN hnn = hnn_alloc(header.dtype, file.widths, header.layer_count);
+  free(file.widths);
+  hnn.map = map;
+  hnn.map_len = file.map_len;
+
+  for (size_t l = 0; l < hnn.count; ++l) {
+    const NN_Model_Tensor *t = &tensors[2 * l];
+    size_t n = hnn.widths[l+1];
+    if (!nn_model_tensor_check(header, &t[0], header.dtype, hnn.widths[l], hnn.strides[l+1], sizeof(uint16_t)) ||
+        !nn_model_tensor_check(header, &t[1], NN_DTYPE_F32, 1, n, sizeof(float))) {
+      fprintf(stderr, "Invalid model tensor.");
+      exit(1);
+    }
+    hnn.ws[l] = (uint16_t *) (map + t[0].offset);
+    hnn.bs[l] = (float *) (map + t[1].offset);
+  }
+  return hnn;
+}
+
+void hnn_save(HNN hnn, char *save_path, char *filename)
+{
+  printf("Saving the model...\n");
+
+  char fullname[MAX_FILEPATH_LEN];
+  snprintf(fullname, sizeof(fullname), "%s%s", save_path, filename);
+
+  uint32_t *arch = malloc(sizeof(*arch) * (hnn.count + 1));
+  assert(arch != NULL);
+  for (size_t l = 0; l <= hnn.count; ++l) {
+    arch[l] = hnn.widths[l];
+  }
+
+  size_t tensor_count = 2 * hnn.count;
+  NN_Model_Tensor *tensors = calloc(tensor_count, sizeof(*tensors));
+  assert(tensors != NULL);
+  const void **data = malloc(sizeof(*data) * tensor_count);
+  assert(data != NULL);
+  for (size_t l = 0; l < hnn.count; ++l) {
+    NN_Model_Tensor *t = &tensors[2 * l];
+    size_t k = hnn.widths[l];
+    size_t n = hnn.widths[l+1];
+    size_t stride = hnn.strides[l+1];
+    t[0] = (NN_Model_Tensor) {hnn.dtype, k, stride, 0, 0, k * stride * sizeof(uint16_t)};
+    t[1] = (NN_Model_Tensor) {NN_DTYPE_F32, 1, n, 0, 0, n * sizeof(float)};
+    data[2 * l] = hnn.ws[l];
+    data[2 * l + 1] = hnn.bs[l];
+  }
+  nn_model_write(fullname, hnn.dtype, arch, hnn.count + 1, tensors, data, tensor_count);
+
+  free(data);
+  free(tensors);
+  free(arch);
+  printf("The model has been saved as %s.\n", filename);
+}
+
+#endif // HNN_IMPLEMENTATION
@@ -1,29 +1,49 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
+#define CALIBRATION_COUNT 1000
+#define CHECKPOINT_INTERVAL 300
 #define DIGITS 10
+#define ADAM_LEARNING_RATE 0.001f
 #define EPOCHS 2000 
 #define HIDDEN_LAYERS 48, 24
 #define LEARNING_RATE 0.03f
 #define TRAINING_BATCH 100
+#define EVALUATION_BATCH 256
+#define SERVE_BATCH 64
 
-#define LABEL_UNIT_LEN 1
-#define LABELS_METADATA_LEN 2
+#define IDX_IMAGES_TYPE 0x0803
+#define IDX_LABELS_TYPE 0x0801
+#define IMAGE_HEIGHT 28
 #define IMAGE_UNIT_LEN 784
-#define IMAGES_METADATA_LEN 4
-#define TEST_IMAGES_COUNT 10000
-#define TRAINING_IMAGES_COUNT 60000
+#define IMAGE_WIDTH 28
 
+#define BENCH_PATH "./bench/"
+#define CHECKPOINTS_PATH "./checkpoints/"
+#define GENERATED_PATH "./generated/"
 #define MAX_FILEPATH_LEN 256
 #define RENDER_PATH "./render/"
 #define SAVED_MODELS_PATH "./saved_models/"
+#define SWEEPS_PATH "./sweeps/"
 #define TEST_IMAGES_PATH "./test_data/test_images"
 #define TEST_LABELS_PATH "./test_data/test_labels"
 #define TRAINING_IMAGES_PATH "./training_data/training_images"
@@ -35,7 +55,6 @@
 #define MAX_ACTIVATION 1.0f
 #define MAX_BRIGHTNESS 255.0f
 #define MAX_PERCENT 100
-#define PGM_P5_METADATA_LEN 13
 #define PNG_CHANNELS 4
 #define RENDER_STEP 10
 #define RENDER_HEIGHT 3240
@@ -47,149 +66,504 @@ uint32_t canvas_pixels[RENDER_WIDTH * RENDER_HEIGHT];
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+#define POOL_IMPLEMENTATION
+#include "pool.h"
+#define PROF_IMPLEMENTATION
+#include "prof.h"
+#define VMATH_IMPLEMENTATION
+#include "vmath.h"
+#define GEMM_IMPLEMENTATION
+#include "gemm.h"
+#define OPTIM_IMPLEMENTATION
+#include "optim.h"
+#include "dataset.h"
 #define NN_IMPLEMENTATION
 #include "nn.h"
+#define QNN_IMPLEMENTATION
+#include "qnn.h"
+#define HNN_IMPLEMENTATION
+#include "hnn.h"
+#define SNN_IMPLEMENTATION
+#include "snn.h"
+#define EMIT_IMPLEMENTATION
+#include "emit.h"
+#define CHECKPOINT_IMPLEMENTATION
+#include "checkpoint.h"
+#define RENDER_IMPLEMENTATION
+#include "render.h"
+#define PGM_IMPLEMENTATION
+#include "pgm.h"
+#define SERVE_IMPLEMENTATION
+#include "serve.h"
+#define DATASET_IMPLEMENTATION
+#include "dataset.h"
+#define BENCH_IMPLEMENTATION
+#include "bench.h"
+#define SWEEP_IMPLEMENTATION
+#include "sweep.h"
+#define CLASSIFY_IMPLEMENTATION
+#include "classify.h"
+
+void model_check(size_t inputs, size_t outputs)
+{
+  if ((inputs != IMAGE_UNIT_LEN) || (outputs != DIGITS)) {
+    fprintf(stderr, "The model must take %d pixels and output %d digits.", IMAGE_UNIT_LEN, DIGITS);
+    exit(1);
+  }
+}
 
-float training_images[TRAINING_IMAGES_COUNT][IMAGE_UNIT_LEN];
-float test_images[TEST_IMAGES_COUNT][IMAGE_UNIT_LEN];
-int training_labels[TRAINING_IMAGES_COUNT];
-int test_labels[TEST_IMAGES_COUNT];
+int model_dtype(char *model_name)
+{
+  char fullname[MAX_FILEPATH_LEN];
+  snprintf(fullname, sizeof(fullname), "%s%s", SAVED_MODELS_PATH, model_name);
+  return nn_model_dtype(fullname);
+}
 
-void dataset_load(char *dataset_name, float images[][IMAGE_UNIT_LEN], int *labels)
+// Loads a saved model of any dtype for inference, dispatching on the dtype in its header. The model is kept until
+// the program exits.
+NN_Model model_load(char *model_name, size_t *legacy_arch, size_t legacy_arch_count)
 {
-  int images_count;
-  char *images_path, *labels_path;
-  if (strcmp(dataset_name, "training") == 0) {
-    images_count = TRAINING_IMAGES_COUNT;
-    images_path = TRAINING_IMAGES_PATH;
-    labels_path = TRAINING_LABELS_PATH;
-  } else if (strcmp(dataset_name, "test") == 0) {
-    images_count = TEST_IMAGES_COUNT;
-    images_path = TEST_IMAGES_PATH;
-    labels_path = TEST_LABELS_PATH;
+  NN_Model model;
+  int dtype = model_dtype(model_name);
+  if (dtype == NN_DTYPE_I8) {
+    QNN *qnn = malloc(sizeof(*qnn));
+    assert(qnn != NULL);
+    *qnn = qnn_load(SAVED_MODELS_PATH, model_name);
+    model = qnn_model(qnn);
+  } else if ((dtype == NN_DTYPE_BF16) || (dtype == NN_DTYPE_F16)) {
+    HNN *hnn = malloc(sizeof(*hnn));
+    assert(hnn != NULL);
+    *hnn = hnn_load(SAVED_MODELS_PATH, model_name);
+    model = hnn_model(hnn);
+  } else if (dtype == NN_DTYPE_SPARSE) {
+    SNN *snn = malloc(sizeof(*snn));
+    assert(snn != NULL);
+    *snn = snn_load(SAVED_MODELS_PATH, model_name);
+    model = snn_model(snn);
   } else {
-    fprintf(stderr, "Unknown dataset.");
-    exit(1);
+    NN *nn = malloc(sizeof(*nn));
+    assert(nn != NULL);
+    *nn = nn_load(SAVED_MODELS_PATH, model_name, legacy_arch, legacy_arch_count);
+    model = nn_model(nn);
   }
+  model_check(model.inputs, model.outputs);
+  return model;
+}
 
-  int file_descriptor = open(images_path, O_RDONLY);
-  if (file_descriptor == -1) {
-    fprintf(stderr, "Error opening the images file.");
-    exit(1);
+int main(int argc, char *argv[])
+{ 
+  size_t arch[] = {IMAGE_UNIT_LEN, HIDDEN_LAYERS, DIGITS};
+  size_t layer_count = ARRAY_LEN(arch);
+
+  NN nn;
+
+  size_t threads = pool_cpu_count();
+  size_t render_step = RENDER_STEP;
+  int optimizer_kind = OPTIM_SGD;
+  int schedule = OPTIM_CONSTANT;
+  float learning_rate = 0.0f;
+  size_t epochs = EPOCHS;
+  size_t warmup = 0;
+  double checkpoint_interval = CHECKPOINT_INTERVAL;
+  size_t stream_window = 0;
+  int classify_format = CLASSIFY_CSV;
+  size_t classify_top = 1;
+  for (;;) {
+    if ((argc > 2) && (strcmp(argv[argc-2], "-threads") == 0)) {
+      threads = strtoul(argv[argc-1], NULL, 10);
+      if (threads == 0) {
+        fprintf(stderr, "Invalid number of threads.");
+        return 1;
+      }
+    } else if ((argc > 2) && (strcmp(argv[argc-2], "-render-step") == 0)) {
+      char *end;
+      render_step = strtoul(argv[argc-1], &end, 10);
+      if ((*argv[argc-1] == '\0') || (*end != '\0')) {
+        fprintf(stderr, "Invalid render step.");
+        return 1;
+      }
+    } else if ((argc > 2) && (strcmp(argv[argc-2], "-optimizer") == 0)) {
+      optimizer_kind = optim_parse(argv[argc-1], optim_kinds, ARRAY_LEN(optim_kinds));
+      if (optimizer_kind == -1) {
+        fprintf(stderr, "Unknown optimizer.");
+        return 1;
+      }
+    } else if ((argc > 2) && (strcmp(argv[argc-2], "-schedule") == 0)) {
+      schedule = optim_parse(argv[argc-1], optim_schedules, ARRAY_LEN(optim_schedules));
+      if (schedule == -1) {
+        fprintf(stderr, "Unknown learning rate schedule.");
+        return 1;
+      }
+    } else if ((argc > 2) && (strcmp(argv[argc-2], "-lr") == 0)) {
+      char *end;
+      learning_rate = strtof(argv[argc-1], &end);
+      if ((*end != '\0') || !(learning_rate > 0.0f)) {
+        fprintf(stderr, "Invalid learning rate.");
+        return 1;
+      }
+    } else if ((argc > 2) && (strcmp(argv[argc-2], "-epochs") == 0)) {
+      epochs = strtoul(argv[argc-1], NULL, 10);
+      if (epochs == 0) {
+        fprintf(stderr, "Invalid number of epochs.");
+        return 1;
+      }
+    } else if ((argc > 2) && (strcmp(argv[argc-2], "-warmup") == 0)) {
+      char *end;
+      warmup = strtoul(argv[argc-1], &end, 10);
+      if ((*argv[argc-1] == '\0') || (*end != '\0')) {
+        fprintf(stderr, "Invalid number of warmup epochs.");
+        return 1;
+      }
+    } else if ((argc > 2) && (strcmp(argv[argc-2], "-checkpoint-every") == 0)) {
+      char *end;
+      checkpoint_interval = strtod(argv[argc-1], &end);
+      if ((*argv[argc-1] == '\0') || (*end != '\0') || !(checkpoint_interval >= 0)) {
+        fprintf(stderr, "Invalid checkpoint interval.");
+        return 1;
+      }
+    } else if ((argc > 2) && (strcmp(argv[argc-2], "-stream") == 0)) {
+      stream_window = strtoul(argv[argc-1], NULL, 10);
+      if (stream_window == 0) {
+        fprintf(stderr, "Invalid stream window.");
+        return 1;
+      }
+    } else if ((argc > 2) && (strcmp(argv[argc-2], "-format") == 0)) {
+      if (strcmp(argv[argc-1], "csv") == 0) {
+        classify_format = CLASSIFY_CSV;
+      } else if (strcmp(argv[argc-1], "binary") == 0) {
+        classify_format = CLASSIFY_BINARY;
+      } else {
+        fprintf(stderr, "Unknown output format.");
+        return 1;
+      }
+    } else if ((argc > 2) && (strcmp(argv[argc-2], "-top") == 0)) {
+      classify_top = strtoul(argv[argc-1], NULL, 10);
+      if ((classify_top == 0) || (classify_top > DIGITS)) {
+        fprintf(stderr, "The number of top digits must be between 1 and %d.", DIGITS);
+        return 1;
+      }
+    } else if ((argc > 2) && (strcmp(argv[argc-2], "-profile") == 0)) {
+      prof_open(argv[argc-1]);
+    } else {
+      break;
+    }
+    argc -= 2;
   }
 
-  int metadata_buf[IMAGES_METADATA_LEN]; 
-  read(file_descriptor, metadata_buf, IMAGES_METADATA_LEN * sizeof(int));
+  vmath_init();
+  gemm_init();
+  optim_init();
+  qnn_init();
+  hnn_init();
+  snn_init();
 
-  unsigned char image_buf[IMAGE_UNIT_LEN];
-  for (size_t i = 0; i < images_count; ++i) {
-    read(file_descriptor, image_buf, IMAGE_UNIT_LEN * sizeof(unsigned char));   
-    for (size_t j = 0; j < IMAGE_UNIT_LEN; ++j)
-      images[i][j]  = (float) image_buf[j] / MAX_BRIGHTNESS;
+  if (learning_rate == 0.0f) {
+    learning_rate = optimizer_kind == OPTIM_ADAM ? ADAM_LEARNING_RATE : LEARNING_RATE;
   }
 
-  close(file_descriptor);
+  if (((argc == 2) && (strcmp(argv[1], "-train") == 0)) || ((argc == 3) && (strcmp(argv[1], "-resume") == 0))) {
+    Dataset training = stream_window > 0 ?
+                       dataset_stream("training", TRAINING_IMAGES_PATH, TRAINING_LABELS_PATH, stream_window << 20) :
+                       dataset_load("training");
+    Optimizer optimizer;
+    char checkpoint_path[MAX_FILEPATH_LEN];
+    if (argc == 3) {
+      snprintf(checkpoint_path, sizeof(checkpoint_path), "%s%s", CHECKPOINTS_PATH, argv[2]);
+      if (!checkpoint_load(checkpoint_path, arch, layer_count, &nn, &optimizer)) {
+        return 1;
+      }
+      if (optimizer.steps_per_epoch != (training.count / TRAINING_BATCH)) {
+        fprintf(stderr, "The checkpoint was made with a different training set.");
+        return 1;
+      }
+      printf("Resuming at epoch %zu, batch %zu.\n", optimizer.step / optimizer.steps_per_epoch,
+             optimizer.step % optimizer.steps_per_epoch);
+    } else {
+      nn = nn_alloc(arch, layer_count);
+      nn_rng_seed(time(0));
+      nn_init(nn);
+      optimizer = optim_alloc(optimizer_kind, schedule, learning_rate, epochs, warmup, nn.param_count,
+                              training.count / TRAINING_BATCH);
+      char date_string[32];
+      time_t current_time = time(NULL);
+      strftime(date_string, sizeof(date_string), "%Y%m%d%H%M%S", localtime(&current_time));
+      snprintf(checkpoint_path, sizeof(checkpoint_path), "%s%s", CHECKPOINTS_PATH, date_string);
+    }
+    NN gradient = nn_alloc_batch(arch, layer_count, TRAINING_BATCH);
+    Pool *pool = pool_create(threads);
+
+    NN_Train_Hook hooks[2];
+    size_t hook_count = 0;
+    Render_Worker *renderer = render_step > 0 ? render_worker_create(nn, render_step, threads) : NULL;
+    if (renderer != NULL) {
+      hooks[hook_count++] = (NN_Train_Hook) {render_worker_submit, NULL, renderer};
+    }
+    Checkpoint_Worker *checkpointer = NULL;
+    if (checkpoint_interval > 0) {
+      checkpointer = checkpoint_worker_create(nn, &optimizer, checkpoint_path, checkpoint_interval);
+      hooks[hook_count++] = (NN_Train_Hook) {NULL, checkpoint_worker_submit, checkpointer};
+    }
 
-  file_descriptor = open(labels_path, O_RDONLY);
-  if (file_descriptor == -1) {
-    fprintf(stderr, "Error opening the labels file.");
-    exit(1);
-  }
+    nn_train(nn, gradient, pool, training, &optimizer, hooks, hook_count);
+    if (checkpointer != NULL) {
+      checkpoint_worker_destroy(checkpointer);
+    }
+    if (renderer != NULL) {
+      render_worker_destroy(renderer);
+    }
+    if (training.window == 0) {
+      nn_test(nn_model(&nn), pool, "training", training);
+    }
+
+    nn_save(nn, SAVED_MODELS_PATH, optimizer.learning_rate, optimizer.epochs);
+    optim_free(optimizer);
 
-  read(file_descriptor, metadata_buf, LABELS_METADATA_LEN * sizeof(int));
+    Dataset test = dataset_load("test");
+    nn_test(nn_model(&nn), pool, "test", test);
 
-  unsigned char label_buf[LABEL_UNIT_LEN];
-  for (size_t i = 0; i < images_count; ++i) {
-    read(file_descriptor, label_buf, LABEL_UNIT_LEN * sizeof(unsigned char));   
-    labels[i] = (int) label_buf[0];
+    dataset_free(test);
+    dataset_free(training);
+    pool_destroy(pool);
   }
 
-  close(file_descriptor);
-}
+  else if ((argc == 3) && (strcmp(argv[1], "-test") == 0)) {
+    NN_Model model = model_load(argv[2], arch, layer_count);
+    Pool *pool = pool_create(threads);
 
-void pmg_load(char *image_path, NN nn)
-{
-  int file_descriptor = open(image_path, O_RDONLY);
-  if (file_descriptor == -1) {
-    fprintf(stderr, "Error opening the file.");
-    exit(1);
+    Dataset training = dataset_load("training");
+    nn_test(model, pool, "training", training);
+
+    Dataset test = dataset_load("test");
+    nn_test(model, pool, "test", test);
+
+    dataset_free(test);
+    dataset_free(training);
+    pool_destroy(pool);
   }
 
-  unsigned char buf[IMAGE_UNIT_LEN];
+  else if ((argc == 5) && (strcmp(argv[1], "-guess") == 0) && (strcmp(argv[3], "-model") == 0)) {
+    NN_Model model = model_load(argv[4], arch, layer_count);
 
-  read(file_descriptor, buf, PGM_P5_METADATA_LEN * sizeof(unsigned char));
-  read(file_descriptor, buf, IMAGE_UNIT_LEN * sizeof(unsigned char));   
-  
-  close(file_descriptor);
+    uint8_t pixels[IMAGE_UNIT_LEN];
+    if (!pgm_read(argv[2], pixels, IMAGE_WIDTH, IMAGE_HEIGHT)) {
+      fprintf(stderr, "Error reading the image.");
+      return 1;
+    }
 
-  for (size_t i = 0; i < IMAGE_UNIT_LEN; ++i) {
-    MATRIX_AT(NN_INPUT(nn), 0, i) = (float) buf[i] / MAX_BRIGHTNESS;
+    nn_guess(model, pixels);
   }
-}
 
-int main(int argc, char *argv[])
-{ 
-  size_t arch[] = {IMAGE_UNIT_LEN, HIDDEN_LAYERS, DIGITS};
-  size_t layer_count = ARRAY_LEN(arch);
+  else if ((argc == 3) && (strcmp(argv[1], "-quantize") == 0)) {
+    char *model_name = argv[2];
+    nn = nn_load(SAVED_MODELS_PATH, model_name, arch, layer_count);
+    model_check(NN_INPUT(nn).cols, NN_OUTPUT(nn).cols);
+    Pool *pool = pool_create(threads);
+
+    Dataset training = dataset_load("training");
+    Dataset calibration = training;
+    if (calibration.count > CALIBRATION_COUNT) {
+      calibration.count = CALIBRATION_COUNT;
+    }
+    QNN qnn = qnn_quantize(nn, calibration);
+
+    char quantized_name[MAX_FILEPATH_LEN];
+    snprintf(quantized_name, sizeof(quantized_name), "%s_int8", model_name);
+    qnn_save(qnn, SAVED_MODELS_PATH, quantized_name);
 
-  NN nn = nn_alloc(arch, layer_count);
+    Dataset test = dataset_load("test");
+    nn_compare(nn_model(&nn), qnn_model(&qnn), pool, test);
 
-  if ((argc == 2) && (strcmp(argv[1], "-train") == 0)) {
-    NN gradient = nn_alloc(arch, layer_count);
+    dataset_free(test);
+    dataset_free(training);
+    pool_destroy(pool);
+  }
+
+  else if ((argc == 4) && (strcmp(argv[1], "-convert") == 0)) {
+    char *model_name = argv[2];
+    int dtype = hnn_parse_dtype(argv[3]);
+    if (dtype == -1) {
+      fprintf(stderr, "Unknown precision.");
+      return 1;
+    }
+    nn = nn_load(SAVED_MODELS_PATH, model_name, arch, layer_count);
+    model_check(NN_INPUT(nn).cols, NN_OUTPUT(nn).cols);
+    Pool *pool = pool_create(threads);
 
-    dataset_load("training", training_images, training_labels);
-    nn_train(nn, gradient, TRAINING_IMAGES_COUNT, training_images, training_labels);
-    nn_test(nn, "training", TRAINING_IMAGES_COUNT, training_images, training_labels);
+    HNN hnn = hnn_convert(nn, dtype);
+    char converted_name[MAX_FILEPATH_LEN];
+    snprintf(converted_name, sizeof(converted_name), "%s_%s", model_name, hnn_dtype_name(dtype));
+    hnn_save(hnn, SAVED_MODELS_PATH, converted_name);
 
-    nn_save(nn, SAVED_MODELS_PATH);
+    Dataset test = dataset_load("test");
+    nn_compare(nn_model(&nn), hnn_model(&hnn), pool, test);
 
-    dataset_load("test", test_images, test_labels);
-    nn_test(nn, "test", TEST_IMAGES_COUNT, test_images, test_labels);
+    hnn_free(hnn);
+    dataset_free(test);
+    pool_destroy(pool);
   }
 
-  else if ((argc == 3) && (strcmp(argv[1], "-test") == 0)) {
+  else if (((argc == 4) || (argc == 5)) && (strcmp(argv[1], "-prune") == 0)) {
     char *model_name = argv[2];
-    nn_load(nn, SAVED_MODELS_PATH, model_name);
-    
-    dataset_load("training", training_images, training_labels);
-    nn_test(nn, "training", TRAINING_IMAGES_COUNT, training_images, training_labels);
+    char *end;
+    float sparsity = strtof(argv[3], &end);
+    if ((*end != '\0') || !(sparsity >= 0.0f) || !(sparsity < 1.0f)) {
+      fprintf(stderr, "The sparsity must be at least 0 and below 1.");
+      return 1;
+    }
+    size_t finetune_epochs = 0;
+    if (argc == 5) {
+      finetune_epochs = strtoul(argv[4], &end, 10);
+      if ((*argv[4] == '\0') || (*end != '\0')) {
+        fprintf(stderr, "Invalid number of epochs.");
+        return 1;
+      }
+    }
+    NN dense = nn_load(SAVED_MODELS_PATH, model_name, arch, layer_count);
+    model_check(NN_INPUT(dense).cols, NN_OUTPUT(dense).cols);
+    nn = nn_load(SAVED_MODELS_PATH, model_name, arch, layer_count);
+    Pool *pool = pool_create(threads);
+
+    Dataset training = dataset_load("training");
+    Dataset calibration = training;
+    if (calibration.count > CALIBRATION_COUNT) {
+      calibration.count = CALIBRATION_COUNT;
+    }
+    SNN_Mask mask = snn_prune(nn, calibration, sparsity);
+    Dataset test = dataset_load("test");
+    if (finetune_epochs > 0) {
+      nn_test(nn_model(&nn), pool, "test", test);
+      // Fine tuned with the pruned weights held at zero after every step, starting from the pruned weights.
+      Optimizer optimizer = optim_alloc(optimizer_kind, schedule, learning_rate, finetune_epochs, warmup,
+                                        nn.param_count, training.count / TRAINING_BATCH);
+      // The widths come from the model file, which need not be the compiled-in architecture.
+      size_t *widths = malloc(sizeof(*widths) * (nn.count + 1));
+      assert(widths != NULL);
+      for (size_t l = 0; l <= nn.count; ++l) {
+        widths[l] = l == 0 ? nn.ws[0].rows : nn.ws[l-1].cols;
+      }
+      NN gradient = nn_alloc_batch(widths, nn.count + 1, TRAINING_BATCH);
+      NN_Train_Hook hook = {NULL, snn_mask_apply, &mask};
+      nn_train(nn, gradient, pool, training, &optimizer, &hook, 1);
+      nn_free(gradient);
+      free(widths);
+      optim_free(optimizer);
+    }
 
-    dataset_load("test", test_images, test_labels);
-    nn_test(nn, "test", TEST_IMAGES_COUNT, test_images, test_labels);
+    SNN snn = snn_from_nn(nn);
+    char pruned_name[MAX_FILEPATH_LEN];
+    snprintf(pruned_name, sizeof(pruned_name), "%s_sparse%02ld", model_name, lrintf(sparsity * MAX_PERCENT));
+    snn_save(snn, SAVED_MODELS_PATH, pruned_name);
+    snn_print_layers(snn);
+    nn_compare(nn_model(&dense), snn_model(&snn), pool, test);
+
+    snn_free(snn);
+    snn_mask_free(mask);
+    nn_free(dense);
+    dataset_free(test);
+    dataset_free(training);
+    pool_destroy(pool);
   }
 
-  else if ((argc == 5) && (strcmp(argv[1], "-guess") == 0) && (strcmp(argv[3], "-model") == 0)) {
-    char *model_name = argv[4];
-    nn_load(nn, SAVED_MODELS_PATH, model_name);
+  else if ((argc >= 5) && (argc % 2 == 1) && (strcmp(argv[1], "-serve") == 0)) {
+    size_t model_count = (argc - 3) / 2;
+    if (model_count > UINT8_MAX + 1) {
+      fprintf(stderr, "Too many models.");
+      return 1;
+    }
+    char **model_paths = malloc(sizeof(*model_paths) * model_count);
+    assert(model_paths != NULL);
+    for (size_t i = 0; i < model_count; ++i) {
+      if (strcmp(argv[3 + 2*i], "-model") != 0) {
+        fprintf(stderr, "Invalid parameters.");
+        return 1;
+      }
+      model_paths[i] = malloc(MAX_FILEPATH_LEN);
+      assert(model_paths[i] != NULL);
+      snprintf(model_paths[i], MAX_FILEPATH_LEN, "%s%s", SAVED_MODELS_PATH, argv[4 + 2*i]);
+    }
 
-    char *guess_image_path = argv[2];
-    pmg_load(guess_image_path, nn);
+    serve(argv[2], model_paths, model_count, arch, layer_count, threads);
+  }
 
-    nn_guess(nn);
+  else if (((argc == 4) || ((argc == 6) && (strcmp(argv[4], "-model") == 0))) && (strcmp(argv[1], "-client") == 0)) {
+    unsigned long model = 0;
+    if (argc == 6) {
+      char *end;
+      model = strtoul(argv[5], &end, 10);
+      if ((*argv[5] < '0') || (*argv[5] > '9') || (*end != '\0') || (model > UINT8_MAX)) {
+        fprintf(stderr, "Invalid model index.");
+        return 1;
+      }
+    }
+    if (!serve_client(argv[2], argv[3], (uint8_t) model)) {
+      return 1;
+    }
+  }
+
+  else if ((argc == 5) && (strcmp(argv[1], "-loadgen") == 0)) {
+    size_t requests = strtoul(argv[3], NULL, 10);
+    size_t connections = strtoul(argv[4], NULL, 10);
+    if ((requests == 0) || (connections == 0)) {
+      fprintf(stderr, "Invalid parameters.");
+      return 1;
+    }
+    if (!serve_loadgen(argv[2], requests, connections)) {
+      return 1;
+    }
+  }
+
+  else if ((argc == 3) && (strcmp(argv[1], "-emit-c") == 0)) {
+    char *model_name = argv[2];
+    nn = nn_load(SAVED_MODELS_PATH, model_name, arch, layer_count);
+
+    char source_filepath[MAX_FILEPATH_LEN];
+    snprintf(source_filepath, sizeof(source_filepath), "%s%s.c", GENERATED_PATH, model_name);
+    emit_c(nn, model_name, source_filepath);
   }
 
   else if ((argc == 3) && (strcmp(argv[1], "-print") == 0)) {
     char *model_name = argv[2];
-    nn_load(nn, SAVED_MODELS_PATH, model_name);
+    nn = nn_load(SAVED_MODELS_PATH, model_name, arch, layer_count);
 
     NN_PRINT(nn);
   }
 
+  else if (((argc == 2) || (argc == 3)) && (strcmp(argv[1], "-bench") == 0)) {
+    bench_run(arch, layer_count, threads, argc == 3 ? argv[2] : NULL);
+  }
+
+  else if ((argc == 3) && (strcmp(argv[1], "-sweep") == 0)) {
+    sweep_run(argv[2], threads);
+  }
+
+  else if ((argc == 5) && (strcmp(argv[1], "-classify") == 0)) {
+    nn = nn_load(SAVED_MODELS_PATH, argv[2], arch, layer_count);
+    model_check(NN_INPUT(nn).cols, NN_OUTPUT(nn).cols);
+
+    classify_run(nn, argv[3], argv[4], classify_format, classify_top, threads);
+  }
+
   else if ((argc == 3) && (strcmp(argv[1], "-render") == 0)) {
     char *model_name = argv[2];
-    nn_load(nn, SAVED_MODELS_PATH, model_name);
+    nn = nn_load(SAVED_MODELS_PATH, model_name, arch, layer_count);
+
+    Pool *pool = pool_create(threads);
 
+    printf("Rendering the model...\n");
     Olivec_Canvas canvas = olivec_canvas(canvas_pixels, RENDER_WIDTH, RENDER_HEIGHT, RENDER_WIDTH);
-    nn_render(canvas, nn);
+    Render_Cache *cache = render_cache_create(canvas, nn);
+    render_cache_draw(cache, pool, canvas, nn);
+    render_cache_free(cache);
+    printf("The model has been rendered.\n");
 
     char canvas_filepath[MAX_FILEPATH_LEN];
     snprintf(canvas_filepath, sizeof(canvas_filepath), "%s%s.png", RENDER_PATH, model_name);
 
-    if (!stbi_write_png(canvas_filepath, canvas.width, canvas.height, PNG_CHANNELS, canvas_pixels,
-    canvas.stride * sizeof(uint32_t))) {
+    if (!render_png(canvas_filepath, canvas)) {
       fprintf(stderr, "Could not save the file.");
       return 1;
     }
+    pool_destroy(pool);
   }
 
   else {
@@ -197,6 +571,7 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  prof_close();
   return 0;
 }
 
@@ -12,33 +12,148 @@ typedef struct {
   Matrix *ws;
   Matrix *bs;
   Matrix *as;
+  float *params;
+  size_t param_count;
+  void *map;
+  size_t map_len;
 } NN;
 
+// Model file v2: header, u32 layer widths, tensor table, then the tensors at NN_MODEL_ALIGN aligned offsets.
+// All fields are little-endian and the checksum is FNV-1a over the payload.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t dtype;
+  uint32_t layer_count;
+  uint32_t tensor_count;
+  uint64_t payload_offset;
+  uint64_t payload_size;
+  uint64_t checksum;
+} NN_Model_Header;
+
+typedef struct {
+  uint32_t dtype;
+  uint32_t rows;
+  uint32_t cols;
+  uint32_t reserved;
+  uint64_t offset;
+  uint64_t size;
+} NN_Model_Tensor;
+
+typedef struct {
+  size_t count;
+  size_t correct;
+  size_t confusion[DIGITS][DIGITS];
+} NN_Evaluation;
+
+// A model of any dtype as the evaluator and -guess see it. forward reads count images into a batch from alloc_batch
+// and returns their logits. bytes and flops are the size of the parameters and the multiply-adds of one image, and
+// layer_count the number of layers forward records in the profile, 0 for none.
+typedef struct {
+  const void *model;
+  const char *dtype;
+  const char *kernel;
+  size_t inputs;
+  size_t outputs;
+  size_t bytes;
+  size_t flops;
+  size_t layer_count;
+  void *(*alloc_batch)(const void *model, size_t rows);
+  void (*free_batch)(const void *model, void *batch);
+  Matrix (*forward)(const void *model, void *batch, const uint8_t *images, size_t count);
+} NN_Model;
+
+// A v2 model file mapped by nn_model_open, with its layer widths.
+typedef struct {
+  NN_Model_Header header;
+  uint8_t *map;
+  size_t map_len;
+  size_t *widths;
+  const NN_Model_Tensor *tensors;
+} NN_Model_File;
+
+typedef struct {
+  Pool *pool;
+  NN_Model model;
+  void **batches;
+  NN_Evaluation *partials;
+  Prof_Counters *counters;
+  size_t next;
+  Dataset dataset;
+} NN_Evaluator;
+
+typedef int (*NN_Epoch_Callback)(void *context, NN nn, size_t epoch);
+typedef void (*NN_Step_Callback)(void *context, NN nn, const Optimizer *optimizer);
+
+// Either callback may be NULL. on_step runs after every optimizer step, on_epoch after every epoch; training ends early
+// when an on_epoch returns 0.
+typedef struct {
+  NN_Epoch_Callback on_epoch;
+  NN_Step_Callback on_step;
+  void *context;
+} NN_Train_Hook;
+
 float rand_float(void);
+void nn_rng_seed(uint64_t state);
+uint64_t nn_rng_state(void);
+uint64_t nn_splitmix64(uint64_t *state);
 float sigmoidf(float x);
 
 Matrix matrix_alloc(size_t rows, size_t cols);
 void matrix_copy(Matrix dst, Matrix src);
+void matrix_dense(Matrix dst, Matrix a, Matrix w, Matrix bias, int activation);
+void matrix_dense_sparse(Matrix dst, Matrix a, Matrix w, Matrix bias, int activation);
 void matrix_dot(Matrix dst, Matrix a, Matrix b);
+void matrix_dot_at(Matrix dst, Matrix a, Matrix b);
+void matrix_dot_at_sparse(Matrix dst, Matrix a, Matrix b);
+void matrix_dot_bt(Matrix dst, Matrix a, Matrix b);
 void matrix_fill(Matrix matrix, float x);
+void matrix_from_bytes(Matrix dst, const uint8_t *bytes);
 void matrix_print(Matrix matrix, const char *name, size_t padding);
 void matrix_rand(Matrix matrix, float low, float high);
+Matrix matrix_rows(Matrix matrix, size_t start, size_t count);
 void matrix_sig(Matrix matrix);
 void matrix_softmax(Matrix matrix);
 void matrix_sum(Matrix dst, Matrix a);
+void matrix_sum_cols(Matrix dst, Matrix a);
+void matrix_sum_row(Matrix dst, Matrix row);
 
 NN nn_alloc(size_t *arch, size_t arch_count);
+NN nn_alloc_activations(NN nn, size_t batch_size);
+NN nn_alloc_batch(size_t *arch, size_t arch_count, size_t batch_size);
+NN nn_alloc_params(NN nn);
+void nn_compare(NN_Model baseline, NN_Model model, Pool *pool, Dataset dataset);
+void nn_evaluate(NN_Evaluator *evaluator, Dataset dataset, NN_Evaluation *evaluation);
+void nn_evaluation_add(NN_Evaluation *evaluation, Matrix outputs, const uint8_t *labels);
+void nn_evaluation_merge(NN_Evaluation *evaluation, const NN_Evaluation *partials, size_t partial_count);
+void nn_evaluation_print(NN_Evaluation evaluation, char *dataset_name);
+NN_Evaluator nn_evaluator_alloc(NN_Model model, Pool *pool);
+void nn_evaluator_free(NN_Evaluator evaluator);
 void nn_forward(NN nn);
+void nn_free(NN nn);
+void nn_free_activations(NN nn);
+void nn_free_params(NN nn);
 void nn_get_average_gradient(NN gradient, size_t data_count);
+void nn_get_batch_gradient(NN nn, NN gradient);
 void nn_get_total_gradient(NN nn, NN gradient);
-void nn_guess(NN nn);
+void nn_guess(NN_Model model, const uint8_t *pixels);
 void nn_init(NN nn);
-void nn_load(NN nn, char *save_path, char *filename);
+int nn_model_dtype(char *path);
+NN nn_load(char *save_path, char *filename, size_t *legacy_arch, size_t legacy_arch_count);
+NN_Model nn_model(const NN *nn);
+int nn_load_file(char *path, size_t *legacy_arch, size_t legacy_arch_count, NN *nn);
+void nn_predict(NN nn);
 void nn_print(NN nn, const char *name);
+void nn_print_probabilities(const float *probabilities);
+NN nn_rows(NN nn, size_t start, size_t count);
 void nn_render(Olivec_Canvas canvas, NN nn);
-void nn_save(NN nn, char *save_path);
-void nn_test(NN nn, char *dataset_name, size_t images_count, float images[][IMAGE_UNIT_LEN], int *labels);
-void nn_train(NN nn, NN gradient, size_t images_count, float images[][IMAGE_UNIT_LEN], int *labels);
+void nn_render_center(Olivec_Canvas canvas, NN nn, size_t l, size_t i, int *x, int *y);
+uint32_t nn_render_color(float x);
+void nn_save(NN nn, char *save_path, float learning_rate, size_t epochs);
+void nn_save_file(NN nn, char *path);
+void nn_test(NN_Model model, Pool *pool, char *dataset_name, Dataset dataset);
+void nn_train(NN nn, NN gradient, Pool *pool, Dataset dataset, Optimizer *optimizer, const NN_Train_Hook *hooks,
+              size_t hook_count);
 void nn_update_weights(NN nn, NN gradient, float learning_rate);
 void nn_zero(NN nn);
 
@@ -49,6 +164,23 @@ void nn_zero(NN nn);
 #define NN_OUTPUT(nn) (nn).as[(nn).count]
 #define NN_PRINT(nn) nn_print(nn, #nn)
 
+#define NN_ARENA_HUGE_PAGE (2 * 1024 * 1024)
+#define NN_BENCHMARK_ROUNDS 5
+#define NN_DTYPE_F32 0
+#define NN_DTYPE_I8 1
+#define NN_DTYPE_U8 2
+#define NN_DTYPE_BF16 3
+#define NN_DTYPE_F16 4
+#define NN_DTYPE_U64 5
+#define NN_DTYPE_SPARSE 6
+#define NN_MODEL_ALIGN 64
+#define NN_MODEL_MAGIC "NNMODEL"
+#define NN_MODEL_VERSION 2
+#define NN_RENDER_HPAD 50
+#define NN_RENDER_NEUTRAL_COLOR 0xFFAAAAAA
+#define NN_RENDER_RADIUS 25
+#define NN_RENDER_VPAD 50
+
 #endif // NN_H_
 
 #ifdef NN_IMPLEMENTATION
@@ -58,9 +190,36 @@ float sigmoidf(float x)
   return 1.0f / (1.0f + expf(-x));
 }
 
+// splitmix64. The whole generator is one word, so checkpoints can store it and resume the same sequence. Every thread
+// has its own, so concurrent trainings draw reproducible weights.
+static __thread uint64_t nn_rng = 0x9E3779B97F4A7C15ULL;
+
+void nn_rng_seed(uint64_t state)
+{
+  nn_rng = state;
+}
+
+uint64_t nn_rng_state(void)
+{
+  return nn_rng;
+}
+
+uint64_t nn_splitmix64(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static uint64_t nn_rng_next(void)
+{
+  return nn_splitmix64(&nn_rng);
+}
+
 float rand_float(void)
 {
-  return (float) rand() / (float) RAND_MAX;
+  return (float) (nn_rng_next() >> 40) / (float) (1 << 24);
 }
 
 Matrix matrix_alloc(size_t rows, size_t cols)
@@ -84,20 +243,86 @@ void matrix_copy(Matrix dst, Matrix src)
   }
 }
 
+// dst = activation(a * w + bias) in one pass, bias being a single row.
+void matrix_dense(Matrix dst, Matrix a, Matrix w, Matrix bias, int activation)
+{
+  assert(a.cols == w.rows);
+  assert(dst.rows == a.rows);
+  assert(dst.cols == w.cols);
+  assert((bias.rows == 1) && (bias.cols == w.cols));
+  gemm_fused(dst.rows, dst.cols, a.cols, a.items, a.cols, 1, w.items, w.cols, dst.items, dst.cols, bias.items,
+             activation);
+}
+
+// matrix_dense for an a that is mostly zeros, like the images entering the first layer.
+void matrix_dense_sparse(Matrix dst, Matrix a, Matrix w, Matrix bias, int activation)
+{
+  assert(a.cols == w.rows);
+  assert(dst.rows == a.rows);
+  assert(dst.cols == w.cols);
+  assert((bias.rows == 1) && (bias.cols == w.cols));
+  if (!gemm_sparse(dst.rows, dst.cols, a.cols, a.items, a.cols, w.items, w.cols, dst.items, dst.cols, bias.items,
+                   activation)) {
+    matrix_dense(dst, a, w, bias, activation);
+  }
+}
+
 void matrix_dot(Matrix dst, Matrix a, Matrix b)
 {
   assert(a.cols == b.rows);
-  size_t n = a.cols;
   assert(dst.rows == a.rows);
   assert(dst.cols == b.cols);
-  for (size_t i = 0; i < dst.rows; ++i) {
-    for (size_t j = 0; j < dst.cols; ++j) {
-      MATRIX_AT(dst, i, j) = 0;
-      for (size_t k = 0; k < n; ++k) {
-        MATRIX_AT(dst, i, j) += MATRIX_AT(a, i, k) * MATRIX_AT(b, k, j); 
-      }
+  gemm(dst.rows, dst.cols, a.cols, a.items, a.cols, 1, b.items, b.cols, dst.items, dst.cols);
+}
+
+void matrix_dot_at(Matrix dst, Matrix a, Matrix b)
+{
+  assert(a.rows == b.rows);
+  assert(dst.rows == a.cols);
+  assert(dst.cols == b.cols);
+  gemm(dst.rows, dst.cols, a.rows, a.items, 1, a.cols, b.items, b.cols, dst.items, dst.cols);
+}
+
+// matrix_dot_at for an a that is mostly zeros.
+void matrix_dot_at_sparse(Matrix dst, Matrix a, Matrix b)
+{
+  assert(a.rows == b.rows);
+  assert(dst.rows == a.cols);
+  assert(dst.cols == b.cols);
+  if (!gemm_sparse_at(a.rows, dst.cols, a.cols, a.items, a.cols, b.items, b.cols, dst.items, dst.cols)) {
+    matrix_dot_at(dst, a, b);
+  }
+}
+
+void matrix_dot_bt(Matrix dst, Matrix a, Matrix b)
+{
+  assert(a.cols == b.cols);
+  assert(dst.rows == a.rows);
+  assert(dst.cols == b.rows);
+
+  static __thread float *packed = NULL;
+  static __thread size_t packed_cap = 0;
+  size_t packed_len = b.rows * b.cols;
+  if (packed_len > packed_cap) {
+    free(packed);
+    packed = malloc(sizeof(*packed) * packed_len);
+    assert(packed != NULL);
+    packed_cap = packed_len;
+  }
+  for (size_t i = 0; i < b.rows; ++i) {
+    for (size_t j = 0; j < b.cols; ++j) {
+      packed[j * b.rows + i] = MATRIX_AT(b, i, j);
     }
   }
+  gemm(dst.rows, dst.cols, a.cols, a.items, a.cols, 1, packed, b.rows, dst.items, dst.cols);
+}
+
+void matrix_from_bytes(Matrix dst, const uint8_t *bytes)
+{
+  size_t count = dst.rows * dst.cols;
+  for (size_t i = 0; i < count; ++i) {
+    dst.items[i] = (float) bytes[i] / MAX_BRIGHTNESS;
+  }
 }
 
 void matrix_fill(Matrix matrix, float x)
@@ -131,35 +356,41 @@ void matrix_rand(Matrix matrix, float low, float high)
   }
 }
 
+Matrix matrix_rows(Matrix matrix, size_t start, size_t count)
+{
+  assert(start + count <= matrix.rows);
+  Matrix view;
+  view.rows = count;
+  view.cols = matrix.cols;
+  view.items = &MATRIX_AT(matrix, start, 0);
+  return view;
+}
+
 void matrix_sig(Matrix matrix)
 {
-  for (size_t i = 0; i < matrix.rows; ++i) {
-    for (size_t j = 0; j < matrix.cols; ++j) {
-      MATRIX_AT(matrix, i, j) = sigmoidf(MATRIX_AT(matrix, i, j));
-    }
-  }
+  vmath_sigmoid(matrix.items, matrix.rows * matrix.cols);
 }
 
 void matrix_softmax(Matrix matrix)
 {
-  float max_value = 0;
   for (size_t i = 0; i < matrix.rows; ++i) {
-    for (size_t j = 0; j < matrix.cols; ++j) {
+    float max_value = MATRIX_AT(matrix, i, 0);
+    for (size_t j = 1; j < matrix.cols; ++j) {
       if (MATRIX_AT(matrix, i, j) > max_value) {
         max_value = MATRIX_AT(matrix, i, j);
       }
     }
-  }
-    
-  float exp_sum = 0;
-  for (size_t i = 0; i < matrix.rows; ++i) {
+
+    for (size_t j = 0; j < matrix.cols; ++j) {
+      MATRIX_AT(matrix, i, j) -= max_value;
+    }
+    vmath_exp(&MATRIX_AT(matrix, i, 0), matrix.cols);
+
+    float exp_sum = 0;
     for (size_t j = 0; j < matrix.cols; ++j) {
-      MATRIX_AT(matrix, i, j) = expf(MATRIX_AT(matrix, i, j) - max_value);
       exp_sum += MATRIX_AT(matrix, i, j);
     }
-  }
 
-  for (size_t i = 0; i < matrix.rows; ++i) {
     for (size_t j = 0; j < matrix.cols; ++j) {
       MATRIX_AT(matrix, i, j) /= exp_sum;
     }
@@ -177,88 +408,408 @@ void matrix_sum(Matrix dst, Matrix a)
   }
 }
 
+void matrix_sum_cols(Matrix dst, Matrix a)
+{
+  assert(dst.rows == 1);
+  assert(dst.cols == a.cols);
+  for (size_t i = 0; i < a.rows; ++i) {
+    for (size_t j = 0; j < a.cols; ++j) {
+      MATRIX_AT(dst, 0, j) += MATRIX_AT(a, i, j);
+    }
+  }
+}
+
+void matrix_sum_row(Matrix dst, Matrix row)
+{
+  assert(row.rows == 1);
+  assert(dst.cols == row.cols);
+  for (size_t i = 0; i < dst.rows; ++i) {
+    for (size_t j = 0; j < dst.cols; ++j) {
+      MATRIX_AT(dst, i, j) += MATRIX_AT(row, 0, j);
+    }
+  }
+}
+
+// Returns zeroed memory aligned to NN_MODEL_ALIGN. With NN_HUGEPAGES=1 arenas of a huge page or more are aligned to
+// one and advised to be backed by transparent huge pages.
+static float *nn_arena_alloc(size_t count)
+{
+  size_t len = count * sizeof(float);
+  size_t alignment = NN_MODEL_ALIGN;
+  const char *huge = getenv("NN_HUGEPAGES");
+  int use_huge = (huge != NULL) && (strcmp(huge, "1") == 0) && (len >= NN_ARENA_HUGE_PAGE);
+  if (use_huge) {
+    alignment = NN_ARENA_HUGE_PAGE;
+    len = (len + NN_ARENA_HUGE_PAGE - 1) & ~((size_t) NN_ARENA_HUGE_PAGE - 1);
+  }
+
+  void *arena = NULL;
+  if ((len == 0) || (posix_memalign(&arena, alignment, len) != 0)) {
+    arena = NULL;
+  }
+  assert(arena != NULL);
+#ifdef MADV_HUGEPAGE
+  if (use_huge) {
+    madvise(arena, len, MADV_HUGEPAGE);
+  }
+#endif
+  memset(arena, 0, len);
+  return arena;
+}
+
+static size_t nn_arena_floats(size_t count)
+{
+  return ((count * sizeof(float) + NN_MODEL_ALIGN - 1) & ~((size_t) NN_MODEL_ALIGN - 1)) / sizeof(float);
+}
+
+// Points ws and bs, whose shapes must be set, into params and returns the length of the arena in floats. The layout is
+// the payload of a v2 model file, every tensor starting NN_MODEL_ALIGN aligned, so saving writes the arena as it is.
+// With params NULL only the length is computed.
+static size_t nn_params_bind(NN nn, float *params)
+{
+  size_t offset = 0;
+  for (size_t l = 0; l < nn.count; ++l) {
+    Matrix *ms[2] = {&nn.ws[l], &nn.bs[l]};
+    for (size_t m = 0; m < 2; ++m) {
+      if (params != NULL) {
+        ms[m]->items = params + offset;
+      }
+      offset += nn_arena_floats(ms[m]->rows * ms[m]->cols);
+    }
+  }
+  return offset;
+}
+
 NN nn_alloc(size_t *arch, size_t arch_count)
+{
+  return nn_alloc_batch(arch, arch_count, 1);
+}
+
+// All the activations of a batch share one arena, owned through as[0].
+NN nn_alloc_activations(NN nn, size_t batch_size)
+{
+  NN batch = nn;
+  batch.as = malloc(sizeof(*batch.as) * (batch.count + 1));
+  assert(batch.as != NULL);
+  size_t count = nn_arena_floats(batch_size * nn.ws[0].rows);
+  for (size_t l = 0; l < batch.count; ++l) {
+    count += nn_arena_floats(batch_size * nn.ws[l].cols);
+  }
+
+  float *arena = nn_arena_alloc(count);
+  for (size_t l = 0; l <= batch.count; ++l) {
+    batch.as[l].rows = batch_size;
+    batch.as[l].cols = l == 0 ? nn.ws[0].rows : nn.ws[l-1].cols;
+    batch.as[l].items = arena;
+    arena += nn_arena_floats(batch_size * batch.as[l].cols);
+  }
+  return batch;
+}
+
+NN nn_alloc_params(NN nn)
+{
+  NN copy = nn;
+  copy.map = NULL;
+  copy.map_len = 0;
+  copy.ws = malloc(sizeof(*copy.ws) * copy.count);
+  assert(copy.ws != NULL);
+  copy.bs = malloc(sizeof(*copy.bs) * copy.count);
+  assert(copy.bs != NULL);
+  memcpy(copy.ws, nn.ws, sizeof(*copy.ws) * copy.count);
+  memcpy(copy.bs, nn.bs, sizeof(*copy.bs) * copy.count);
+  copy.params = nn_arena_alloc(copy.param_count);
+  nn_params_bind(copy, copy.params);
+  return copy;
+}
+
+NN nn_alloc_batch(size_t *arch, size_t arch_count, size_t batch_size)
 {
   assert(arch_count > 0);
   NN nn;
   nn.count = arch_count - 1;
+  nn.map = NULL;
+  nn.map_len = 0;
 
   nn.ws = malloc(sizeof(*nn.ws) * nn.count);
   assert(nn.ws != NULL);
   nn.bs = malloc(sizeof(*nn.bs) * nn.count);
   assert(nn.bs != NULL);
-  nn.as = malloc(sizeof(*nn.as) * (nn.count + 1));
-  assert(nn.as != NULL);
-
-  nn.as[0] = matrix_alloc(1, arch[0]); 
   for (size_t i = 1; i < arch_count; ++i) {
-    nn.ws[i-1] = matrix_alloc(nn.as[i-1].cols, arch[i]);
-    nn.bs[i-1] = matrix_alloc(1, arch[i]);
-    nn.as[i] = matrix_alloc(1, arch[i]);
+    nn.ws[i-1].rows = arch[i-1];
+    nn.ws[i-1].cols = arch[i];
+    nn.bs[i-1].rows = 1;
+    nn.bs[i-1].cols = arch[i];
+  }
+
+  nn.param_count = nn_params_bind(nn, NULL);
+  nn.params = nn_arena_alloc(nn.param_count);
+  nn_params_bind(nn, nn.params);
+  return nn_alloc_activations(nn, batch_size);
+}
+
+// Evaluates both models on dataset, best of NN_BENCHMARK_ROUNDS alternating rounds for the timings.
+void nn_compare(NN_Model baseline, NN_Model model, Pool *pool, Dataset dataset)
+{
+  printf("Comparing the %s (%s) and %s (%s) models...\n", baseline.dtype, baseline.kernel, model.dtype, model.kernel);
+
+  NN_Model models[2] = {baseline, model};
+  NN_Evaluator evaluators[2];
+  NN_Evaluation evaluations[2];
+  double best[2] = {0.0, 0.0};
+  for (size_t m = 0; m < 2; ++m) {
+    evaluators[m] = nn_evaluator_alloc(models[m], pool);
+  }
+  for (size_t r = 0; r < NN_BENCHMARK_ROUNDS; ++r) {
+    for (size_t m = 0; m < 2; ++m) {
+      double start = prof_now();
+      nn_evaluate(&evaluators[m], dataset, &evaluations[m]);
+      double seconds = prof_now() - start;
+      if ((r == 0) || (seconds < best[m])) {
+        best[m] = seconds;
+      }
+    }
+  }
+
+  float accuracies[2];
+  for (size_t m = 0; m < 2; ++m) {
+    accuracies[m] = (float) evaluations[m].correct * MAX_PERCENT / evaluations[m].count;
+    printf("%s: %zu / %zu (%.2f %%), %.0f images/s, %zu bytes of parameters, %zu FLOPs per image\n", models[m].dtype,
+           evaluations[m].correct, evaluations[m].count, accuracies[m], dataset.count / best[m], models[m].bytes,
+           models[m].flops);
+    nn_evaluator_free(evaluators[m]);
+  }
+  printf("Accuracy delta: %+.2f %%, speedup: %.2fx\n", accuracies[1] - accuracies[0], best[0] / best[1]);
+}
+
+static void nn_evaluate_task(void *context, size_t thread_index, size_t thread_count)
+{
+  NN_Evaluator *evaluator = context;
+  void *batch = evaluator->batches[thread_index];
+  NN_Evaluation *evaluation = &evaluator->partials[thread_index];
+  memset(evaluation, 0, sizeof(*evaluation));
+  prof_counters = evaluator->counters != NULL ? &evaluator->counters[thread_index] : NULL;
+
+  for (;;) {
+    size_t start = __atomic_fetch_add(&evaluator->next, EVALUATION_BATCH, __ATOMIC_RELAXED);
+    if (start >= evaluator->dataset.count) {
+      break;
+    }
+    size_t count = evaluator->dataset.count - start;
+    if (count > EVALUATION_BATCH) {
+      count = EVALUATION_BATCH;
+    }
+
+    Dataset dataset = evaluator->dataset;
+    NN_Model model = evaluator->model;
+    Matrix outputs = model.forward(model.model, batch, &dataset.images[start * dataset.image_len], count);
+    nn_evaluation_add(evaluation, outputs, &dataset.labels[start]);
+  }
+  prof_counters = NULL;
+}
+
+void nn_evaluate(NN_Evaluator *evaluator, Dataset dataset, NN_Evaluation *evaluation)
+{
+  assert(dataset.image_len == evaluator->model.inputs);
+  evaluator->next = 0;
+  evaluator->dataset = dataset;
+  pool_run(evaluator->pool, nn_evaluate_task, evaluator);
+  nn_evaluation_merge(evaluation, evaluator->partials, evaluator->pool->count);
+}
+
+// Counts the rows of outputs whose largest column is the label.
+void nn_evaluation_add(NN_Evaluation *evaluation, Matrix outputs, const uint8_t *labels)
+{
+  for (size_t i = 0; i < outputs.rows; ++i) {
+    size_t max_digit = 0;
+    float max_value = MATRIX_AT(outputs, i, 0);
+    for (size_t d = 1; d < outputs.cols; ++d) {
+      if (MATRIX_AT(outputs, i, d) > max_value) {
+        max_value = MATRIX_AT(outputs, i, d);
+        max_digit = d;
+      }
+    }
+    evaluation->confusion[labels[i]][max_digit] += 1;
+    if (max_digit == labels[i]) {
+      evaluation->correct += 1;
+    }
+  }
+  evaluation->count += outputs.rows;
+}
+
+void nn_evaluation_merge(NN_Evaluation *evaluation, const NN_Evaluation *partials, size_t partial_count)
+{
+  memset(evaluation, 0, sizeof(*evaluation));
+  for (size_t t = 0; t < partial_count; ++t) {
+    const NN_Evaluation *partial = &partials[t];
+    evaluation->count += partial->count;
+    evaluation->correct += partial->correct;
+    for (size_t i = 0; i < DIGITS; ++i) {
+      for (size_t j = 0; j < DIGITS; ++j) {
+        evaluation->confusion[i][j] += partial->confusion[i][j];
+      }
+    }
+  }
+}
+
+void nn_evaluation_print(NN_Evaluation evaluation, char *dataset_name)
+{
+  printf("Forwarded %s set. ", dataset_name);
+  printf("Accuracy: %zu / %zu.\n", evaluation.correct, evaluation.count);
+
+  printf("Confusion matrix (rows: label, columns: guess):\n");
+  printf("   ");
+  for (size_t j = 0; j < DIGITS; ++j) {
+    printf(" %6zu", j);
+  }
+  printf("   accuracy\n");
+  for (size_t i = 0; i < DIGITS; ++i) {
+    size_t total = 0;
+    printf("(%zu)", i);
+    for (size_t j = 0; j < DIGITS; ++j) {
+      printf(" %6zu", evaluation.confusion[i][j]);
+      total += evaluation.confusion[i][j];
+    }
+    printf("   %6.2f %%\n", total ? (float) evaluation.confusion[i][i] * MAX_PERCENT / total : 0.0f);
+  }
+}
+
+NN_Evaluator nn_evaluator_alloc(NN_Model model, Pool *pool)
+{
+  NN_Evaluator evaluator;
+  memset(&evaluator, 0, sizeof(evaluator));
+  evaluator.pool = pool;
+  evaluator.model = model;
+  evaluator.batches = malloc(sizeof(*evaluator.batches) * pool->count);
+  assert(evaluator.batches != NULL);
+  evaluator.partials = malloc(sizeof(*evaluator.partials) * pool->count);
+  assert(evaluator.partials != NULL);
+  if (PROF_ENABLED) {
+    evaluator.counters = calloc(pool->count, sizeof(*evaluator.counters));
+    assert(evaluator.counters != NULL);
+  }
+  for (size_t t = 0; t < pool->count; ++t) {
+    evaluator.batches[t] = model.alloc_batch(model.model, EVALUATION_BATCH);
+  }
+  return evaluator;
+}
+
+void nn_evaluator_free(NN_Evaluator evaluator)
+{
+  for (size_t t = 0; t < evaluator.pool->count; ++t) {
+    evaluator.model.free_batch(evaluator.model.model, evaluator.batches[t]);
+  }
+  free(evaluator.batches);
+  free(evaluator.partials);
+  free(evaluator.counters);
+}
+
+// Runs every layer of nn over its activations, the last one with last_activation.
+static void nn_forward_layers(NN nn, int last_activation)
+{
+  for (size_t l = 0; l < nn.count; ++l) {
+    int activation = (l + 1) < nn.count ? GEMM_SIGMOID : last_activation;
+    double start = prof_layer_begin();
+    if (l == 0) {
+      matrix_dense_sparse(nn.as[l+1], nn.as[l], nn.ws[l], nn.bs[l], activation);
+    } else {
+      matrix_dense(nn.as[l+1], nn.as[l], nn.ws[l], nn.bs[l], activation);
+    }
+    prof_layer_end(0, l, start, 2.0 * nn.as[l].rows * nn.ws[l].rows * nn.ws[l].cols);
   }
-  return nn;
 }
 
 void nn_forward(NN nn)
 {
-  for (int l = 0; l < nn.count; ++l) {
-    matrix_dot(nn.as[l+1], nn.as[l], nn.ws[l]);
-    matrix_sum(nn.as[l+1], nn.bs[l]);
-    matrix_sig(nn.as[l+1]);
+  nn_forward_layers(nn, GEMM_SIGMOID);
+}
+
+void nn_free(NN nn)
+{
+  nn_free_activations(nn);
+  nn_free_params(nn);
+}
+
+void nn_free_activations(NN nn)
+{
+  free(nn.as[0].items);
+  free(nn.as);
+}
+
+void nn_free_params(NN nn)
+{
+  if (nn.map != NULL) {
+    munmap(nn.map, nn.map_len);
+  } else {
+    free(nn.params);
   }
+  free(nn.ws);
+  free(nn.bs);
 }
 
 void nn_get_average_gradient(NN gradient, size_t data_count)
 {
-  for (size_t l = 0; l < gradient.count; ++l) {
-    for (size_t i = 0; i < gradient.ws[l].rows; ++i) {
-      for (size_t j = 0; j < gradient.ws[l].cols; ++j) {
-        MATRIX_AT(gradient.ws[l], i, j) /= data_count;
+  vmath_scale(gradient.params, 1.0f / data_count, gradient.param_count);
+}
+
+void nn_get_batch_gradient(NN nn, NN gradient)
+{
+  for (size_t l = nn.count; l > 0; --l) {
+    double start = prof_layer_begin();
+    Matrix delta = gradient.as[l];
+    for (size_t i = 0; i < delta.rows; ++i) {
+      for (size_t j = 0; j < delta.cols; ++j) {
+        float a = MATRIX_AT(nn.as[l], i, j);
+        MATRIX_AT(delta, i, j) = 2 * MATRIX_AT(delta, i, j) * a * (1 - a);
       }
     }
-    for (size_t i = 0; i < gradient.bs[l].rows; ++i) {
-      for (size_t j = 0; j < gradient.bs[l].cols; ++j) {
-        MATRIX_AT(gradient.bs[l], i, j) /= data_count;
-      }
+    matrix_fill(gradient.bs[l-1], 0);
+    matrix_sum_cols(gradient.bs[l-1], delta);
+    if (l == 1) {
+      matrix_dot_at_sparse(gradient.ws[l-1], nn.as[l-1], delta);
+    } else {
+      matrix_dot_at(gradient.ws[l-1], nn.as[l-1], delta);
+    }
+    if (l > 1) {
+      matrix_dot_bt(gradient.as[l-1], delta, nn.ws[l-1]);
     }
+    prof_layer_end(1, l - 1, start, (l > 1 ? 4.0 : 2.0) * delta.rows * nn.ws[l-1].rows * nn.ws[l-1].cols);
   }
 }
 
+// Adds the gradient of a single sample, whose output error is in gradient.as[nn.count], to gradient. Each layer turns
+// its error into a delta in place, accumulates the outer product of the previous activations and the delta row by row
+// into the weights, and propagates W * delta to the layer below. Nothing is propagated into the input layer.
 void nn_get_total_gradient(NN nn, NN gradient)
 {
   for (size_t l = nn.count; l > 0; --l) {
-    for (size_t j = 0; j < nn.as[l].cols; ++j) {
+    Matrix delta = gradient.as[l];
+    for (size_t j = 0; j < delta.cols; ++j) {
       float a = MATRIX_AT(nn.as[l], 0, j);
-      float da = MATRIX_AT(gradient.as[l], 0, j);
-      MATRIX_AT(gradient.bs[l-1], 0, j) += 2 * da * a * (1 - a);
-      for (size_t k = 0; k < nn.as[l-1].cols; ++k) {
-        float prev_a = MATRIX_AT(nn.as[l-1], 0, k);
-        float w = MATRIX_AT(nn.ws[l-1], k, j);
-        MATRIX_AT(gradient.ws[l-1], k, j) += 2 * da * a * (1 - a) * prev_a;
-        MATRIX_AT(gradient.as[l-1], 0, k) += 2 * da * a * (1 - a) * w;
+      MATRIX_AT(delta, 0, j) = 2 * MATRIX_AT(delta, 0, j) * a * (1 - a);
+    }
+    vmath_axpy(gradient.bs[l-1].items, 1.0f, delta.items, delta.cols);
+    for (size_t k = 0; k < nn.as[l-1].cols; ++k) {
+      float prev_a = MATRIX_AT(nn.as[l-1], 0, k);
+      if (prev_a != 0.0f) {
+        vmath_axpy(&MATRIX_AT(gradient.ws[l-1], k, 0), prev_a, delta.items, delta.cols);
       }
     }
+    if (l > 1) {
+      Matrix w = nn.ws[l-1];
+      gemm(w.rows, 1, w.cols, w.items, w.cols, 1, delta.items, 1, gradient.as[l-1].items, 1);
+    }
   }
 }
 
-void nn_guess(NN nn)
+void nn_guess(NN_Model model, const uint8_t *pixels)
 {
   printf("Guessing the number...\n");
-  
-  for (size_t l = 0; l < nn.count; ++l) {
-    matrix_dot(nn.as[l+1], nn.as[l], nn.ws[l]);
-    matrix_sum(nn.as[l+1], nn.bs[l]);
-    if ((l + 1) < nn.count)  {
-      matrix_sig(nn.as[l+1]);
-    }
-  }
 
-  matrix_softmax(NN_OUTPUT(nn));
-
-  printf("Calculated probabilities:\n");
-  for (size_t i = 0; i < DIGITS; ++i) {
-    printf("(%zu) -> %f %%\n", i, MATRIX_AT(NN_OUTPUT(nn), 0, i) * MAX_PERCENT);
-  }
+  void *batch = model.alloc_batch(model.model, 1);
+  Matrix output = model.forward(model.model, batch, pixels, 1);
+  matrix_softmax(output);
+  nn_print_probabilities(output.items);
+  model.free_batch(model.model, batch);
 }
 
 void nn_init(NN nn)
@@ -271,36 +822,377 @@ void nn_init(NN nn)
   }
 }
 
-void nn_load(NN nn, char *save_path, char *filename)
+static size_t nn_model_align(size_t offset)
+{
+  return (offset + NN_MODEL_ALIGN - 1) & ~((size_t) NN_MODEL_ALIGN - 1);
+}
+
+static uint64_t nn_model_checksum(const uint8_t *bytes, size_t len)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static int nn_read_all(int file_descriptor, void *buf, size_t len)
+{
+  uint8_t *bytes = buf;
+  while (len > 0) {
+    ssize_t n = read(file_descriptor, bytes, len);
+    if (n <= 0) {
+      return 0;
+    }
+    bytes += n;
+    len -= n;
+  }
+  return 1;
+}
+
+// Reads the v2 header, returns 0 when the file has none (a legacy model).
+static int nn_model_header(int file_descriptor, size_t file_len, NN_Model_Header *header)
+{
+  return (file_len >= sizeof(*header)) && (pread(file_descriptor, header, sizeof(*header), 0) == sizeof(*header)) &&
+         (memcmp(header->magic, NN_MODEL_MAGIC, sizeof(header->magic)) == 0);
+}
+
+// Maps a v2 model and checks the tables and the payload against the header. The dtype and tensor count are left to the
+// caller.
+static uint8_t *nn_model_map(int file_descriptor, size_t file_len, NN_Model_Header header)
+{
+  size_t table_len = header.layer_count * sizeof(uint32_t) + header.tensor_count * sizeof(NN_Model_Tensor);
+  if ((header.version != NN_MODEL_VERSION) || ((file_len - sizeof(header)) < table_len) ||
+      (header.payload_offset > file_len) || (header.payload_size > file_len - header.payload_offset)) {
+    fprintf(stderr, "Invalid model header.");
+    return NULL;
+  }
+
+  uint8_t *map = mmap(NULL, file_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, file_descriptor, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Error mapping the model.");
+    return NULL;
+  }
+  if (nn_model_checksum(map + header.payload_offset, header.payload_size) != header.checksum) {
+    fprintf(stderr, "The model checksum does not match.");
+    munmap(map, file_len);
+    return NULL;
+  }
+  return map;
+}
+
+static int nn_model_tensor_check(NN_Model_Header header, const NN_Model_Tensor *tensor, uint32_t dtype, size_t rows,
+                                 size_t cols, size_t item_size)
+{
+  // The payload end cannot wrap, nn_model_map checked it against the file; the tensor fields come straight from the
+  // file and are compared without adding them.
+  uint64_t end = header.payload_offset + header.payload_size;
+  uint64_t size;
+  return (tensor->dtype == dtype) && (tensor->rows == rows) && (tensor->cols == cols) &&
+         ((tensor->offset % NN_MODEL_ALIGN) == 0) && (tensor->offset >= header.payload_offset) &&
+         !__builtin_mul_overflow((uint64_t) tensor->rows * tensor->cols, (uint64_t) item_size, &size) &&
+         (tensor->size == size) && (tensor->offset <= end) && (tensor->size <= end - tensor->offset);
+}
+
+// Writes a v2 model whose payload is already laid out: tensors must be filled in, with their offsets relative to the
+// start of the payload, and are moved past the header and the tables here.
+static void nn_model_write_payload(char *path, uint32_t dtype, const uint32_t *arch, size_t layer_count,
+                                   NN_Model_Tensor *tensors, size_t tensor_count, const void *payload,
+                                   size_t payload_size)
+{
+  NN_Model_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, NN_MODEL_MAGIC, sizeof(header.magic));
+  header.version = NN_MODEL_VERSION;
+  header.dtype = dtype;
+  header.layer_count = layer_count;
+  header.tensor_count = tensor_count;
+
+  size_t table_len = layer_count * sizeof(uint32_t) + tensor_count * sizeof(NN_Model_Tensor);
+  header.payload_offset = nn_model_align(sizeof(header) + table_len);
+  header.payload_size = payload_size;
+  header.checksum = nn_model_checksum(payload, payload_size);
+  for (size_t t = 0; t < tensor_count; ++t) {
+    tensors[t].offset += header.payload_offset;
+  }
+
+  uint8_t *head = calloc(header.payload_offset, 1);
+  assert(head != NULL);
+  memcpy(head, &header, sizeof(header));
+  memcpy(head + sizeof(header), arch, layer_count * sizeof(*arch));
+  memcpy(head + sizeof(header) + layer_count * sizeof(*arch), tensors, tensor_count * sizeof(*tensors));
+
+  FILE *fptr;
+  if ((fptr = fopen(path, "wb")) == NULL) {
+    fprintf(stderr, "Error opening the file.");
+    exit(1);
+  }
+  // Synced so a file published by a rename afterwards is never seen half written, even after a crash.
+  if ((fwrite(head, 1, header.payload_offset, fptr) != header.payload_offset) ||
+      (fwrite(payload, 1, payload_size, fptr) != payload_size) || (fflush(fptr) != 0) || (fsync(fileno(fptr)) != 0)) {
+    fprintf(stderr, "Error writing the model.");
+    exit(1);
+  }
+
+  fclose(fptr);
+  free(head);
+}
+
+// Writes a v2 model from separate tensors. The tensor offsets are filled in here, everything else in tensors must be
+// set by the caller.
+static void nn_model_write(char *path, uint32_t dtype, const uint32_t *arch, size_t layer_count,
+                           NN_Model_Tensor *tensors, const void **data, size_t tensor_count)
+{
+  size_t payload_size = 0;
+  for (size_t t = 0; t < tensor_count; ++t) {
+    tensors[t].offset = payload_size;
+    payload_size = nn_model_align(payload_size + tensors[t].size);
+  }
+
+  uint8_t *payload = calloc(payload_size, 1);
+  assert(payload != NULL);
+  for (size_t t = 0; t < tensor_count; ++t) {
+    memcpy(payload + tensors[t].offset, data[t], tensors[t].size);
+  }
+  nn_model_write_payload(path, dtype, arch, layer_count, tensors, tensor_count, payload, payload_size);
+  free(payload);
+}
+
+int nn_model_dtype(char *path)
+{
+  int file_descriptor = open(path, O_RDONLY);
+  if (file_descriptor == -1) {
+    return -1;
+  }
+  struct stat st;
+  NN_Model_Header header;
+  int dtype = NN_DTYPE_F32;
+  if ((fstat(file_descriptor, &st) == 0) && nn_model_header(file_descriptor, st.st_size, &header)) {
+    dtype = header.dtype;
+  }
+  close(file_descriptor);
+  return dtype;
+}
+
+// Opens a v2 model whose dtype is one of dtypes, a mask of 1 << dtype, and which holds tensors_per_layer tensors per
+// layer and extra_tensors more, and maps it. The tensors themselves are left to the caller.
+static NN_Model_File nn_model_open(char *save_path, char *filename, uint32_t dtypes, size_t tensors_per_layer,
+                                   size_t extra_tensors)
 {
   char fullname[MAX_FILEPATH_LEN];
-  strcpy(fullname, save_path);
-  strcat(fullname, filename);
+  snprintf(fullname, sizeof(fullname), "%s%s", save_path, filename);
 
   int file_descriptor = open(fullname, O_RDONLY);
   if (file_descriptor == -1) {
     fprintf(stderr, "Error loading the model.");
     exit(1);
   }
+  struct stat st;
+  if (fstat(file_descriptor, &st) == -1) {
+    fprintf(stderr, "Error loading the model.");
+    exit(1);
+  }
+
+  NN_Model_File file;
+  file.map_len = st.st_size;
+  NN_Model_Header header;
+  if (!nn_model_header(file_descriptor, file.map_len, &header) || (header.dtype >= 32) ||
+      ((dtypes & (1u << header.dtype)) == 0) || (header.layer_count < 2) ||
+      (header.tensor_count != tensors_per_layer * (header.layer_count - 1) + extra_tensors)) {
+    fprintf(stderr, "Invalid model header.");
+    exit(1);
+  }
+  file.header = header;
+  file.map = nn_model_map(file_descriptor, file.map_len, header);
+  close(file_descriptor);
+  if (file.map == NULL) {
+    exit(1);
+  }
+
+  const uint32_t *arch = (const uint32_t *) (file.map + sizeof(header));
+  file.tensors = (const NN_Model_Tensor *) (arch + header.layer_count);
+  file.widths = malloc(sizeof(*file.widths) * header.layer_count);
+  assert(file.widths != NULL);
+  for (size_t l = 0; l < header.layer_count; ++l) {
+    file.widths[l] = arch[l];
+  }
+  return file;
+}
 
-  float buf[IMAGE_UNIT_LEN];
+static int nn_load_legacy(NN nn, int file_descriptor, size_t file_len)
+{
+  size_t expected_len = 0;
+  for (size_t l = 0; l < nn.count; ++l) {
+    expected_len += (nn.ws[l].rows * nn.ws[l].cols + nn.bs[l].cols) * sizeof(float);
+  }
+  if (file_len != expected_len) {
+    fprintf(stderr, "Unknown model format.");
+    return 0;
+  }
 
   for (size_t l = 0; l < nn.count; ++l) {
-    for (size_t i = 0; i < nn.ws[l].rows; ++i) {
-      read(file_descriptor, buf, nn.ws[l].cols * sizeof(float));
-      for (size_t j = 0; j < nn.ws[l].cols; ++j) {
-        MATRIX_AT(nn.ws[l], i, j) = buf[j];
-      }
+    if (!nn_read_all(file_descriptor, nn.ws[l].items, nn.ws[l].rows * nn.ws[l].cols * sizeof(float)) ||
+        !nn_read_all(file_descriptor, nn.bs[l].items, nn.bs[l].cols * sizeof(float))) {
+      fprintf(stderr, "Error loading the model.");
+      return 0;
     }
-    for (size_t i = 0; i < nn.bs[l].rows; ++i) {
-      read(file_descriptor, buf, nn.bs[l].cols * sizeof(float));
-      for (size_t j = 0; j < nn.bs[l].cols; ++j) {
-        MATRIX_AT(nn.bs[l], i, j) = buf[j];
-      }
+  }
+  return 1;
+}
+
+NN nn_load(char *save_path, char *filename, size_t *legacy_arch, size_t legacy_arch_count)
+{
+  char fullname[MAX_FILEPATH_LEN];
+  snprintf(fullname, sizeof(fullname), "%s%s", save_path, filename);
+
+  NN nn;
+  if (!nn_load_file(fullname, legacy_arch, legacy_arch_count, &nn)) {
+    exit(1);
+  }
+  return nn;
+}
+
+static int nn_load_map(char *path, size_t *legacy_arch, size_t legacy_arch_count, NN *result)
+{
+  int file_descriptor = open(path, O_RDONLY);
+  if (file_descriptor == -1) {
+    fprintf(stderr, "Error loading the model.");
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(file_descriptor, &st) == -1) {
+    fprintf(stderr, "Error loading the model.");
+    close(file_descriptor);
+    return 0;
+  }
+  size_t file_len = st.st_size;
+
+  NN_Model_Header header;
+  if (!nn_model_header(file_descriptor, file_len, &header)) {
+    NN nn = nn_alloc(legacy_arch, legacy_arch_count);
+    int loaded = nn_load_legacy(nn, file_descriptor, file_len);
+    close(file_descriptor);
+    if (!loaded) {
+      nn_free(nn);
+      return 0;
     }
+    *result = nn;
+    return 1;
   }
 
+  if ((header.dtype != NN_DTYPE_F32) || (header.layer_count < 2) ||
+      (header.tensor_count != 2 * (header.layer_count - 1))) {
+    fprintf(stderr, "Invalid model header.");
+    close(file_descriptor);
+    return 0;
+  }
+  uint8_t *map = nn_model_map(file_descriptor, file_len, header);
   close(file_descriptor);
+  if (map == NULL) {
+    return 0;
+  }
+
+  const uint32_t *arch = (const uint32_t *) (map + sizeof(header));
+  const NN_Model_Tensor *tensors = (const NN_Model_Tensor *) (arch + header.layer_count);
+
+  NN nn;
+  nn.count = header.layer_count - 1;
+  nn.ws = malloc(sizeof(*nn.ws) * nn.count);
+  assert(nn.ws != NULL);
+  nn.bs = malloc(sizeof(*nn.bs) * nn.count);
+  assert(nn.bs != NULL);
+  nn.map = map;
+  nn.map_len = file_len;
+  for (size_t l = 0; l < nn.count; ++l) {
+    nn.ws[l].rows = arch[l];
+    nn.ws[l].cols = arch[l+1];
+    nn.bs[l].rows = 1;
+    nn.bs[l].cols = arch[l+1];
+  }
+
+  // The payload is the parameter arena, so the model is used in place once every tensor sits where the arena expects.
+  nn.param_count = nn_params_bind(nn, NULL);
+  int valid = header.payload_size == nn.param_count * sizeof(float);
+  if (valid) {
+    nn.params = (float *) (map + header.payload_offset);
+    nn_params_bind(nn, nn.params);
+  }
+  for (size_t t = 0; valid && (t < header.tensor_count); ++t) {
+    Matrix matrix = (t % 2) == 0 ? nn.ws[t/2] : nn.bs[t/2];
+    valid = nn_model_tensor_check(header, &tensors[t], NN_DTYPE_F32, matrix.rows, matrix.cols, sizeof(float)) &&
+            (tensors[t].offset == (uint64_t) ((uint8_t *) matrix.items - map));
+  }
+  if (!valid) {
+    fprintf(stderr, "Invalid model tensor.");
+    free(nn.ws);
+    free(nn.bs);
+    munmap(map, file_len);
+    return 0;
+  }
+
+  *result = nn_alloc_activations(nn, 1);
+  return 1;
+}
+
+int nn_load_file(char *path, size_t *legacy_arch, size_t legacy_arch_count, NN *result)
+{
+  double start = prof_now();
+  int loaded = nn_load_map(path, legacy_arch, legacy_arch_count, result);
+  if (loaded) {
+    prof_emit("\"model_load\",\"path\":%s,\"bytes\":%zu,\"seconds\":%.6f", prof_quote(path),
+              result->param_count * sizeof(float), prof_now() - start);
+  }
+  return loaded;
+}
+
+static void *nn_model_alloc_batch(const void *model, size_t rows)
+{
+  NN *batch = malloc(sizeof(*batch));
+  assert(batch != NULL);
+  *batch = nn_alloc_activations(*(const NN *) model, rows);
+  return batch;
+}
+
+static void nn_model_free_batch(const void *model, void *batch)
+{
+  nn_free_activations(*(NN *) batch);
+  free(batch);
+}
+
+// Forwards the whole batch, as the layers are sized for it, and returns the logits of the first count rows.
+static Matrix nn_model_forward(const void *model, void *batch, const uint8_t *images, size_t count)
+{
+  NN nn = *(NN *) batch;
+  matrix_from_bytes(matrix_rows(NN_INPUT(nn), 0, count), images);
+  nn_forward_layers(nn, GEMM_LINEAR);
+  return matrix_rows(NN_OUTPUT(nn), 0, count);
+}
+
+NN_Model nn_model(const NN *nn)
+{
+  NN_Model model = {nn, "fp32", gemm_kernel_name(), NN_INPUT(*nn).cols, NN_OUTPUT(*nn).cols,
+                    nn->param_count * sizeof(float), 0, nn->count, nn_model_alloc_batch, nn_model_free_batch,
+                    nn_model_forward};
+  for (size_t l = 0; l < nn->count; ++l) {
+    model.flops += 2 * nn->ws[l].rows * nn->ws[l].cols;
+  }
+  return model;
+}
+
+void nn_predict(NN nn)
+{
+  nn_forward_layers(nn, GEMM_LINEAR);
+  matrix_softmax(NN_OUTPUT(nn));
+}
+
+void nn_print_probabilities(const float *probabilities)
+{
+  printf("Calculated probabilities:\n");
+  for (size_t i = 0; i < DIGITS; ++i) {
+    printf("(%zu) -> %f %%\n", i, probabilities[i] * MAX_PERCENT);
+  }
 }
 
 void nn_print(NN nn, const char *name)
@@ -320,62 +1212,70 @@ void nn_print(NN nn, const char *name)
   printf("]\n");
 }
 
-void nn_render(Olivec_Canvas canvas, NN nn)
+NN nn_rows(NN nn, size_t start, size_t count)
 {
-  printf("Rendering the model...\n");
+  NN view = nn;
+  view.as = malloc(sizeof(*view.as) * (view.count + 1));
+  assert(view.as != NULL);
+  for (size_t l = 0; l <= view.count; ++l) {
+    view.as[l] = matrix_rows(nn.as[l], start, count);
+  }
+  return view;
+}
 
-  uint32_t background_color = BACKGROUND_COLOR;
-  uint32_t high_color = HIGH_COLOR;
-  uint32_t low_color = LOW_COLOR;
-  uint32_t neutral_color = 0xFFAAAAAA;
-  uint32_t mask = 0xFF000000;
-  olivec_fill(canvas, background_color);
-
-  int neuron_radius = 25;
-  int layer_border_vpad = 50;
-  int layer_border_hpad = 50;
-  int nn_width = canvas.width - (layer_border_hpad * 2);
-  int nn_height = canvas.height - (layer_border_vpad * 2);
+// Where nn_render puts neuron i of layer l, layer 0 being the input.
+void nn_render_center(Olivec_Canvas canvas, NN nn, size_t l, size_t i, int *x, int *y)
+{
+  int nn_width = canvas.width - (NN_RENDER_HPAD * 2);
+  int nn_height = canvas.height - (NN_RENDER_VPAD * 2);
   int nn_x = (canvas.width / 2) - (nn_width / 2);
   int nn_y = (canvas.height / 2) - (nn_height / 2);
+  int layer_hpad = nn_width / (nn.count + 1);
+  int layer_vpad = nn_height / (l < nn.count ? nn.ws[l].rows : nn.ws[l-1].cols);
+  *x = nn_x + (layer_hpad * l) + (layer_hpad / 2);
+  *y = nn_y + (layer_vpad * i) + (layer_vpad / 2);
+}
+
+// The color of a weight or a bias x, from LOW_COLOR to HIGH_COLOR as sigmoidf(x) goes from 0 to 1.
+uint32_t nn_render_color(float x)
+{
+  uint32_t alpha = floorf(sigmoidf(x) * MAX_BRIGHTNESS);
+  uint32_t color = 0xFF000000 | LOW_COLOR;
+  olivec_blend_color(&color, (alpha<<(8*3)) | HIGH_COLOR);
+  return color;
+}
+
+void nn_render(Olivec_Canvas canvas, NN nn)
+{
+  printf("Rendering the model...\n");
+
+  olivec_fill(canvas, BACKGROUND_COLOR);
   size_t layer_count = nn.count + 1;
-  int layer_hpad = nn_width / layer_count;
   for (size_t l = 0; l < layer_count; ++l) {
-    int layer_vpad1 = nn_height / nn.as[l].cols;  
-    for (size_t i = 0; i < nn.as[l].cols; ++i) {
-      int cx1 = nn_x + (layer_hpad * l) + (layer_hpad / 2);
-      int cy1 = nn_y + (layer_vpad1 * i) + (layer_vpad1 / 2);
+    size_t width = l < nn.count ? nn.ws[l].rows : nn.ws[l-1].cols;
+    for (size_t i = 0; i < width; ++i) {
+      int cx1, cy1;
+      nn_render_center(canvas, nn, l, i, &cx1, &cy1);
       if ((l + 1) < layer_count) {
-        int layer_vpad2 = nn_height / nn.as[l+1].cols;
-        for (size_t j = 0; j < nn.as[l+1].cols; ++j) {
-          int cx2 = nn_x + (layer_hpad * (l + 1)) + (layer_hpad / 2);
-          int cy2 = nn_y + (layer_vpad2 * j) + (layer_vpad2 / 2);
-          uint32_t alpha = floorf(sigmoidf(MATRIX_AT(nn.ws[l], i, j)) * MAX_BRIGHTNESS);
-          uint32_t connection_color = mask | low_color;
-          olivec_blend_color(&connection_color, (alpha<<(8*3)) | high_color);
-          olivec_line(canvas, cx1, cy1, cx2, cy2, connection_color);
-        }   
-      }
-      if (l > 0) {
-          uint32_t alpha = floorf(sigmoidf(MATRIX_AT(nn.bs[l-1], 0, i)) * MAX_BRIGHTNESS);
-          uint32_t neuron_color = mask | low_color;
-          olivec_blend_color(&neuron_color, (alpha<<(8*3)) | high_color);
-          olivec_circle(canvas, cx1, cy1, neuron_radius, neuron_color);
-      } else {
-          olivec_circle(canvas, cx1, cy1, neuron_radius, neutral_color);
+        for (size_t j = 0; j < nn.ws[l].cols; ++j) {
+          int cx2, cy2;
+          nn_render_center(canvas, nn, l + 1, j, &cx2, &cy2);
+          olivec_line(canvas, cx1, cy1, cx2, cy2, nn_render_color(MATRIX_AT(nn.ws[l], i, j)));
+        }
       }
+      uint32_t neuron_color = l > 0 ? nn_render_color(MATRIX_AT(nn.bs[l-1], 0, i)) : NN_RENDER_NEUTRAL_COLOR;
+      olivec_circle(canvas, cx1, cy1, NN_RENDER_RADIUS, neuron_color);
     }
   }
-  
+
   printf("The model has been rendered.\n");
 }
 
-void nn_save(NN nn, char *save_path)
+void nn_save(NN nn, char *save_path, float learning_rate, size_t epochs)
 {
   printf("Saving the model...\n");
 
   char fullname[MAX_FILEPATH_LEN];
-  FILE *fptr;
 
   time_t current_time = time(NULL);
   char date_string[32];
@@ -383,148 +1283,270 @@ void nn_save(NN nn, char *save_path)
 
   strcpy(fullname, save_path);
   strcat(fullname, date_string);
-  strcat(fullname, "_784x48x24x10_");
+  strcat(fullname, "_");
+
+  char arch_string[32];
+  for (size_t l = 0; l <= nn.count; ++l) {
+    snprintf(arch_string, sizeof(arch_string), l < nn.count ? "%zux" : "%zu_", nn.as[l].cols);
+    strcat(fullname, arch_string);
+  }
 
   char learning_rate_string[32];
-  sprintf(learning_rate_string, "%03.0f", LEARNING_RATE * MAX_PERCENT);
+  snprintf(learning_rate_string, sizeof(learning_rate_string), "%g", learning_rate);
   strcat(fullname, learning_rate_string);
   strcat(fullname, "x");
 
   char epochs_string[32];
-  sprintf(epochs_string, "%d", EPOCHS);
+  sprintf(epochs_string, "%zu", epochs);
   strcat(fullname, epochs_string);
 
-  fptr = fopen(fullname, "wb");
-  if ((fptr = fopen(fullname, "wb")) == NULL) {
-    fprintf(stderr, "Error opening the file.");
-    exit(1);
+  nn_save_file(nn, fullname);
+  printf("The model has been saved.\n");
+}
+
+void nn_save_file(NN nn, char *path)
+{
+  double start = prof_now();
+  uint32_t *arch = malloc(sizeof(*arch) * (nn.count + 1));
+  assert(arch != NULL);
+  for (size_t l = 0; l <= nn.count; ++l) {
+    arch[l] = nn.as[l].cols;
   }
 
-  float buf[IMAGE_UNIT_LEN];
-  for (size_t l = 0; l < nn.count; ++l) {
-    for (size_t i = 0; i < nn.ws[l].rows; ++i) {
-      for (size_t j = 0; j < nn.ws[l].cols; ++j) {
-        buf[j] = MATRIX_AT(nn.ws[l], i, j);
-      }
-      fwrite(buf, sizeof(float), nn.ws[l].cols, fptr);
-    }
-    for (size_t i = 0; i < nn.bs[l].rows; ++i) {
-      for (size_t j = 0; j < nn.bs[l].cols; ++j) {
-        buf[j] = MATRIX_AT(nn.bs[l], i, j);
-      }
-      fwrite(buf, sizeof(float), nn.bs[l].cols, fptr);
-    }
+  size_t tensor_count = 2 * nn.count;
+  NN_Model_Tensor *tensors = calloc(tensor_count, sizeof(*tensors));
+  assert(tensors != NULL);
+  for (size_t t = 0; t < tensor_count; ++t) {
+    Matrix matrix = (t % 2) == 0 ? nn.ws[t/2] : nn.bs[t/2];
+    tensors[t].dtype = NN_DTYPE_F32;
+    tensors[t].rows = matrix.rows;
+    tensors[t].cols = matrix.cols;
+    tensors[t].offset = (matrix.items - nn.params) * sizeof(float);
+    tensors[t].size = matrix.rows * matrix.cols * sizeof(float);
   }
+  nn_model_write_payload(path, NN_DTYPE_F32, arch, nn.count + 1, tensors, tensor_count, nn.params,
+                         nn.param_count * sizeof(float));
 
-  fclose(fptr);
-  printf("The model has been saved.\n");
+  free(tensors);
+  free(arch);
+  prof_emit("\"save\",\"path\":%s,\"bytes\":%zu,\"seconds\":%.6f", prof_quote(path),
+            nn.param_count * sizeof(float), prof_now() - start);
 }
 
-void nn_test(NN nn, char *dataset_name, size_t images_count, float images[][IMAGE_UNIT_LEN], int *labels)
+void nn_test(NN_Model model, Pool *pool, char *dataset_name, Dataset dataset)
 {
-  printf("Testing the model...\n");
-
-  size_t correct_count = 0;
-  size_t max_digit = 0;
-  float max_value = 0.0f;
+  printf("Testing the %s model (%s)...\n", model.dtype, model.kernel);
+
+  NN_Evaluator evaluator = nn_evaluator_alloc(model, pool);
+  NN_Evaluation evaluation;
+  double start = prof_now();
+  nn_evaluate(&evaluator, dataset, &evaluation);
+  if (PROF_ENABLED) {
+    double seconds = prof_now() - start;
+    Prof_Counters total;
+    char layers[PROF_LAYERS_LEN];
+    prof_counters_merge(&total, evaluator.counters, pool->count);
+    prof_format_layers(layers, sizeof(layers), &total, model.layer_count);
+    prof_emit("\"evaluate\",\"dataset\":%s,\"dtype\":\"%s\",\"seconds\":%.6f,\"images_per_sec\":%.1f,"
+              "\"accuracy\":%.6f,\"layers\":%s", prof_quote(dataset_name), model.dtype, seconds,
+              evaluation.count / seconds, (double) evaluation.correct / evaluation.count, layers);
+  }
+  nn_evaluation_print(evaluation, dataset_name);
+  nn_evaluator_free(evaluator);
+}
 
-  for (size_t i = 0; i < images_count; ++i) {
-    for (size_t j = 0; j < IMAGE_UNIT_LEN; ++j) {
-      MATRIX_AT(NN_INPUT(nn), 0, j) = images[i][j];
-    }
-    nn_forward(nn);
+typedef struct {
+  NN *batches;
+  NN *gradients;
+  size_t *starts;
+  size_t replica_count;
+  const uint8_t *labels;
+  Prof_Counters *counters;
+} NN_Train_Context;
+
+static void nn_train_batch_task(void *context, size_t thread_index, size_t thread_count)
+{
+  NN_Train_Context *ctx = context;
+  if (thread_index >= ctx->replica_count) {
+    return;
+  }
+  NN batch = ctx->batches[thread_index];
+  NN gradient = ctx->gradients[thread_index];
+  const uint8_t *labels = &ctx->labels[ctx->starts[thread_index]];
+  size_t count = NN_INPUT(batch).rows;
+  prof_counters = ctx->counters != NULL ? &ctx->counters[thread_index] : NULL;
 
-    max_digit = 0;
-    max_value = 0.0f;
+  nn_forward(batch);
 
-    for (size_t d = 0; d < NN_OUTPUT(nn).cols; ++d) {
-      if (MATRIX_AT(NN_OUTPUT(nn), 0, d) > max_value) {
-        max_value = MATRIX_AT(NN_OUTPUT(nn), 0, d);
-        max_digit = d;
+  matrix_copy(NN_OUTPUT(gradient), NN_OUTPUT(batch));
+  for (size_t i = 0; i < count; ++i) {
+    MATRIX_AT(NN_OUTPUT(gradient), i, labels[i]) -= MAX_ACTIVATION;
+  }
+  if (PROF_ENABLED && (prof_counters != NULL)) {
+    Matrix delta = NN_OUTPUT(gradient);
+    for (size_t i = 0; i < count; ++i) {
+      size_t guess = 0;
+      for (size_t j = 0; j < delta.cols; ++j) {
+        prof_counters->loss += MATRIX_AT(delta, i, j) * MATRIX_AT(delta, i, j);
+        if (MATRIX_AT(NN_OUTPUT(batch), i, j) > MATRIX_AT(NN_OUTPUT(batch), i, guess)) {
+          guess = j;
+        }
       }
+      prof_counters->correct += guess == labels[i];
     }
+    prof_counters->count += count;
+  }
 
-    if (max_digit == labels[i]) {
-      correct_count++;
-    } 
+  nn_get_batch_gradient(batch, gradient);
+  prof_counters = NULL;
+}
+
+static void nn_train_reduce_task(void *context, size_t thread_index, size_t thread_count)
+{
+  NN_Train_Context *ctx = context;
+  NN total = ctx->gradients[0];
+  size_t start, end;
+  pool_split(total.param_count, thread_index, thread_count, &start, &end);
+  for (size_t r = 1; r < ctx->replica_count; ++r) {
+    vmath_axpy(total.params + start, 1.0f, ctx->gradients[r].params + start, end - start);
   }
-  printf("Forwarded %s set. ", dataset_name);
-  printf("Accuracy: %zu / %zu.\n", correct_count, images_count);
 }
 
-void nn_train(NN nn, NN gradient, size_t images_count, float images[][IMAGE_UNIT_LEN], int *labels)
+// Runs optimizer->epochs epochs, one optimizer step per batch, from the optimizer's step count on: a fresh optimizer
+// trains the weights the caller initialized, one restored from a checkpoint continues with the weights already in nn.
+// Batches come shuffled from a prefetcher seeded with the calling thread's generator state, which is the state after
+// initialization on a fresh start and the one a checkpoint restores.
+void nn_train(NN nn, NN gradient, Pool *pool, Dataset dataset, Optimizer *optimizer, const NN_Train_Hook *hooks,
+              size_t hook_count)
 {
   printf("Training the model...\n");
-  
-  srand(time(0));
-
-  nn_init(nn);
-  
-  Olivec_Canvas canvas = olivec_canvas(canvas_pixels, RENDER_WIDTH, RENDER_HEIGHT, RENDER_WIDTH);
-  
-  for (size_t e = 0; e < EPOCHS; ++e) {
-    nn_zero(gradient);
-    
-    for (size_t i = 0; i < images_count; ++i) {
-      for (size_t j = 0; j < IMAGE_UNIT_LEN; ++j) {
-        MATRIX_AT(NN_INPUT(nn), 0, j) = images[i][j];
-      }
-      nn_forward(nn);
+  assert(dataset.image_len == NN_INPUT(nn).cols);
+  assert(optimizer->steps_per_epoch == dataset.count / TRAINING_BATCH);
+
+  NN batch = nn_alloc_activations(nn, TRAINING_BATCH);
+
+  NN_Train_Context ctx;
+  ctx.replica_count = pool->count < TRAINING_BATCH ? pool->count : TRAINING_BATCH;
+  ctx.batches = malloc(sizeof(*ctx.batches) * ctx.replica_count);
+  assert(ctx.batches != NULL);
+  ctx.gradients = malloc(sizeof(*ctx.gradients) * ctx.replica_count);
+  assert(ctx.gradients != NULL);
+  ctx.starts = malloc(sizeof(*ctx.starts) * ctx.replica_count);
+  assert(ctx.starts != NULL);
+  ctx.counters = NULL;
+  if (PROF_ENABLED) {
+    ctx.counters = malloc(sizeof(*ctx.counters) * ctx.replica_count);
+    assert(ctx.counters != NULL);
+  }
 
-      for (size_t l = 0; l <= nn.count; ++l) {
-        matrix_fill(gradient.as[l], 0);
-      }
+  for (size_t t = 0; t < ctx.replica_count; ++t) {
+    size_t start, end;
+    pool_split(TRAINING_BATCH, t, ctx.replica_count, &start, &end);
+    ctx.starts[t] = start;
+    ctx.batches[t] = nn_rows(batch, start, end - start);
+    ctx.gradients[t] = nn_rows(gradient, start, end - start);
+    if (t > 0) {
+      ctx.gradients[t] = nn_alloc_params(ctx.gradients[t]);
+    }
+  }
 
-      matrix_copy(NN_OUTPUT(gradient), NN_OUTPUT(nn));
-      MATRIX_AT(NN_OUTPUT(gradient), 0, labels[i]) -= MAX_ACTIVATION;
+  assert(optimizer->count == nn.param_count);
+  Prefetcher *prefetcher = prefetch_create(dataset, TRAINING_BATCH, nn_rng_state(), optimizer->step,
+                                           optimizer->epochs * optimizer->steps_per_epoch);
+  int running = 1;
+  for (size_t e = optimizer->step / optimizer->steps_per_epoch; running && (e < optimizer->epochs); ++e) {
+    // Phase times of the main thread: waiting for input, batch (forward and backward), reduce, update and hooks.
+    double phases[5] = {0};
+    double epoch_start = prof_now();
+    if (PROF_ENABLED) {
+      memset(ctx.counters, 0, sizeof(*ctx.counters) * ctx.replica_count);
+    }
 
-      nn_get_total_gradient(nn, gradient);
+    for (size_t s = optimizer->step % optimizer->steps_per_epoch; s < optimizer->steps_per_epoch; ++s) {
+      double start = PROF_ENABLED ? prof_now() : 0;
+      Prefetch_Slot *slot = prefetch_acquire(prefetcher);
+      for (size_t t = 0; t < ctx.replica_count; ++t) {
+        NN_INPUT(ctx.batches[t]).items = &slot->inputs[ctx.starts[t] * dataset.image_len];
+      }
+      ctx.labels = slot->labels;
+      double end = PROF_ENABLED ? prof_now() : 0;
+      phases[0] += end - start;
+      pool_run(pool, nn_train_batch_task, &ctx);
+      prefetch_release(prefetcher);
+
+      start = end;
+      end = PROF_ENABLED ? prof_now() : 0;
+      phases[1] += end - start;
+      if (ctx.replica_count > 1) {
+        pool_run(pool, nn_train_reduce_task, &ctx);
+      }
 
-      if ((i % TRAINING_BATCH) == (TRAINING_BATCH - 1)) {
-        nn_get_average_gradient(gradient, TRAINING_BATCH);
-        nn_update_weights(nn, gradient, LEARNING_RATE);
-        nn_zero(gradient);
+      start = end;
+      end = PROF_ENABLED ? prof_now() : 0;
+      phases[2] += end - start;
+      optim_step(optimizer, nn.params, gradient.params, 1.0f / TRAINING_BATCH);
+
+      start = end;
+      end = PROF_ENABLED ? prof_now() : 0;
+      phases[3] += end - start;
+      for (size_t h = 0; h < hook_count; ++h) {
+        if (hooks[h].on_step != NULL) {
+          hooks[h].on_step(hooks[h].context, nn, optimizer);
+        }
       }
+      phases[4] += (PROF_ENABLED ? prof_now() : 0) - end;
     }
 
-    if (((e % RENDER_STEP) == 9) || e == 0) {
-      nn_render(canvas, nn);
-      char canvas_filepath[MAX_FILEPATH_LEN];
-      snprintf(canvas_filepath, sizeof(canvas_filepath), "./render/%04zu.png", e);
-
-      if (!stbi_write_png(canvas_filepath, canvas.width, canvas.height, PNG_CHANNELS, canvas_pixels, 
-      canvas.stride * sizeof(uint32_t))) {
-        fprintf(stderr, "Could not save the file.");
+    double hooks_start = PROF_ENABLED ? prof_now() : 0;
+    for (size_t h = 0; h < hook_count; ++h) {
+      if ((hooks[h].on_epoch != NULL) && !hooks[h].on_epoch(hooks[h].context, nn, e)) {
+        running = 0;
       }
     }
+
+    if (PROF_ENABLED) {
+      double end = prof_now();
+      phases[4] += end - hooks_start;
+      Prof_Counters total;
+      char layers[PROF_LAYERS_LEN];
+      prof_counters_merge(&total, ctx.counters, ctx.replica_count);
+      prof_format_layers(layers, sizeof(layers), &total, nn.count);
+      size_t count = total.count > 0 ? total.count : 1;
+      prof_emit("\"epoch\",\"epoch\":%zu,\"seconds\":%.6f,\"images_per_sec\":%.1f,\"loss\":%.6f,\"accuracy\":%.6f,"
+                "\"learning_rate\":%g,\"phases\":{\"input\":%.6f,\"batch\":%.6f,\"reduce\":%.6f,\"update\":%.6f,"
+                "\"hooks\":%.6f},\"layers\":%s", e, end - epoch_start, total.count / (end - epoch_start),
+                total.loss / count, (double) total.correct / count, optim_learning_rate(optimizer), phases[0],
+                phases[1], phases[2], phases[3], phases[4], layers);
+    }
+  }
+  prefetch_destroy(prefetcher);
+  for (size_t t = 0; t < ctx.replica_count; ++t) {
+    if (t > 0) {
+      nn_free_params(ctx.gradients[t]);
+    }
+    free(ctx.gradients[t].as);
+    free(ctx.batches[t].as);
   }
+  free(ctx.batches);
+  free(ctx.gradients);
+  free(ctx.starts);
+  free(ctx.counters);
+  nn_free_activations(batch);
   printf("The model has been trained.\n");
 }
 
 void nn_update_weights(NN nn, NN gradient, float learning_rate)
 {
-  for (size_t l = 0; l < gradient.count; ++l) {
-    for (size_t i = 0; i < gradient.ws[l].rows; ++i) {
-      for (size_t j = 0; j < gradient.ws[l].cols; ++j) {
-        MATRIX_AT(nn.ws[l], i, j) -= learning_rate * MATRIX_AT(gradient.ws[l], i, j);
-      }
-    }
-    for (size_t i = 0; i < gradient.bs[l].rows; ++i) {
-      for (size_t j = 0; j < gradient.bs[l].cols; ++j) {
-        MATRIX_AT(nn.bs[l], i, j) -= learning_rate * MATRIX_AT(gradient.bs[l], i, j);
-      }
-    }
-  }
+  assert(nn.param_count == gradient.param_count);
+  vmath_axpy(nn.params, -learning_rate, gradient.params, nn.param_count);
 }
 
 void nn_zero(NN nn)
 {
-  for (size_t i = 0; i < nn.count; ++i) {
-    matrix_fill(nn.ws[i], 0);
-    matrix_fill(nn.bs[i], 0);
-    matrix_fill(nn.as[i], 0);
+  memset(nn.params, 0, sizeof(*nn.params) * nn.param_count);
+  for (size_t l = 0; l <= nn.count; ++l) {
+    matrix_fill(nn.as[l], 0);
   }
-  matrix_fill(NN_OUTPUT(nn), 0);
 }
 
 #endif // NN_IMPLEMENTATION
@@ -0,0 +1,289 @@
+#ifndef OPTIM_H_
+#define OPTIM_H_
+
+// Optimizers over the flat parameter arena of an NN. Every step reads each parameter, gradient and state value once
+// and writes them back once; the gradient averaging over the batch is folded in as gradient_scale.
+typedef struct {
+  int kind;
+  int schedule;
+  float learning_rate;
+  size_t epochs;
+  size_t warmup;
+  size_t steps_per_epoch;
+  size_t step;
+  size_t count;
+  float *velocity;
+  float *second_moment;
+} Optimizer;
+
+void optim_init(void);
+Optimizer optim_alloc(int kind, int schedule, float learning_rate, size_t epochs, size_t warmup, size_t count,
+                      size_t steps_per_epoch);
+void optim_free(Optimizer optimizer);
+float optim_learning_rate(const Optimizer *optimizer);
+int optim_parse(const char *name, const char *const *names, size_t name_count);
+void optim_step(Optimizer *optimizer, float *params, const float *gradient, float gradient_scale);
+
+#define OPTIM_SGD 0
+#define OPTIM_MOMENTUM 1
+#define OPTIM_NESTEROV 2
+#define OPTIM_ADAM 3
+
+#define OPTIM_CONSTANT 0
+#define OPTIM_STEP 1
+#define OPTIM_COSINE 2
+
+#define OPTIM_MOMENTUM_DECAY 0.9f
+#define OPTIM_ADAM_BETA1 0.9f
+#define OPTIM_ADAM_BETA2 0.999f
+#define OPTIM_ADAM_EPSILON 1e-8f
+#define OPTIM_STEP_GAMMA 0.1f
+#define OPTIM_STEP_COUNT 3
+
+static const char *const optim_kinds[] = {"sgd", "momentum", "nesterov", "adam"};
+static const char *const optim_schedules[] = {"constant", "step", "cosine"};
+
+#endif // OPTIM_H_
+
+#ifdef OPTIM_IMPLEMENTATION
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OPTIM_X86
+#include <immintrin.h>
+#endif
+
+// Heavy-ball momentum, v = mu * v + g, followed by w -= lr * (c_g * g + c_v * v). Plain momentum uses c_g = 0, c_v = 1,
+// Nesterov c_g = 1, c_v = mu.
+typedef struct {
+  float scale;
+  float learning_rate;
+  float decay;
+  float c_g;
+  float c_v;
+} Optim_Momentum;
+
+// Adam with the bias corrections folded into step_size and epsilon.
+typedef struct {
+  float scale;
+  float step_size;
+  float epsilon;
+} Optim_Adam;
+
+typedef void (*Optim_Momentum_Kernel)(float *ws, const float *gs, float *vs, size_t count, Optim_Momentum k);
+typedef void (*Optim_Adam_Kernel)(float *ws, const float *gs, float *ms, float *vs, size_t count, Optim_Adam k);
+
+static void optim_momentum_scalar(float *ws, const float *gs, float *vs, size_t count, Optim_Momentum k)
+{
+  for (size_t i = 0; i < count; ++i) {
+    float g = gs[i] * k.scale;
+    float v = k.decay * vs[i] + g;
+    vs[i] = v;
+    ws[i] -= k.learning_rate * (k.c_g * g + k.c_v * v);
+  }
+}
+
+static void optim_adam_scalar(float *ws, const float *gs, float *ms, float *vs, size_t count, Optim_Adam k)
+{
+  for (size_t i = 0; i < count; ++i) {
+    float g = gs[i] * k.scale;
+    float m = OPTIM_ADAM_BETA1 * ms[i] + (1.0f - OPTIM_ADAM_BETA1) * g;
+    float v = OPTIM_ADAM_BETA2 * vs[i] + (1.0f - OPTIM_ADAM_BETA2) * g * g;
+    ms[i] = m;
+    vs[i] = v;
+    ws[i] -= k.step_size * m / (sqrtf(v) + k.epsilon);
+  }
+}
+
+#ifdef OPTIM_X86
+
+__attribute__((target("avx2,fma")))
+static void optim_momentum_avx2(float *ws, const float *gs, float *vs, size_t count, Optim_Momentum k)
+{
+  __m256 scale = _mm256_set1_ps(k.scale);
+  __m256 decay = _mm256_set1_ps(k.decay);
+  __m256 c_g = _mm256_set1_ps(-k.learning_rate * k.c_g);
+  __m256 c_v = _mm256_set1_ps(-k.learning_rate * k.c_v);
+  size_t i = 0;
+  for (; (i + 8) <= count; i += 8) {
+    __m256 g = _mm256_mul_ps(_mm256_loadu_ps(gs + i), scale);
+    __m256 v = _mm256_fmadd_ps(decay, _mm256_loadu_ps(vs + i), g);
+    _mm256_storeu_ps(vs + i, v);
+    __m256 w = _mm256_fmadd_ps(c_g, g, _mm256_loadu_ps(ws + i));
+    _mm256_storeu_ps(ws + i, _mm256_fmadd_ps(c_v, v, w));
+  }
+  optim_momentum_scalar(ws + i, gs + i, vs + i, count - i, k);
+}
+
+__attribute__((target("avx2,fma")))
+static void optim_adam_avx2(float *ws, const float *gs, float *ms, float *vs, size_t count, Optim_Adam k)
+{
+  __m256 scale = _mm256_set1_ps(k.scale);
+  __m256 beta1 = _mm256_set1_ps(OPTIM_ADAM_BETA1);
+  __m256 beta2 = _mm256_set1_ps(OPTIM_ADAM_BETA2);
+  __m256 one_beta1 = _mm256_set1_ps(1.0f - OPTIM_ADAM_BETA1);
+  __m256 one_beta2 = _mm256_set1_ps(1.0f - OPTIM_ADAM_BETA2);
+  __m256 step_size = _mm256_set1_ps(-k.step_size);
+  __m256 epsilon = _mm256_set1_ps(k.epsilon);
+  size_t i = 0;
+  for (; (i + 8) <= count; i += 8) {
+    __m256 g = _mm256_mul_ps(_mm256_loadu_ps(gs + i), scale);
+    __m256 m = _mm256_fmadd_ps(beta1, _mm256_loadu_ps(ms + i), _mm256_mul_ps(one_beta1, g));
+    __m256 v = _mm256_fmadd_ps(beta2, _mm256_loadu_ps(vs + i), _mm256_mul_ps(one_beta2, _mm256_mul_ps(g, g)));
+    _mm256_storeu_ps(ms + i, m);
+    _mm256_storeu_ps(vs + i, v);
+    __m256 d = _mm256_div_ps(m, _mm256_add_ps(_mm256_sqrt_ps(v), epsilon));
+    _mm256_storeu_ps(ws + i, _mm256_fmadd_ps(step_size, d, _mm256_loadu_ps(ws + i)));
+  }
+  optim_adam_scalar(ws + i, gs + i, ms + i, vs + i, count - i, k);
+}
+
+__attribute__((target("avx512f")))
+static void optim_momentum_avx512(float *ws, const float *gs, float *vs, size_t count, Optim_Momentum k)
+{
+  __m512 scale = _mm512_set1_ps(k.scale);
+  __m512 decay = _mm512_set1_ps(k.decay);
+  __m512 c_g = _mm512_set1_ps(-k.learning_rate * k.c_g);
+  __m512 c_v = _mm512_set1_ps(-k.learning_rate * k.c_v);
+  for (size_t i = 0; i < count; i += 16) {
+    __mmask16 mask = (count - i) >= 16 ? 0xFFFF : (__mmask16) ((1u << (count - i)) - 1);
+    __m512 g = _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, gs + i), scale);
+    __m512 v = _mm512_fmadd_ps(decay, _mm512_maskz_loadu_ps(mask, vs + i), g);
+    _mm512_mask_storeu_ps(vs + i, mask, v);
+    __m512 w = _mm512_fmadd_ps(c_g, g, _mm512_maskz_loadu_ps(mask, ws + i));
+    _mm512_mask_storeu_ps(ws + i, mask, _mm512_fmadd_ps(c_v, v, w));
+  }
+}
+
+__attribute__((target("avx512f")))
+static void optim_adam_avx512(float *ws, const float *gs, float *ms, float *vs, size_t count, Optim_Adam k)
+{
+  __m512 scale = _mm512_set1_ps(k.scale);
+  __m512 beta1 = _mm512_set1_ps(OPTIM_ADAM_BETA1);
+  __m512 beta2 = _mm512_set1_ps(OPTIM_ADAM_BETA2);
+  __m512 one_beta1 = _mm512_set1_ps(1.0f - OPTIM_ADAM_BETA1);
+  __m512 one_beta2 = _mm512_set1_ps(1.0f - OPTIM_ADAM_BETA2);
+  __m512 step_size = _mm512_set1_ps(-k.step_size);
+  __m512 epsilon = _mm512_set1_ps(k.epsilon);
+  for (size_t i = 0; i < count; i += 16) {
+    __mmask16 mask = (count - i) >= 16 ? 0xFFFF : (__mmask16) ((1u << (count - i)) - 1);
+    __m512 g = _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, gs + i), scale);
+    __m512 m = _mm512_fmadd_ps(beta1, _mm512_maskz_loadu_ps(mask, ms + i), _mm512_mul_ps(one_beta1, g));
+    __m512 g2 = _mm512_mul_ps(one_beta2, _mm512_mul_ps(g, g));
+    __m512 v = _mm512_fmadd_ps(beta2, _mm512_maskz_loadu_ps(mask, vs + i), g2);
+    _mm512_mask_storeu_ps(ms + i, mask, m);
+    _mm512_mask_storeu_ps(vs + i, mask, v);
+    __m512 d = _mm512_div_ps(m, _mm512_add_ps(_mm512_sqrt_ps(v), epsilon));
+    _mm512_mask_storeu_ps(ws + i, mask, _mm512_fmadd_ps(step_size, d, _mm512_maskz_loadu_ps(mask, ws + i)));
+  }
+}
+
+#endif // OPTIM_X86
+
+static Optim_Momentum_Kernel optim_momentum_kernel = optim_momentum_scalar;
+static Optim_Adam_Kernel optim_adam_kernel = optim_adam_scalar;
+
+// Follows NN_GEMM like the GEMM kernels do.
+void optim_init(void)
+{
+#ifdef OPTIM_X86
+  const char *forced = getenv("NN_GEMM");
+  __builtin_cpu_init();
+  int has_avx512 = __builtin_cpu_supports("avx512f");
+  int has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  if (forced != NULL) {
+    has_avx512 = has_avx512 && (strcmp(forced, "avx512") == 0);
+    has_avx2 = has_avx2 && (strcmp(forced, "avx2") == 0);
+  }
+  if (has_avx512) {
+    optim_momentum_kernel = optim_momentum_avx512;
+    optim_adam_kernel = optim_adam_avx512;
+  } else if (has_avx2) {
+    optim_momentum_kernel = optim_momentum_avx2;
+    optim_adam_kernel = optim_adam_avx2;
+  }
+#endif
+}
+
+Optimizer optim_alloc(int kind, int schedule, float learning_rate, size_t epochs, size_t warmup, size_t count,
+                      size_t steps_per_epoch)
+{
+  Optimizer optimizer;
+  memset(&optimizer, 0, sizeof(optimizer));
+  optimizer.kind = kind;
+  optimizer.schedule = schedule;
+  optimizer.learning_rate = learning_rate;
+  optimizer.epochs = epochs;
+  optimizer.warmup = warmup;
+  optimizer.steps_per_epoch = steps_per_epoch;
+  optimizer.count = count;
+  if (kind != OPTIM_SGD) {
+    optimizer.velocity = calloc(count, sizeof(*optimizer.velocity));
+    assert(optimizer.velocity != NULL);
+  }
+  if (kind == OPTIM_ADAM) {
+    optimizer.second_moment = calloc(count, sizeof(*optimizer.second_moment));
+    assert(optimizer.second_moment != NULL);
+  }
+  return optimizer;
+}
+
+void optim_free(Optimizer optimizer)
+{
+  free(optimizer.velocity);
+  free(optimizer.second_moment);
+}
+
+// The learning rate of the next step: a linear warmup over the first warmup epochs, then the schedule over the rest.
+// The step schedule divides the rate by 1 / OPTIM_STEP_GAMMA OPTIM_STEP_COUNT times, evenly spread over training.
+float optim_learning_rate(const Optimizer *optimizer)
+{
+  size_t warmup_steps = optimizer->warmup * optimizer->steps_per_epoch;
+  if (optimizer->step < warmup_steps) {
+    return optimizer->learning_rate * (optimizer->step + 1) / warmup_steps;
+  }
+
+  size_t total = optimizer->epochs * optimizer->steps_per_epoch;
+  size_t length = total > warmup_steps ? total - warmup_steps : 1;
+  float progress = (float) (optimizer->step - warmup_steps) / length;
+  switch (optimizer->schedule) {
+  case OPTIM_STEP:
+    return optimizer->learning_rate * powf(OPTIM_STEP_GAMMA, floorf(progress * (OPTIM_STEP_COUNT + 1)));
+  case OPTIM_COSINE:
+    return optimizer->learning_rate * 0.5f * (1.0f + cosf(M_PI * progress));
+  default:
+    return optimizer->learning_rate;
+  }
+}
+
+// Returns the index of name in names, or -1.
+int optim_parse(const char *name, const char *const *names, size_t name_count)
+{
+  for (size_t i = 0; i < name_count; ++i) {
+    if (strcmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void optim_step(Optimizer *optimizer, float *params, const float *gradient, float gradient_scale)
+{
+  float learning_rate = optim_learning_rate(optimizer);
+  optimizer->step += 1;
+
+  if (optimizer->kind == OPTIM_SGD) {
+    vmath_axpy(params, -learning_rate * gradient_scale, gradient, optimizer->count);
+  } else if (optimizer->kind == OPTIM_ADAM) {
+    float correction1 = 1.0f - powf(OPTIM_ADAM_BETA1, optimizer->step);
+    float correction2 = sqrtf(1.0f - powf(OPTIM_ADAM_BETA2, optimizer->step));
+    Optim_Adam k = {gradient_scale, learning_rate * correction2 / correction1, OPTIM_ADAM_EPSILON * correction2};
+    optim_adam_kernel(params, gradient, optimizer->velocity, optimizer->second_moment, optimizer->count, k);
+  } else {
+    int nesterov = optimizer->kind == OPTIM_NESTEROV;
+    Optim_Momentum k = {gradient_scale, learning_rate, OPTIM_MOMENTUM_DECAY, nesterov ? 1.0f : 0.0f,
+                        nesterov ? OPTIM_MOMENTUM_DECAY : 1.0f};
+    optim_momentum_kernel(params, gradient, optimizer->velocity, optimizer->count, k);
+  }
+}
+
+#endif // OPTIM_IMPLEMENTATION
@@ -0,0 +1,113 @@
+#ifndef PGM_H_
+#define PGM_H_
+
+int pgm_decode(const uint8_t *bytes, size_t len, uint8_t *pixels, size_t width, size_t height);
+int pgm_read(char *path, uint8_t *pixels, size_t width, size_t height);
+
+#endif // PGM_H_
+
+#ifdef PGM_IMPLEMENTATION
+
+static int pgm_skip_space(const uint8_t *bytes, size_t len, size_t *at)
+{
+  int skipped = 0;
+  while (*at < len) {
+    if (bytes[*at] == '#') {
+      while ((*at < len) && (bytes[*at] != '\n')) {
+        *at += 1;
+      }
+    } else if ((bytes[*at] == ' ') || (bytes[*at] == '\t') || (bytes[*at] == '\r') || (bytes[*at] == '\n')) {
+      *at += 1;
+    } else {
+      break;
+    }
+    skipped = 1;
+  }
+  return skipped;
+}
+
+static int pgm_number(const uint8_t *bytes, size_t len, size_t *at, size_t *value)
+{
+  size_t start = *at;
+  *value = 0;
+  while ((*at < len) && (bytes[*at] >= '0') && (bytes[*at] <= '9') && (*value <= 65535)) {
+    *value = (*value * 10) + (bytes[*at] - '0');
+    *at += 1;
+  }
+  return *at > start;
+}
+
+// Decodes a P2 (ASCII) or P5 (binary) graymap with comments anywhere in the header.
+// Samples are rescaled to 0..255 when maxval is not 255. Returns 0 on malformed input or a size mismatch.
+int pgm_decode(const uint8_t *bytes, size_t len, uint8_t *pixels, size_t width, size_t height)
+{
+  if ((len < 2) || (bytes[0] != 'P') || ((bytes[1] != '2') && (bytes[1] != '5'))) {
+    return 0;
+  }
+  int binary = bytes[1] == '5';
+
+  size_t at = 2;
+  size_t header[3];
+  for (size_t i = 0; i < 3; ++i) {
+    if (!pgm_skip_space(bytes, len, &at) || !pgm_number(bytes, len, &at, &header[i])) {
+      return 0;
+    }
+  }
+  size_t maxval = header[2];
+  if ((header[0] != width) || (header[1] != height) || (maxval == 0) || (maxval > 255)) {
+    return 0;
+  }
+
+  size_t count = width * height;
+  if (binary) {
+    if ((at >= len) || ((len - at - 1) < count)) {
+      return 0;
+    }
+    at += 1;
+    for (size_t i = 0; i < count; ++i) {
+      pixels[i] = (uint8_t) ((bytes[at+i] * 255 + maxval / 2) / maxval);
+    }
+  } else {
+    for (size_t i = 0; i < count; ++i) {
+      size_t value;
+      if (!pgm_skip_space(bytes, len, &at) || !pgm_number(bytes, len, &at, &value) || (value > maxval)) {
+        return 0;
+      }
+      pixels[i] = (uint8_t) ((value * 255 + maxval / 2) / maxval);
+    }
+  }
+  return 1;
+}
+
+int pgm_read(char *path, uint8_t *pixels, size_t width, size_t height)
+{
+  int file_descriptor = open(path, O_RDONLY);
+  if (file_descriptor == -1) {
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(file_descriptor, &st) == -1) {
+    close(file_descriptor);
+    return 0;
+  }
+
+  size_t len = st.st_size;
+  uint8_t *bytes = malloc(len + 1);
+  assert(bytes != NULL);
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(file_descriptor, bytes + done, len - done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  close(file_descriptor);
+
+  int decoded = (done == len) && pgm_decode(bytes, len, pixels, width, height);
+  free(bytes);
+  return decoded;
+}
+
+#endif // PGM_IMPLEMENTATION
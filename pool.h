@@ -0,0 +1,146 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+typedef void (*Pool_Task)(void *context, size_t thread_index, size_t thread_count);
+
+typedef struct {
+  size_t count;
+  pthread_t *threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  Pool_Task task;
+  void *context;
+  size_t generation;
+  size_t pending;
+  int stop;
+} Pool;
+
+Pool *pool_create(size_t thread_count);
+size_t pool_cpu_count(void);
+void pool_destroy(Pool *pool);
+void pool_run(Pool *pool, Pool_Task task, void *context);
+void pool_split(size_t count, size_t thread_index, size_t thread_count, size_t *start, size_t *end);
+
+#endif // POOL_H_
+
+#ifdef POOL_IMPLEMENTATION
+
+typedef struct {
+  Pool *pool;
+  size_t index;
+} Pool_Worker;
+
+static void *pool_worker(void *arg)
+{
+  Pool_Worker *worker = arg;
+  Pool *pool = worker->pool;
+  size_t index = worker->index;
+  free(worker);
+
+  size_t seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&pool->mutex);
+    while ((pool->generation == seen) && !pool->stop) {
+      pthread_cond_wait(&pool->start, &pool->mutex);
+    }
+    if (pool->stop) {
+      pthread_mutex_unlock(&pool->mutex);
+      return NULL;
+    }
+    seen = pool->generation;
+    Pool_Task task = pool->task;
+    void *context = pool->context;
+    pthread_mutex_unlock(&pool->mutex);
+
+    task(context, index, pool->count);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->pending == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+  }
+}
+
+Pool *pool_create(size_t thread_count)
+{
+  assert(thread_count > 0);
+  Pool *pool = calloc(1, sizeof(*pool));
+  assert(pool != NULL);
+  pool->count = thread_count;
+  pool->threads = malloc(sizeof(*pool->threads) * thread_count);
+  assert(pool->threads != NULL);
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  for (size_t i = 1; i < thread_count; ++i) {
+    Pool_Worker *worker = malloc(sizeof(*worker));
+    assert(worker != NULL);
+    worker->pool = pool;
+    worker->index = i;
+    if (pthread_create(&pool->threads[i], NULL, pool_worker, worker) != 0) {
+      fprintf(stderr, "Error creating a thread.");
+      exit(1);
+    }
+  }
+  return pool;
+}
+
+size_t pool_cpu_count(void)
+{
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (size_t) count : 1;
+}
+
+void pool_destroy(Pool *pool)
+{
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+  for (size_t i = 1; i < pool->count; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->threads);
+  free(pool);
+}
+
+// Runs task on every thread of the pool, the calling thread being thread 0, and returns once all of them finished.
+void pool_run(Pool *pool, Pool_Task task, void *context)
+{
+  if (pool->count == 1) {
+    task(context, 0, 1);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->task = task;
+  pool->context = context;
+  pool->pending = pool->count - 1;
+  pool->generation += 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+
+  task(context, 0, pool->count);
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+void pool_split(size_t count, size_t thread_index, size_t thread_count, size_t *start, size_t *end)
+{
+  size_t chunk = count / thread_count;
+  size_t rest = count % thread_count;
+  *start = (thread_index * chunk) + (thread_index < rest ? thread_index : rest);
+  *end = *start + chunk + (thread_index < rest ? 1 : 0);
+}
+
+#endif // POOL_IMPLEMENTATION
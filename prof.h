@@ -0,0 +1,165 @@
+#ifndef PROF_H_
+#define PROF_H_
+
+// Phase timers and throughput counters written as JSON lines, one object per event, to the file given with -profile.
+// Every line has "event" and "time" (seconds since prof_open) fields. Building with -DNN_NO_PROFILE turns
+// PROF_ENABLED into a constant 0 so the instrumentation compiles away.
+#define PROF_LAYERS_LEN 4096
+#define PROF_MAX_LAYERS 16
+
+// Per-thread counters of the training and evaluation tasks. Seconds and flops are summed over the threads.
+typedef struct {
+  double forward_seconds[PROF_MAX_LAYERS];
+  double forward_flops[PROF_MAX_LAYERS];
+  double backward_seconds[PROF_MAX_LAYERS];
+  double backward_flops[PROF_MAX_LAYERS];
+  double loss;
+  size_t correct;
+  size_t count;
+} Prof_Counters;
+
+void prof_open(char *path);
+void prof_close(void);
+double prof_now(void);
+void prof_emit(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void prof_counters_merge(Prof_Counters *dst, const Prof_Counters *src, size_t count);
+void prof_format_layers(char *buf, size_t len, const Prof_Counters *counters, size_t layer_count);
+const char *prof_quote(const char *text);
+
+#ifdef NN_NO_PROFILE
+#define PROF_ENABLED 0
+#else
+#define PROF_ENABLED (prof_file != NULL)
+#endif
+
+#endif // PROF_H_
+
+#ifdef PROF_IMPLEMENTATION
+
+static FILE *prof_file = NULL;
+static double prof_start = 0;
+static pthread_mutex_t prof_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Set by the pool tasks for the duration of a task so the layer loops can count into their thread's counters.
+static __thread Prof_Counters *prof_counters = NULL;
+
+double prof_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline double prof_layer_begin(void)
+{
+  return PROF_ENABLED && (prof_counters != NULL) ? prof_now() : 0;
+}
+
+static inline void prof_layer_end(int backward, size_t layer, double start, double flops)
+{
+  if (PROF_ENABLED && (prof_counters != NULL) && (layer < PROF_MAX_LAYERS)) {
+    double seconds = prof_now() - start;
+    if (backward) {
+      prof_counters->backward_seconds[layer] += seconds;
+      prof_counters->backward_flops[layer] += flops;
+    } else {
+      prof_counters->forward_seconds[layer] += seconds;
+      prof_counters->forward_flops[layer] += flops;
+    }
+  }
+}
+
+void prof_open(char *path)
+{
+#ifdef NN_NO_PROFILE
+  (void) path;
+  fprintf(stderr, "Profiling was compiled out.");
+  exit(1);
+#else
+  prof_file = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+  if (prof_file == NULL) {
+    fprintf(stderr, "Error opening the file.");
+    exit(1);
+  }
+  prof_start = prof_now();
+#endif
+}
+
+void prof_close(void)
+{
+  if ((prof_file != NULL) && (prof_file != stdout)) {
+    fclose(prof_file);
+  }
+  prof_file = NULL;
+}
+
+// format is the rest of the object from the quoted event name on, e.g. prof_emit("\"save\",\"seconds\":%f", seconds).
+// Lines are flushed so a scraper sees them as they happen.
+void prof_emit(const char *format, ...)
+{
+  if (prof_file == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&prof_mutex);
+  fprintf(prof_file, "{\"time\":%.6f,\"event\":", prof_now() - prof_start);
+  va_list args;
+  va_start(args, format);
+  vfprintf(prof_file, format, args);
+  va_end(args);
+  fprintf(prof_file, "}\n");
+  fflush(prof_file);
+  pthread_mutex_unlock(&prof_mutex);
+}
+
+void prof_counters_merge(Prof_Counters *dst, const Prof_Counters *src, size_t count)
+{
+  memset(dst, 0, sizeof(*dst));
+  for (size_t t = 0; t < count; ++t) {
+    for (size_t l = 0; l < PROF_MAX_LAYERS; ++l) {
+      dst->forward_seconds[l] += src[t].forward_seconds[l];
+      dst->forward_flops[l] += src[t].forward_flops[l];
+      dst->backward_seconds[l] += src[t].backward_seconds[l];
+      dst->backward_flops[l] += src[t].backward_flops[l];
+    }
+    dst->loss += src[t].loss;
+    dst->correct += src[t].correct;
+    dst->count += src[t].count;
+  }
+}
+
+// Formats the "layers" array of an event: the time spent in each layer and its rate in GFLOP/s per thread.
+void prof_format_layers(char *buf, size_t len, const Prof_Counters *counters, size_t layer_count)
+{
+  size_t n = snprintf(buf, len, "[");
+  for (size_t l = 0; (l < layer_count) && (l < PROF_MAX_LAYERS) && (n < len); ++l) {
+    double forward = counters->forward_seconds[l];
+    double backward = counters->backward_seconds[l];
+    n += snprintf(buf + n, len - n,
+                  "%s{\"layer\":%zu,\"forward_seconds\":%.6f,\"forward_gflops\":%.3f,"
+                  "\"backward_seconds\":%.6f,\"backward_gflops\":%.3f}",
+                  l > 0 ? "," : "", l, forward, forward > 0 ? counters->forward_flops[l] / forward * 1e-9 : 0.0,
+                  backward, backward > 0 ? counters->backward_flops[l] / backward * 1e-9 : 0.0);
+  }
+  if (n < len) {
+    snprintf(buf + n, len - n, "]");
+  }
+}
+
+// Returns text as a JSON string literal. The result stays valid until the next call from the same thread.
+const char *prof_quote(const char *text)
+{
+  static __thread char quoted[2 * MAX_FILEPATH_LEN + 3];
+  size_t n = 0;
+  quoted[n++] = '"';
+  for (; (*text != '\0') && (n + 3) < sizeof(quoted); ++text) {
+    if ((*text == '"') || (*text == '\\')) {
+      quoted[n++] = '\\';
+    }
+    quoted[n++] = (unsigned char) *text < ' ' ? '?' : *text;
+  }
+  quoted[n++] = '"';
+  quoted[n] = '\0';
+  return quoted;
+}
+
+#endif // PROF_IMPLEMENTATION
@@ -0,0 +1,583 @@
+#ifndef QNN_H_
+#define QNN_H_
+
+// An int8 copy of an NN for inference. Layer l computes y = s_in[l] * s_w[l][j] * sum(q_in * q_w) + b[l][j] with an
+// int32 sum, where q_in are uint8 activations and q_w are int8 weights with one symmetric scale per output channel.
+// The weights are stored in groups of 4 inputs, the operand layout of vpdpbusd: row g holds the 4 weights of inputs
+// 4g to 4g + 3 for every output channel, the channels padded with zeros to QNN_CHANNELS and the inputs to QNN_ALIGN.
+// Layer 0 reads the pixels as they are (s_in[0] = 1 / 255), the hidden layers requantize their sigmoid outputs with
+// the scale calibrated for them. The last layer is left as fp32 logits.
+typedef struct {
+  size_t count;
+  size_t *widths;
+  size_t *strides;
+  int8_t **ws;
+  float **scales;
+  float **bs;
+  float *input_scales;
+  void *map;
+  size_t map_len;
+} QNN;
+
+typedef struct {
+  size_t count;
+  size_t rows;
+  uint8_t **as;
+  uint32_t *groups;
+  Matrix output;
+} QNN_Batch;
+
+#define QNN_ALIGN 64
+#define QNN_CHANNELS 16
+#define QNN_TILE 4
+
+void qnn_init(void);
+const char *qnn_kernel_name(void);
+QNN qnn_quantize(NN nn, Dataset calibration);
+void qnn_free(QNN qnn);
+QNN_Batch qnn_alloc_batch(QNN qnn, size_t rows);
+void qnn_free_batch(QNN_Batch batch);
+void qnn_set_input(QNN qnn, QNN_Batch batch, size_t row, const uint8_t *pixels);
+void qnn_forward(QNN qnn, QNN_Batch batch, size_t rows);
+NN_Model qnn_model(const QNN *qnn);
+QNN qnn_load(char *save_path, char *filename);
+void qnn_save(QNN qnn, char *save_path, char *filename);
+
+#endif // QNN_H_
+
+#ifdef QNN_IMPLEMENTATION
+
+// One layer as the kernels see it. The sum of output j is y = input_scale * scales[j] * sum + bias[j]; the last layer
+// stores y as fp32 logits, the others round(sigmoid(y) * inverse_output_scale) saturated to 255.
+typedef struct {
+  const int8_t *w;
+  size_t channels;
+  size_t n;
+  const float *scales;
+  const float *bias;
+  float input_scale;
+  float inverse_output_scale;
+  int last;
+} Qnn_Layer;
+
+// Rows row to row + rows - 1 of y, rows <= QNN_TILE, from the same rows of x, summing only over the listed groups of 4
+// inputs. y is uint8_t for the hidden layers and float for the last one, ldy elements per row.
+typedef void (*Qnn_Kernel)(const Qnn_Layer *layer, size_t rows, const uint8_t *x, size_t ldx, const uint32_t *groups,
+                           size_t group_count, void *y, size_t row, size_t ldy);
+
+static Qnn_Kernel qnn_kernel = NULL;
+static const char *qnn_name = "none";
+
+static int32_t qnn_load_group(const uint8_t *x)
+{
+  int32_t group;
+  memcpy(&group, x, sizeof(group));
+  return group;
+}
+
+static void qnn_store(const Qnn_Layer *layer, void *y, size_t index, size_t j, int32_t sum)
+{
+  float value = (float) sum * layer->input_scale * layer->scales[j] + layer->bias[j];
+  if (layer->last) {
+    ((float *) y)[index] = value;
+  } else {
+    float q = vmath_sigmoidf(value) * layer->inverse_output_scale + 0.5f;
+    ((uint8_t *) y)[index] = q < 255.0f ? (uint8_t) q : 255;
+  }
+}
+
+static void qnn_gemm_scalar(const Qnn_Layer *layer, size_t rows, const uint8_t *x, size_t ldx, const uint32_t *groups,
+                            size_t group_count, void *y, size_t row, size_t ldy)
+{
+  for (size_t i = 0; i < rows; ++i) {
+    for (size_t j = 0; j < layer->n; ++j) {
+      int32_t sum = 0;
+      for (size_t q = 0; q < group_count; ++q) {
+        const uint8_t *xg = x + i * ldx + 4 * groups[q];
+        const int8_t *wg = layer->w + (groups[q] * layer->channels + j) * 4;
+        for (size_t b = 0; b < 4; ++b) {
+          sum += (int32_t) xg[b] * wg[b];
+        }
+      }
+      qnn_store(layer, y, (row + i) * ldy + j, j, sum);
+    }
+  }
+}
+
+#ifdef GEMM_X86
+
+__attribute__((target("avx2,fma")))
+static void qnn_store_avx2(const Qnn_Layer *layer, __m256i sums, size_t j, void *y, size_t index)
+{
+  size_t left = layer->n - j < 8 ? layer->n - j : 8;
+  __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(left), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  __m256 scales = _mm256_mul_ps(_mm256_set1_ps(layer->input_scale), _mm256_maskload_ps(layer->scales + j, mask));
+  __m256 value = _mm256_fmadd_ps(_mm256_cvtepi32_ps(sums), scales, _mm256_maskload_ps(layer->bias + j, mask));
+  if (layer->last) {
+    _mm256_maskstore_ps((float *) y + index, mask, value);
+    return;
+  }
+  value = _mm256_fmadd_ps(vmath_sigmoid_avx2(value), _mm256_set1_ps(layer->inverse_output_scale),
+                          _mm256_set1_ps(0.5f));
+  __m256i q = _mm256_cvttps_epi32(_mm256_min_ps(value, _mm256_set1_ps(255.0f)));
+  __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+  uint64_t bytes = _mm_cvtsi128_si64(_mm_packus_epi16(words, words));
+  memcpy((uint8_t *) y + index, &bytes, left);
+}
+
+// pmaddubsw would add two u8 * s8 products into a saturating int16 (255 * 127 * 2 does not fit), so both operands
+// are widened to int16 first and pmaddwd sums the pairs into int32 exactly, two lanes per channel that hadd folds at
+// the end. Each load of the weights of eight channels serves the four rows of the tile; rows past the tile repeat
+// row 0 and are not stored.
+__attribute__((target("avx2,fma")))
+static void qnn_gemm_avx2(const Qnn_Layer *layer, size_t rows, const uint8_t *x, size_t ldx, const uint32_t *groups,
+                          size_t group_count, void *y, size_t row, size_t ldy)
+{
+  const uint8_t *xs[QNN_TILE];
+  for (size_t i = 0; i < QNN_TILE; ++i) {
+    xs[i] = x + (i < rows ? i : 0) * ldx;
+  }
+  for (size_t j = 0; j < layer->n; j += 8) {
+    __m256i lo0 = _mm256_setzero_si256();
+    __m256i lo1 = _mm256_setzero_si256();
+    __m256i lo2 = _mm256_setzero_si256();
+    __m256i lo3 = _mm256_setzero_si256();
+    __m256i hi0 = _mm256_setzero_si256();
+    __m256i hi1 = _mm256_setzero_si256();
+    __m256i hi2 = _mm256_setzero_si256();
+    __m256i hi3 = _mm256_setzero_si256();
+    for (size_t q = 0; q < group_count; ++q) {
+      size_t p = 4 * groups[q];
+      const int8_t *wg = layer->w + (groups[q] * layer->channels + j) * 4;
+      __m256i wlo = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) wg));
+      __m256i whi = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (wg + 16)));
+      __m256i x0 = _mm256_cvtepu8_epi16(_mm_set1_epi32(qnn_load_group(xs[0] + p)));
+      __m256i x1 = _mm256_cvtepu8_epi16(_mm_set1_epi32(qnn_load_group(xs[1] + p)));
+      __m256i x2 = _mm256_cvtepu8_epi16(_mm_set1_epi32(qnn_load_group(xs[2] + p)));
+      __m256i x3 = _mm256_cvtepu8_epi16(_mm_set1_epi32(qnn_load_group(xs[3] + p)));
+      lo0 = _mm256_add_epi32(lo0, _mm256_madd_epi16(x0, wlo));
+      hi0 = _mm256_add_epi32(hi0, _mm256_madd_epi16(x0, whi));
+      lo1 = _mm256_add_epi32(lo1, _mm256_madd_epi16(x1, wlo));
+      hi1 = _mm256_add_epi32(hi1, _mm256_madd_epi16(x1, whi));
+      lo2 = _mm256_add_epi32(lo2, _mm256_madd_epi16(x2, wlo));
+      hi2 = _mm256_add_epi32(hi2, _mm256_madd_epi16(x2, whi));
+      lo3 = _mm256_add_epi32(lo3, _mm256_madd_epi16(x3, wlo));
+      hi3 = _mm256_add_epi32(hi3, _mm256_madd_epi16(x3, whi));
+    }
+    __m256i sums[QNN_TILE] = {_mm256_hadd_epi32(lo0, hi0), _mm256_hadd_epi32(lo1, hi1), _mm256_hadd_epi32(lo2, hi2),
+                              _mm256_hadd_epi32(lo3, hi3)};
+    for (size_t i = 0; i < rows; ++i) {
+      qnn_store_avx2(layer, _mm256_permute4x64_epi64(sums[i], 0xD8), j, y, (row + i) * ldy + j);
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+static void qnn_store_avx512(const Qnn_Layer *layer, __m512i sums, size_t j, void *y, size_t index)
+{
+  __mmask16 mask = layer->n - j >= 16 ? 0xFFFF : (__mmask16) ((1u << (layer->n - j)) - 1);
+  __m512 scales = _mm512_mul_ps(_mm512_set1_ps(layer->input_scale), _mm512_maskz_loadu_ps(mask, layer->scales + j));
+  __m512 value = _mm512_fmadd_ps(_mm512_cvtepi32_ps(sums), scales, _mm512_maskz_loadu_ps(mask, layer->bias + j));
+  if (layer->last) {
+    _mm512_mask_storeu_ps((float *) y + index, mask, value);
+    return;
+  }
+  value = _mm512_fmadd_ps(vmath_sigmoid_avx512(value), _mm512_set1_ps(layer->inverse_output_scale),
+                          _mm512_set1_ps(0.5f));
+  __m512i q = _mm512_cvttps_epi32(_mm512_min_ps(value, _mm512_set1_ps(255.0f)));
+  _mm512_mask_cvtepi32_storeu_epi8((uint8_t *) y + index, mask, q);
+}
+
+// vpdpbusd multiplies the 4 bytes of a group with the 4 weights of each of 16 channels and adds them into the channel's
+// int32 lane without saturation, so the sums need no reduction. Each load of the weights of 16 channels serves the
+// four rows of the tile; rows past the tile repeat row 0 and are not stored.
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void qnn_gemm_vnni(const Qnn_Layer *layer, size_t rows, const uint8_t *x, size_t ldx, const uint32_t *groups,
+                          size_t group_count, void *y, size_t row, size_t ldy)
+{
+  const uint8_t *xs[QNN_TILE];
+  for (size_t i = 0; i < QNN_TILE; ++i) {
+    xs[i] = x + (i < rows ? i : 0) * ldx;
+  }
+  for (size_t j = 0; j < layer->n; j += QNN_CHANNELS) {
+    __m512i acc0 = _mm512_setzero_si512();
+    __m512i acc1 = _mm512_setzero_si512();
+    __m512i acc2 = _mm512_setzero_si512();
+    __m512i acc3 = _mm512_setzero_si512();
+    for (size_t q = 0; q < group_count; ++q) {
+      size_t p = 4 * groups[q];
+      __m512i wv = _mm512_loadu_si512(layer->w + (groups[q] * layer->channels + j) * 4);
+      acc0 = _mm512_dpbusd_epi32(acc0, _mm512_set1_epi32(qnn_load_group(xs[0] + p)), wv);
+      acc1 = _mm512_dpbusd_epi32(acc1, _mm512_set1_epi32(qnn_load_group(xs[1] + p)), wv);
+      acc2 = _mm512_dpbusd_epi32(acc2, _mm512_set1_epi32(qnn_load_group(xs[2] + p)), wv);
+      acc3 = _mm512_dpbusd_epi32(acc3, _mm512_set1_epi32(qnn_load_group(xs[3] + p)), wv);
+    }
+    __m512i sums[QNN_TILE] = {acc0, acc1, acc2, acc3};
+    for (size_t i = 0; i < rows; ++i) {
+      qnn_store_avx512(layer, sums[i], j, y, (row + i) * ldy + j);
+    }
+  }
+}
+
+#endif // GEMM_X86
+
+// NN_QNN=scalar|avx2|vnni forces a kernel, otherwise the widest one the CPU supports is used.
+void qnn_init(void)
+{
+  if (qnn_kernel != NULL) {
+    return;
+  }
+
+  const char *forced = getenv("NN_QNN");
+  Qnn_Kernel kernel = qnn_gemm_scalar;
+  const char *name = "scalar";
+
+#ifdef GEMM_X86
+  __builtin_cpu_init();
+  int has_vnni = __builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw");
+  int has_avx2 = __builtin_cpu_supports("avx2");
+  if (forced != NULL) {
+    has_vnni = has_vnni && (strcmp(forced, "vnni") == 0);
+    has_avx2 = has_avx2 && (strcmp(forced, "avx2") == 0);
+  }
+  if (has_vnni) {
+    kernel = qnn_gemm_vnni;
+    name = "vnni";
+  } else if (has_avx2) {
+    kernel = qnn_gemm_avx2;
+    name = "avx2";
+  }
+#else
+  (void) forced;
+#endif
+
+  qnn_name = name;
+  qnn_kernel = kernel;
+}
+
+const char *qnn_kernel_name(void)
+{
+  qnn_init();
+  return qnn_name;
+}
+
+static size_t qnn_stride(size_t width)
+{
+  return (width + QNN_ALIGN - 1) & ~((size_t) QNN_ALIGN - 1);
+}
+
+static size_t qnn_channels(size_t width)
+{
+  return (width + QNN_CHANNELS - 1) & ~((size_t) QNN_CHANNELS - 1);
+}
+
+static QNN qnn_alloc(size_t *widths, size_t layer_count)
+{
+  QNN qnn;
+  memset(&qnn, 0, sizeof(qnn));
+  qnn.count = layer_count - 1;
+  qnn.widths = malloc(sizeof(*qnn.widths) * layer_count);
+  assert(qnn.widths != NULL);
+  qnn.strides = malloc(sizeof(*qnn.strides) * layer_count);
+  assert(qnn.strides != NULL);
+  qnn.ws = malloc(sizeof(*qnn.ws) * qnn.count);
+  assert(qnn.ws != NULL);
+  qnn.scales = malloc(sizeof(*qnn.scales) * qnn.count);
+  assert(qnn.scales != NULL);
+  qnn.bs = malloc(sizeof(*qnn.bs) * qnn.count);
+  assert(qnn.bs != NULL);
+  for (size_t l = 0; l < layer_count; ++l) {
+    qnn.widths[l] = widths[l];
+    qnn.strides[l] = qnn_stride(widths[l]);
+  }
+  return qnn;
+}
+
+// The weight scales are the per-channel max |w| / 127. The activation scale of each hidden layer is the largest
+// sigmoid output seen while forwarding the calibration images through nn, divided by 255.
+QNN qnn_quantize(NN nn, Dataset calibration)
+{
+  printf("Quantizing the model on %zu images...\n", calibration.count);
+  assert(calibration.image_len == NN_INPUT(nn).cols);
+
+  size_t *widths = malloc(sizeof(*widths) * (nn.count + 1));
+  assert(widths != NULL);
+  widths[0] = nn.ws[0].rows;
+  for (size_t l = 0; l < nn.count; ++l) {
+    widths[l+1] = nn.ws[l].cols;
+  }
+  QNN qnn = qnn_alloc(widths, nn.count + 1);
+  free(widths);
+
+  qnn.input_scales = malloc(sizeof(*qnn.input_scales) * qnn.count);
+  assert(qnn.input_scales != NULL);
+  qnn.input_scales[0] = 1.0f / MAX_BRIGHTNESS;
+  for (size_t l = 1; l < qnn.count; ++l) {
+    qnn.input_scales[l] = 0.0f;
+  }
+
+  NN batch = nn_alloc_activations(nn, EVALUATION_BATCH);
+  for (size_t start = 0; start < calibration.count; start += EVALUATION_BATCH) {
+    size_t count = calibration.count - start;
+    if (count > EVALUATION_BATCH) {
+      count = EVALUATION_BATCH;
+    }
+    NN view = nn_rows(batch, 0, count);
+    matrix_from_bytes(NN_INPUT(view), &calibration.images[start * calibration.image_len]);
+    nn_forward(view);
+    for (size_t l = 1; l < qnn.count; ++l) {
+      for (size_t i = 0; i < view.as[l].rows * view.as[l].cols; ++i) {
+        if (view.as[l].items[i] > qnn.input_scales[l]) {
+          qnn.input_scales[l] = view.as[l].items[i];
+        }
+      }
+    }
+    free(view.as);
+  }
+  nn_free_activations(batch);
+  for (size_t l = 1; l < qnn.count; ++l) {
+    qnn.input_scales[l] = qnn.input_scales[l] > 0.0f ? qnn.input_scales[l] / MAX_BRIGHTNESS : 1.0f / MAX_BRIGHTNESS;
+  }
+
+  for (size_t l = 0; l < qnn.count; ++l) {
+    size_t k = qnn.widths[l];
+    size_t n = qnn.widths[l+1];
+    size_t channels = qnn_channels(n);
+    qnn.ws[l] = calloc(qnn.strides[l] * channels, sizeof(*qnn.ws[l]));
+    assert(qnn.ws[l] != NULL);
+    qnn.scales[l] = malloc(sizeof(*qnn.scales[l]) * n);
+    assert(qnn.scales[l] != NULL);
+    qnn.bs[l] = malloc(sizeof(*qnn.bs[l]) * n);
+    assert(qnn.bs[l] != NULL);
+
+    for (size_t j = 0; j < n; ++j) {
+      float max_abs = 0.0f;
+      for (size_t p = 0; p < k; ++p) {
+        float w = fabsf(MATRIX_AT(nn.ws[l], p, j));
+        if (w > max_abs) {
+          max_abs = w;
+        }
+      }
+      float scale = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+      for (size_t p = 0; p < k; ++p) {
+        qnn.ws[l][((p / 4) * channels + j) * 4 + p % 4] = (int8_t) lrintf(MATRIX_AT(nn.ws[l], p, j) / scale);
+      }
+      qnn.scales[l][j] = scale;
+      qnn.bs[l][j] = MATRIX_AT(nn.bs[l], 0, j);
+    }
+  }
+
+  printf("The model has been quantized.\n");
+  return qnn;
+}
+
+void qnn_free(QNN qnn)
+{
+  if (qnn.map != NULL) {
+    munmap(qnn.map, qnn.map_len);
+  } else {
+    for (size_t l = 0; l < qnn.count; ++l) {
+      free(qnn.ws[l]);
+      free(qnn.scales[l]);
+      free(qnn.bs[l]);
+    }
+    free(qnn.input_scales);
+  }
+  free(qnn.ws);
+  free(qnn.scales);
+  free(qnn.bs);
+  free(qnn.strides);
+  free(qnn.widths);
+}
+
+QNN_Batch qnn_alloc_batch(QNN qnn, size_t rows)
+{
+  QNN_Batch batch;
+  batch.count = qnn.count;
+  batch.rows = rows;
+  batch.as = malloc(sizeof(*batch.as) * qnn.count);
+  assert(batch.as != NULL);
+  size_t max_stride = 0;
+  for (size_t l = 0; l < qnn.count; ++l) {
+    batch.as[l] = calloc(rows * qnn.strides[l], sizeof(*batch.as[l]));
+    assert(batch.as[l] != NULL);
+    if (qnn.strides[l] > max_stride) {
+      max_stride = qnn.strides[l];
+    }
+  }
+  batch.groups = malloc(sizeof(*batch.groups) * (max_stride / 4));
+  assert(batch.groups != NULL);
+  batch.output = matrix_alloc(rows, qnn.widths[qnn.count]);
+  return batch;
+}
+
+void qnn_free_batch(QNN_Batch batch)
+{
+  for (size_t l = 0; l < batch.count; ++l) {
+    free(batch.as[l]);
+  }
+  free(batch.as);
+  free(batch.groups);
+  free(batch.output.items);
+}
+
+void qnn_set_input(QNN qnn, QNN_Batch batch, size_t row, const uint8_t *pixels)
+{
+  assert(row < batch.rows);
+  memcpy(batch.as[0] + row * qnn.strides[0], pixels, qnn.widths[0]);
+}
+
+// Forwards the rows QNN_TILE at a time. The groups of 4 inputs that are zero in every row of a tile are skipped, so
+// blank pixels cost nothing in layer 0, and the kernels requantize their sums with the vmath sigmoid as they store
+// them.
+void qnn_forward(QNN qnn, QNN_Batch batch, size_t rows)
+{
+  if (qnn_kernel == NULL) {
+    qnn_init();
+  }
+  assert(rows <= batch.rows);
+
+  for (size_t l = 0; l < qnn.count; ++l) {
+    size_t k = qnn.strides[l];
+    size_t n = qnn.widths[l+1];
+    int last = (l + 1) == qnn.count;
+    Qnn_Layer layer = {qnn.ws[l], qnn_channels(n), n, qnn.scales[l], qnn.bs[l], qnn.input_scales[l],
+                       last ? 0.0f : 1.0f / qnn.input_scales[l+1], last};
+    void *y = last ? (void *) batch.output.items : (void *) batch.as[l+1];
+    size_t ldy = last ? batch.output.cols : qnn.strides[l+1];
+
+    for (size_t i = 0; i < rows; i += QNN_TILE) {
+      size_t tile = rows - i < QNN_TILE ? rows - i : QNN_TILE;
+      const uint8_t *x = batch.as[l] + i * k;
+      // Two groups per word, the first in the low half as the host is little-endian like the model files.
+      size_t group_count = 0;
+      for (size_t p = 0; p < k; p += 8) {
+        uint64_t any = 0;
+        for (size_t r = 0; r < tile; ++r) {
+          uint64_t bits;
+          memcpy(&bits, x + r * k + p, sizeof(bits));
+          any |= bits;
+        }
+        batch.groups[group_count] = p / 4;
+        group_count += (any & 0xFFFFFFFF) != 0;
+        batch.groups[group_count] = p / 4 + 1;
+        group_count += (any >> 32) != 0;
+      }
+      qnn_kernel(&layer, tile, x, k, batch.groups, group_count, y, i, ldy);
+    }
+  }
+}
+
+static void *qnn_model_alloc_batch(const void *model, size_t rows)
+{
+  QNN_Batch *batch = malloc(sizeof(*batch));
+  assert(batch != NULL);
+  *batch = qnn_alloc_batch(*(const QNN *) model, rows);
+  return batch;
+}
+
+static void qnn_model_free_batch(const void *model, void *batch)
+{
+  qnn_free_batch(*(QNN_Batch *) batch);
+  free(batch);
+}
+
+static Matrix qnn_model_forward(const void *model, void *batch, const uint8_t *images, size_t count)
+{
+  const QNN *qnn = model;
+  QNN_Batch *qnn_batch = batch;
+  for (size_t i = 0; i < count; ++i) {
+    qnn_set_input(*qnn, *qnn_batch, i, &images[i * qnn->widths[0]]);
+  }
+  qnn_forward(*qnn, *qnn_batch, count);
+  return matrix_rows(qnn_batch->output, 0, count);
+}
+
+NN_Model qnn_model(const QNN *qnn)
+{
+  NN_Model model = {qnn, "int8", qnn_kernel_name(), qnn->widths[0], qnn->widths[qnn->count], qnn->count * sizeof(float),
+                    0, 0, qnn_model_alloc_batch, qnn_model_free_batch, qnn_model_forward};
+  for (size_t l = 0; l < qnn->count; ++l) {
+    size_t n = qnn->widths[l+1];
+    model.bytes += qnn->strides[l] * qnn_channels(n) * sizeof(int8_t) + 2 * n * sizeof(float);
+    model.flops += 2 * qnn->widths[l] * n;
+  }
+  return model;
+}
+
+// Tensors per layer: the transposed int8 weights, the fp32 channel scales and the fp32 biases. The fp32 input scales
+// of every layer come last.
+QNN qnn_load(char *save_path, char *filename)
+{
+  NN_Model_File file = nn_model_open(save_path, filename, 1u << NN_DTYPE_I8, 3, 1);
+  NN_Model_Header header = file.header;
+  const NN_Model_Tensor *tensors = file.tensors;
+  uint8_t *map = file.map;
+  QNN qnn = qnn_alloc(file.widths, header.layer_count);
+  free(file.widths);
+  qnn.map = map;
+  qnn.map_len = file.map_len;
+
+  for (size_t l = 0; l < qnn.count; ++l) {
+    const NN_Model_Tensor *t = &tensors[3 * l];
+    size_t n = qnn.widths[l+1];
+    if (!nn_model_tensor_check(header, &t[0], NN_DTYPE_I8, qnn.strides[l] / 4, 4 * qnn_channels(n), sizeof(int8_t)) ||
+        !nn_model_tensor_check(header, &t[1], NN_DTYPE_F32, 1, n, sizeof(float)) ||
+        !nn_model_tensor_check(header, &t[2], NN_DTYPE_F32, 1, n, sizeof(float))) {
+      fprintf(stderr, "Invalid model tensor.");
+      exit(1);
+    }
+    qnn.ws[l] = (int8_t *) (map + t[0].offset);
+    qnn.scales[l] = (float *) (map + t[1].offset);
+    qnn.bs[l] = (float *) (map + t[2].offset);
+  }
+  const NN_Model_Tensor *t = &tensors[3 * qnn.count];
+  if (!nn_model_tensor_check(header, t, NN_DTYPE_F32, 1, qnn.count, sizeof(float))) {
+    fprintf(stderr, "Invalid model tensor.");
+    exit(1);
+  }
+  qnn.input_scales = (float *) (map + t->offset);
+  return qnn;
+}
+
+void qnn_save(QNN qnn, char *save_path, char *filename)
+{
+  printf("Saving the model...\n");
+
+  char fullname[MAX_FILEPATH_LEN];
+  snprintf(fullname, sizeof(fullname), "%s%s", save_path, filename);
+
+  uint32_t *arch = malloc(sizeof(*arch) * (qnn.count + 1));
+  assert(arch != NULL);
+  for (size_t l = 0; l <= qnn.count; ++l) {
+    arch[l] = qnn.widths[l];
+  }
+
+  size_t tensor_count = 3 * qnn.count + 1;
+  NN_Model_Tensor *tensors = calloc(tensor_count, sizeof(*tensors));
+  assert(tensors != NULL);
+  const void **data = malloc(sizeof(*data) * tensor_count);
+  assert(data != NULL);
+  for (size_t l = 0; l < qnn.count; ++l) {
+    NN_Model_Tensor *t = &tensors[3 * l];
+    size_t n = qnn.widths[l+1];
+    size_t groups = qnn.strides[l] / 4;
+    size_t channels = qnn_channels(n);
+    t[0] = (NN_Model_Tensor) {NN_DTYPE_I8, groups, 4 * channels, 0, 0, groups * 4 * channels * sizeof(int8_t)};
+    t[1] = (NN_Model_Tensor) {NN_DTYPE_F32, 1, n, 0, 0, n * sizeof(float)};
+    t[2] = (NN_Model_Tensor) {NN_DTYPE_F32, 1, n, 0, 0, n * sizeof(float)};
+    data[3 * l] = qnn.ws[l];
+    data[3 * l + 1] = qnn.scales[l];
+    data[3 * l + 2] = qnn.bs[l];
+  }
+  tensors[3 * qnn.count] = (NN_Model_Tensor) {NN_DTYPE_F32, 1, qnn.count, 0, 0, qnn.count * sizeof(float)};
+  data[3 * qnn.count] = qnn.input_scales;
+  nn_model_write(fullname, NN_DTYPE_I8, arch, qnn.count + 1, tensors, data, tensor_count);
+
+  free(data);
+  free(tensors);
+  free(arch);
+  printf("The model has been saved as %s.\n", filename);
+}
+
+#endif // QNN_IMPLEMENTATION
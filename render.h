@@ -0,0 +1,429 @@
+#ifndef RENDER_H_
+#define RENDER_H_
+
+// The geometry of a rendered model never changes, only its colors do, so the first frame of an architecture replays
+// nn_render into a cache of spans: every pixel ends up the color of the last line drawn over it, or the background,
+// with the circles drawn after that line blended on top in drawing order. Later frames fill the line spans from a
+// palette of the new colors and blend the circle spans, a band of rows per pool thread, and match nn_render exactly.
+typedef struct {
+  uint16_t x;
+  uint16_t len;
+  uint32_t index;
+} Render_Span;
+
+typedef struct {
+  uint16_t x;
+  uint16_t y;
+  uint16_t len;
+  uint8_t alpha;
+  uint32_t neuron;
+} Render_Blend;
+
+// Row y has the line spans from line_rows[y] up to line_rows[y+1], palette index 0 being the background and 1 + c
+// connection c in nn_render order, and likewise the circle blends of the neurons in nn_render order.
+typedef struct {
+  size_t width;
+  size_t height;
+  size_t connection_count;
+  size_t neuron_count;
+  Render_Span *lines;
+  size_t *line_rows;
+  Render_Blend *circles;
+  size_t *circle_rows;
+  uint32_t *palette;
+  uint32_t *neuron_colors;
+  Olivec_Canvas canvas;
+} Render_Cache;
+
+// Renders training snapshots on a background thread. The trainer copies the weights into whichever of the two
+// frames the worker is not drawing and returns immediately. A frame that was not picked up yet is overwritten, so a
+// slow worker coalesces frames instead of stalling training.
+typedef struct {
+  NN frames[2];
+  size_t epochs[2];
+  int pending;
+  int drawing;
+  size_t step;
+  size_t rendered;
+  size_t dropped;
+  size_t threads;
+  Render_Cache *cache;
+  Pool *pool;
+  int stop;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t ready;
+} Render_Worker;
+
+#define RENDER_CACHE_MARGIN 4
+#define RENDER_PNG_FILTER 1
+#define RENDER_PNG_LEVEL 1
+
+Render_Cache *render_cache_create(Olivec_Canvas scratch, NN nn);
+void render_cache_draw(Render_Cache *cache, Pool *pool, Olivec_Canvas canvas, NN nn);
+void render_cache_free(Render_Cache *cache);
+int render_png(char *path, Olivec_Canvas canvas);
+Render_Worker *render_worker_create(NN nn, size_t step, size_t threads);
+int render_worker_submit(void *context, NN nn, size_t epoch);
+void render_worker_destroy(Render_Worker *worker);
+
+#endif // RENDER_H_
+
+#ifdef RENDER_IMPLEMENTATION
+
+static volatile sig_atomic_t render_paused = 0;
+
+static void render_toggle(int signal)
+{
+  (void) signal;
+  render_paused = !render_paused;
+}
+
+static size_t render_layer_width(NN nn, size_t l)
+{
+  return l < nn.count ? nn.ws[l].rows : nn.ws[l-1].cols;
+}
+
+// Splits every row of the owner map into runs of pixels last drawn by the same line.
+static void render_cache_lines(Render_Cache *cache, Olivec_Canvas owners)
+{
+  size_t count = 0;
+  for (int pass = 0; pass < 2; ++pass) {
+    count = 0;
+    for (size_t y = 0; y < cache->height; ++y) {
+      if (pass == 1) {
+        cache->line_rows[y] = count;
+      }
+      size_t x = 0;
+      while (x < cache->width) {
+        uint32_t owner = OLIVEC_PIXEL(owners, x, y) & 0xFFFFFF;
+        size_t len = 1;
+        while (((x + len) < cache->width) && ((OLIVEC_PIXEL(owners, x + len, y) & 0xFFFFFF) == owner)) {
+          len += 1;
+        }
+        if (pass == 1) {
+          cache->lines[count] = (Render_Span) {x, len, owner};
+        }
+        count += 1;
+        x += len;
+      }
+    }
+    if (pass == 0) {
+      cache->lines = malloc(sizeof(*cache->lines) * count);
+      assert(cache->lines != NULL);
+      cache->line_rows = malloc(sizeof(*cache->line_rows) * (cache->height + 1));
+      assert(cache->line_rows != NULL);
+    }
+  }
+  cache->line_rows[cache->height] = count;
+}
+
+// Rasterizes every circle alone on a small canvas, where the red channel of a white circle over black is the alpha
+// olivec_circle blends each pixel with, and keeps the pixels no later line covers. The blends come out in drawing
+// order and a stable counting sort groups them by row.
+static void render_cache_circles(Render_Cache *cache, Olivec_Canvas owners, NN nn)
+{
+  int margin = NN_RENDER_RADIUS + RENDER_CACHE_MARGIN;
+  size_t side = 2 * margin + 1;
+  uint32_t *scratch_pixels = malloc(sizeof(*scratch_pixels) * side * side);
+  assert(scratch_pixels != NULL);
+  Olivec_Canvas scratch = olivec_canvas(scratch_pixels, side, side, side);
+
+  size_t cap = 1024;
+  size_t count = 0;
+  Render_Blend *blends = malloc(sizeof(*blends) * cap);
+  assert(blends != NULL);
+  size_t neuron = 0;
+  size_t connection = 0;
+  for (size_t l = 0; l <= nn.count; ++l) {
+    for (size_t i = 0; i < render_layer_width(nn, l); ++i, ++neuron) {
+      connection += l < nn.count ? nn.ws[l].cols : 0;
+      int cx, cy;
+      nn_render_center(owners, nn, l, i, &cx, &cy);
+      olivec_fill(scratch, 0xFF000000);
+      olivec_circle(scratch, margin, margin, NN_RENDER_RADIUS, 0xFFFFFFFF);
+      for (int sy = 0; sy < (int) side; ++sy) {
+        int y = cy - margin + sy;
+        for (int sx = 0; (y >= 0) && (y < (int) cache->height) && (sx < (int) side); ++sx) {
+          int x = cx - margin + sx;
+          uint8_t alpha = OLIVEC_PIXEL(scratch, sx, sy) & 0xFF;
+          uint32_t owner = (x >= 0) && (x < (int) cache->width) ? OLIVEC_PIXEL(owners, x, y) & 0xFFFFFF : 0;
+          if ((x < 0) || (x >= (int) cache->width) || (alpha == 0) || ((owner != 0) && (owner > connection))) {
+            continue;
+          }
+          Render_Blend *last = count > 0 ? &blends[count - 1] : NULL;
+          if ((last != NULL) && (last->y == y) && ((last->x + last->len) == x) && (last->alpha == alpha) &&
+              (last->neuron == neuron)) {
+            last->len += 1;
+            continue;
+          }
+          if (count == cap) {
+            cap *= 2;
+            blends = realloc(blends, sizeof(*blends) * cap);
+            assert(blends != NULL);
+          }
+          blends[count++] = (Render_Blend) {x, y, 1, alpha, neuron};
+        }
+      }
+    }
+  }
+  free(scratch_pixels);
+
+  cache->circle_rows = calloc(cache->height + 1, sizeof(*cache->circle_rows));
+  assert(cache->circle_rows != NULL);
+  cache->circles = malloc(sizeof(*cache->circles) * (count > 0 ? count : 1));
+  assert(cache->circles != NULL);
+  for (size_t b = 0; b < count; ++b) {
+    cache->circle_rows[blends[b].y + 1] += 1;
+  }
+  for (size_t y = 0; y < cache->height; ++y) {
+    cache->circle_rows[y + 1] += cache->circle_rows[y];
+  }
+  size_t *next = malloc(sizeof(*next) * cache->height);
+  assert(next != NULL);
+  memcpy(next, cache->circle_rows, sizeof(*next) * cache->height);
+  for (size_t b = 0; b < count; ++b) {
+    cache->circles[next[blends[b].y]++] = blends[b];
+  }
+  free(next);
+  free(blends);
+}
+
+// Draws the lines of nn into scratch with their index as the color, which olivec_blend_color copies as is since the
+// lines are opaque, so scratch becomes a map of the last line over every pixel. The rasterization is olive's own.
+Render_Cache *render_cache_create(Olivec_Canvas scratch, NN nn)
+{
+  double start = prof_now();
+  assert((scratch.width <= UINT16_MAX) && (scratch.height <= UINT16_MAX));
+  Render_Cache *cache = calloc(1, sizeof(*cache));
+  assert(cache != NULL);
+  cache->width = scratch.width;
+  cache->height = scratch.height;
+  for (size_t l = 0; l <= nn.count; ++l) {
+    cache->neuron_count += render_layer_width(nn, l);
+    cache->connection_count += l < nn.count ? nn.ws[l].rows * nn.ws[l].cols : 0;
+  }
+  assert(cache->connection_count < 0xFFFFFF);
+
+  olivec_fill(scratch, 0xFF000000);
+  uint32_t owner = 0;
+  for (size_t l = 0; l < nn.count; ++l) {
+    for (size_t i = 0; i < nn.ws[l].rows; ++i) {
+      int cx1, cy1;
+      nn_render_center(scratch, nn, l, i, &cx1, &cy1);
+      for (size_t j = 0; j < nn.ws[l].cols; ++j) {
+        int cx2, cy2;
+        nn_render_center(scratch, nn, l + 1, j, &cx2, &cy2);
+        olivec_line(scratch, cx1, cy1, cx2, cy2, 0xFF000000 | ++owner);
+      }
+    }
+  }
+  render_cache_lines(cache, scratch);
+  render_cache_circles(cache, scratch, nn);
+
+  cache->palette = malloc(sizeof(*cache->palette) * (cache->connection_count + 1));
+  assert(cache->palette != NULL);
+  cache->neuron_colors = malloc(sizeof(*cache->neuron_colors) * cache->neuron_count);
+  assert(cache->neuron_colors != NULL);
+  prof_emit("\"render_cache\",\"line_spans\":%zu,\"circle_spans\":%zu,\"seconds\":%.6f",
+            cache->line_rows[cache->height], cache->circle_rows[cache->height], prof_now() - start);
+  return cache;
+}
+
+// An opaque blend only replaces the color channels, so it is a plain store.
+static void render_cache_task(void *context, size_t thread_index, size_t thread_count)
+{
+  Render_Cache *cache = context;
+  size_t start, end;
+  pool_split(cache->height, thread_index, thread_count, &start, &end);
+  for (size_t y = start; y < end; ++y) {
+    uint32_t *row = &OLIVEC_PIXEL(cache->canvas, 0, y);
+    for (size_t s = cache->line_rows[y]; s < cache->line_rows[y + 1]; ++s) {
+      Render_Span span = cache->lines[s];
+      uint32_t color = cache->palette[span.index];
+      for (size_t x = span.x; x < (size_t) (span.x + span.len); ++x) {
+        row[x] = color;
+      }
+    }
+    for (size_t b = cache->circle_rows[y]; b < cache->circle_rows[y + 1]; ++b) {
+      Render_Blend blend = cache->circles[b];
+      uint32_t color = (cache->neuron_colors[blend.neuron] & 0x00FFFFFF) | ((uint32_t) blend.alpha << (8*3));
+      for (size_t x = blend.x; x < (size_t) (blend.x + blend.len); ++x) {
+        if (blend.alpha == 0xFF) {
+          row[x] = (row[x] & 0xFF000000) | (color & 0x00FFFFFF);
+        } else {
+          olivec_blend_color(&row[x], color);
+        }
+      }
+    }
+  }
+}
+
+void render_cache_draw(Render_Cache *cache, Pool *pool, Olivec_Canvas canvas, NN nn)
+{
+  assert((canvas.width == cache->width) && (canvas.height == cache->height));
+  size_t connection = 0;
+  size_t neuron = 0;
+  cache->palette[0] = BACKGROUND_COLOR;
+  for (size_t l = 0; l <= nn.count; ++l) {
+    for (size_t i = 0; i < render_layer_width(nn, l); ++i) {
+      for (size_t j = 0; (l < nn.count) && (j < nn.ws[l].cols); ++j) {
+        cache->palette[++connection] = nn_render_color(MATRIX_AT(nn.ws[l], i, j));
+      }
+      cache->neuron_colors[neuron++] = l > 0 ? nn_render_color(MATRIX_AT(nn.bs[l-1], 0, i)) : NN_RENDER_NEUTRAL_COLOR;
+    }
+  }
+  assert((connection == cache->connection_count) && (neuron == cache->neuron_count));
+  cache->canvas = canvas;
+  pool_run(pool, render_cache_task, cache);
+}
+
+void render_cache_free(Render_Cache *cache)
+{
+  free(cache->lines);
+  free(cache->line_rows);
+  free(cache->circles);
+  free(cache->circle_rows);
+  free(cache->palette);
+  free(cache->neuron_colors);
+  free(cache);
+}
+
+// The frames are large and mostly flat, so the sub filter on every row and a low zlib level compress them several
+// times faster than stb's default of trying every filter at level 8, for slightly larger files.
+int render_png(char *path, Olivec_Canvas canvas)
+{
+  stbi_write_png_compression_level = RENDER_PNG_LEVEL;
+  stbi_write_force_png_filter = RENDER_PNG_FILTER;
+  return stbi_write_png(path, canvas.width, canvas.height, PNG_CHANNELS, canvas.pixels,
+                        canvas.stride * sizeof(uint32_t));
+}
+
+// The cache and the pool are made on the first frame, on the worker thread, so their threads inherit its priority.
+static void render_frame(Render_Worker *worker, NN nn, size_t epoch)
+{
+  double start = prof_now();
+  Olivec_Canvas canvas = olivec_canvas(canvas_pixels, RENDER_WIDTH, RENDER_HEIGHT, RENDER_WIDTH);
+  if (worker->cache == NULL) {
+    worker->pool = pool_create(worker->threads);
+    worker->cache = render_cache_create(canvas, nn);
+  }
+  render_cache_draw(worker->cache, worker->pool, canvas, nn);
+
+  char canvas_filepath[MAX_FILEPATH_LEN];
+  snprintf(canvas_filepath, sizeof(canvas_filepath), "%s%04zu.png", RENDER_PATH, epoch);
+  if (!render_png(canvas_filepath, canvas)) {
+    fprintf(stderr, "Could not save the file.");
+  }
+  prof_emit("\"render\",\"epoch\":%zu,\"seconds\":%.6f", epoch, prof_now() - start);
+}
+
+static void *render_worker_run(void *arg)
+{
+  Render_Worker *worker = arg;
+
+  pthread_mutex_lock(&worker->mutex);
+  for (;;) {
+    while ((worker->pending == -1) && !worker->stop) {
+      pthread_cond_wait(&worker->ready, &worker->mutex);
+    }
+    if (worker->pending == -1) {
+      break;
+    }
+    int frame = worker->pending;
+    worker->pending = -1;
+    worker->drawing = frame;
+    pthread_mutex_unlock(&worker->mutex);
+
+    render_frame(worker, worker->frames[frame], worker->epochs[frame]);
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->drawing = -1;
+    worker->rendered += 1;
+  }
+  pthread_mutex_unlock(&worker->mutex);
+  return NULL;
+}
+
+// The worker runs at idle priority where the platform has one, so it only takes CPU time training leaves unused.
+// SIGUSR1 pauses and resumes rendering while training.
+Render_Worker *render_worker_create(NN nn, size_t step, size_t threads)
+{
+  assert(step > 0);
+  Render_Worker *worker = calloc(1, sizeof(*worker));
+  assert(worker != NULL);
+  for (size_t f = 0; f < 2; ++f) {
+    worker->frames[f] = nn_alloc_params(nn);
+  }
+  worker->pending = -1;
+  worker->drawing = -1;
+  worker->step = step;
+  worker->threads = threads;
+  pthread_mutex_init(&worker->mutex, NULL);
+  pthread_cond_init(&worker->ready, NULL);
+
+  if (pthread_create(&worker->thread, NULL, render_worker_run, worker) != 0) {
+    fprintf(stderr, "Error creating a thread.");
+    exit(1);
+  }
+#ifdef SCHED_IDLE
+  struct sched_param param = {0};
+  pthread_setschedparam(worker->thread, SCHED_IDLE, &param);
+#endif
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = render_toggle;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &action, NULL);
+  return worker;
+}
+
+// Keeps the original cadence: the first epoch, then the last epoch of every step.
+int render_worker_submit(void *context, NN nn, size_t epoch)
+{
+  Render_Worker *worker = context;
+  if (render_paused || ((epoch != 0) && ((epoch % worker->step) != (worker->step - 1)))) {
+    return 1;
+  }
+
+  pthread_mutex_lock(&worker->mutex);
+  int frame = worker->drawing == 0 ? 1 : 0;
+  if (worker->pending != -1) {
+    frame = worker->pending;
+    worker->dropped += 1;
+  }
+  memcpy(worker->frames[frame].params, nn.params, sizeof(float) * nn.param_count);
+  worker->epochs[frame] = epoch;
+  worker->pending = frame;
+  pthread_cond_signal(&worker->ready);
+  pthread_mutex_unlock(&worker->mutex);
+  return 1;
+}
+
+// Renders the frame still pending, if any, so the last snapshot is never lost.
+void render_worker_destroy(Render_Worker *worker)
+{
+  pthread_mutex_lock(&worker->mutex);
+  worker->stop = 1;
+  pthread_cond_signal(&worker->ready);
+  pthread_mutex_unlock(&worker->mutex);
+  pthread_join(worker->thread, NULL);
+
+  printf("Rendered %zu frame(s), coalesced %zu.\n", worker->rendered, worker->dropped);
+
+  signal(SIGUSR1, SIG_DFL);
+  if (worker->cache != NULL) {
+    render_cache_free(worker->cache);
+    pool_destroy(worker->pool);
+  }
+  for (size_t f = 0; f < 2; ++f) {
+    nn_free_params(worker->frames[f]);
+  }
+  pthread_cond_destroy(&worker->ready);
+  pthread_mutex_destroy(&worker->mutex);
+  free(worker);
+}
+
+#endif // RENDER_IMPLEMENTATION
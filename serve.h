@@ -0,0 +1,565 @@
+#ifndef SERVE_H_
+#define SERVE_H_
+
+// Every request is a Serve_Request_Header followed by len payload bytes. Every answer is a Serve_Response_Header
+// followed by count floats: the softmax probabilities of the digits, or nothing when status is not SERVE_OK.
+#define SERVE_FRAME_RAW 0
+#define SERVE_FRAME_PGM 1
+#define SERVE_RELOAD 2
+#define SERVE_MAX_PAYLOAD 65536
+
+#define SERVE_OK 0
+#define SERVE_BAD_REQUEST -1
+#define SERVE_BAD_MODEL -2
+#define SERVE_RELOAD_FAILED -3
+
+typedef struct {
+  uint8_t type;
+  uint8_t model;
+  uint16_t reserved;
+  uint32_t len;
+} Serve_Request_Header;
+
+typedef struct {
+  int32_t status;
+  uint32_t count;
+} Serve_Response_Header;
+
+typedef struct Serve_Job {
+  uint8_t pixels[IMAGE_UNIT_LEN];
+  size_t model;
+  float probabilities[DIGITS];
+  int done;
+  pthread_cond_t finished;
+  struct Serve_Job *next;
+} Serve_Job;
+
+typedef struct {
+  char **model_paths;
+  size_t model_count;
+  NN *models;
+  size_t *legacy_arch;
+  size_t legacy_arch_count;
+  pthread_rwlock_t models_lock;
+  pthread_mutex_t reload_lock;
+  pthread_mutex_t mutex;
+  pthread_cond_t ready;
+  Serve_Job *head;
+  Serve_Job *tail;
+  int listener;
+} Server;
+
+void serve(char *socket_path, char **model_paths, size_t model_count, size_t *legacy_arch, size_t legacy_arch_count,
+           size_t batcher_count);
+int serve_client(char *socket_path, char *image_path, uint8_t model);
+int serve_loadgen(char *socket_path, size_t requests, size_t connections);
+
+#endif // SERVE_H_
+
+#ifdef SERVE_IMPLEMENTATION
+
+static int serve_read_all(int fd, void *buf, size_t len)
+{
+  uint8_t *bytes = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, bytes, len);
+    if (n <= 0) {
+      if ((n < 0) && (errno == EINTR)) {
+        continue;
+      }
+      return 0;
+    }
+    bytes += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static int serve_write_all(int fd, const void *buf, size_t len)
+{
+  const uint8_t *bytes = buf;
+  while (len > 0) {
+    ssize_t n = send(fd, bytes, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      if ((n < 0) && (errno == EINTR)) {
+        continue;
+      }
+      return 0;
+    }
+    bytes += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static int serve_connect(char *socket_path)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Loads every model first and only swaps them in when all of them loaded, so a bad file keeps the old models serving.
+// The models are mapped, so new versions must replace the files (rename) instead of being written over them.
+static int serve_reload(Server *server)
+{
+  pthread_mutex_lock(&server->reload_lock);
+  printf("Loading %zu model(s)...\n", server->model_count);
+  fflush(stdout);
+
+  NN *models = malloc(sizeof(*models) * server->model_count);
+  assert(models != NULL);
+  size_t loaded = 0;
+  for (; loaded < server->model_count; ++loaded) {
+    if (!nn_load_file(server->model_paths[loaded], server->legacy_arch, server->legacy_arch_count, &models[loaded])) {
+      fprintf(stderr, " (%s)\n", server->model_paths[loaded]);
+      break;
+    }
+    if ((NN_INPUT(models[loaded]).cols != IMAGE_UNIT_LEN) || (NN_OUTPUT(models[loaded]).cols != DIGITS)) {
+      fprintf(stderr, "The model %s must take %d pixels and output %d digits.\n", server->model_paths[loaded],
+              IMAGE_UNIT_LEN, DIGITS);
+      nn_free(models[loaded]);
+      break;
+    }
+  }
+  if (loaded < server->model_count) {
+    for (size_t i = 0; i < loaded; ++i) {
+      nn_free(models[i]);
+    }
+    free(models);
+    fprintf(stderr, "Keeping the previous models.\n");
+    pthread_mutex_unlock(&server->reload_lock);
+    return 0;
+  }
+
+  pthread_rwlock_wrlock(&server->models_lock);
+  NN *old = server->models;
+  server->models = models;
+  pthread_rwlock_unlock(&server->models_lock);
+
+  if (old != NULL) {
+    for (size_t i = 0; i < server->model_count; ++i) {
+      nn_free(old[i]);
+    }
+    free(old);
+  }
+
+  printf("The models have been loaded.\n");
+  fflush(stdout);
+  pthread_mutex_unlock(&server->reload_lock);
+  return 1;
+}
+
+static void *serve_reload_worker(void *arg)
+{
+  Server *server = arg;
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  for (;;) {
+    int signal;
+    if (sigwait(&signals, &signal) == 0) {
+      serve_reload(server);
+    }
+  }
+  return NULL;
+}
+
+static int serve_fits(NN scratch, NN nn)
+{
+  if ((scratch.as == NULL) || (scratch.count != nn.count) || (scratch.as[0].cols != nn.ws[0].rows)) {
+    return 0;
+  }
+  for (size_t l = 0; l < nn.count; ++l) {
+    if (scratch.as[l+1].cols != nn.ws[l].cols) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Drains up to SERVE_BATCH queued requests for the model of the oldest one and answers all of them with one forward
+// pass. Under light load a batch is a single request, so batching never adds waiting time.
+static void *serve_batcher(void *arg)
+{
+  Server *server = arg;
+  Serve_Job *jobs[SERVE_BATCH];
+  NN *scratch = calloc(server->model_count, sizeof(*scratch));
+  assert(scratch != NULL);
+  Matrix *views = NULL;
+  size_t views_len = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&server->mutex);
+    while (server->head == NULL) {
+      pthread_cond_wait(&server->ready, &server->mutex);
+    }
+    size_t model = server->head->model;
+    size_t count = 0;
+    Serve_Job **link = &server->head;
+    Serve_Job *last = NULL;
+    while ((*link != NULL) && (count < SERVE_BATCH)) {
+      Serve_Job *job = *link;
+      if (job->model == model) {
+        jobs[count++] = job;
+        *link = job->next;
+      } else {
+        last = job;
+        link = &job->next;
+      }
+    }
+    server->tail = last;
+    while ((server->tail != NULL) && (server->tail->next != NULL)) {
+      server->tail = server->tail->next;
+    }
+    if (server->tail == NULL) {
+      server->tail = server->head;
+      while ((server->tail != NULL) && (server->tail->next != NULL)) {
+        server->tail = server->tail->next;
+      }
+    }
+    if (server->head != NULL) {
+      pthread_cond_signal(&server->ready);
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    pthread_rwlock_rdlock(&server->models_lock);
+    NN nn = server->models[model];
+    if (!serve_fits(scratch[model], nn)) {
+      if (scratch[model].as != NULL) {
+        nn_free_activations(scratch[model]);
+      }
+      scratch[model] = nn_alloc_activations(nn, SERVE_BATCH);
+    }
+    if (views_len < (nn.count + 1)) {
+      views_len = nn.count + 1;
+      views = realloc(views, sizeof(*views) * views_len);
+      assert(views != NULL);
+    }
+
+    NN batch = nn;
+    batch.as = views;
+    for (size_t l = 0; l <= nn.count; ++l) {
+      batch.as[l] = matrix_rows(scratch[model].as[l], 0, count);
+    }
+    for (size_t i = 0; i < count; ++i) {
+      matrix_from_bytes(matrix_rows(NN_INPUT(batch), i, 1), jobs[i]->pixels);
+    }
+    nn_predict(batch);
+    for (size_t i = 0; i < count; ++i) {
+      memcpy(jobs[i]->probabilities, &MATRIX_AT(NN_OUTPUT(batch), i, 0), sizeof(jobs[i]->probabilities));
+    }
+    pthread_rwlock_unlock(&server->models_lock);
+
+    pthread_mutex_lock(&server->mutex);
+    for (size_t i = 0; i < count; ++i) {
+      jobs[i]->done = 1;
+      pthread_cond_signal(&jobs[i]->finished);
+    }
+    pthread_mutex_unlock(&server->mutex);
+  }
+  return NULL;
+}
+
+static int serve_respond(int fd, int32_t status, const float *probabilities)
+{
+  Serve_Response_Header response;
+  response.status = status;
+  response.count = status == SERVE_OK ? DIGITS : 0;
+  if (!serve_write_all(fd, &response, sizeof(response))) {
+    return 0;
+  }
+  return (status != SERVE_OK) || serve_write_all(fd, probabilities, sizeof(float) * DIGITS);
+}
+
+typedef struct {
+  Server *server;
+  int fd;
+} Serve_Connection;
+
+static void *serve_connection(void *arg)
+{
+  Serve_Connection *connection = arg;
+  Server *server = connection->server;
+  int fd = connection->fd;
+  free(connection);
+
+  uint8_t *payload = malloc(SERVE_MAX_PAYLOAD);
+  assert(payload != NULL);
+  Serve_Job job;
+  pthread_cond_init(&job.finished, NULL);
+
+  Serve_Request_Header request;
+  while (serve_read_all(fd, &request, sizeof(request))) {
+    if ((request.len > SERVE_MAX_PAYLOAD) || !serve_read_all(fd, payload, request.len)) {
+      break;
+    }
+
+    int32_t status = SERVE_OK;
+    if (request.type == SERVE_RELOAD) {
+      status = serve_reload(server) ? SERVE_OK : SERVE_RELOAD_FAILED;
+      if (!serve_write_all(fd, &(Serve_Response_Header) {status, 0}, sizeof(Serve_Response_Header))) {
+        break;
+      }
+      continue;
+    } else if (request.model >= server->model_count) {
+      status = SERVE_BAD_MODEL;
+    } else if (request.type == SERVE_FRAME_RAW) {
+      if (request.len == IMAGE_UNIT_LEN) {
+        memcpy(job.pixels, payload, IMAGE_UNIT_LEN);
+      } else {
+        status = SERVE_BAD_REQUEST;
+      }
+    } else if (request.type == SERVE_FRAME_PGM) {
+      if (!pgm_decode(payload, request.len, job.pixels, IMAGE_WIDTH, IMAGE_HEIGHT)) {
+        status = SERVE_BAD_REQUEST;
+      }
+    } else {
+      status = SERVE_BAD_REQUEST;
+    }
+
+    if (status == SERVE_OK) {
+      job.model = request.model;
+      job.done = 0;
+      job.next = NULL;
+      pthread_mutex_lock(&server->mutex);
+      if (server->tail != NULL) {
+        server->tail->next = &job;
+      } else {
+        server->head = &job;
+      }
+      server->tail = &job;
+      pthread_cond_signal(&server->ready);
+      while (!job.done) {
+        pthread_cond_wait(&job.finished, &server->mutex);
+      }
+      pthread_mutex_unlock(&server->mutex);
+    }
+
+    if (!serve_respond(fd, status, job.probabilities)) {
+      break;
+    }
+  }
+
+  pthread_cond_destroy(&job.finished);
+  free(payload);
+  close(fd);
+  return NULL;
+}
+
+void serve(char *socket_path, char **model_paths, size_t model_count, size_t *legacy_arch, size_t legacy_arch_count,
+           size_t batcher_count)
+{
+  Server *server = calloc(1, sizeof(*server));
+  assert(server != NULL);
+  server->model_paths = model_paths;
+  server->model_count = model_count;
+  server->legacy_arch = legacy_arch;
+  server->legacy_arch_count = legacy_arch_count;
+  pthread_rwlock_init(&server->models_lock, NULL);
+  pthread_mutex_init(&server->reload_lock, NULL);
+  pthread_mutex_init(&server->mutex, NULL);
+  pthread_cond_init(&server->ready, NULL);
+
+  if (!serve_reload(server)) {
+    exit(1);
+  }
+
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, serve_reload_worker, server) != 0) {
+    fprintf(stderr, "Error creating a thread.");
+    exit(1);
+  }
+  pthread_detach(thread);
+  for (size_t i = 0; i < batcher_count; ++i) {
+    if (pthread_create(&thread, NULL, serve_batcher, server) != 0) {
+      fprintf(stderr, "Error creating a thread.");
+      exit(1);
+    }
+    pthread_detach(thread);
+  }
+
+  server->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+  unlink(socket_path);
+  if ((server->listener == -1) || (bind(server->listener, (struct sockaddr *) &address, sizeof(address)) == -1) ||
+      (listen(server->listener, SOMAXCONN) == -1)) {
+    fprintf(stderr, "Error listening on %s.", socket_path);
+    exit(1);
+  }
+
+  printf("Serving on %s with %zu batcher(s). Send SIGHUP to reload the models.\n", socket_path, batcher_count);
+  fflush(stdout);
+
+  for (;;) {
+    int fd = accept(server->listener, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Error accepting a connection.\n");
+      continue;
+    }
+    Serve_Connection *connection = malloc(sizeof(*connection));
+    assert(connection != NULL);
+    connection->server = server;
+    connection->fd = fd;
+    if (pthread_create(&thread, NULL, serve_connection, connection) != 0) {
+      close(fd);
+      free(connection);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+int serve_client(char *socket_path, char *image_path, uint8_t model)
+{
+  uint8_t pixels[IMAGE_UNIT_LEN];
+  if (!pgm_read(image_path, pixels, IMAGE_WIDTH, IMAGE_HEIGHT)) {
+    fprintf(stderr, "Error reading the image.");
+    return 0;
+  }
+
+  int fd = serve_connect(socket_path);
+  if (fd == -1) {
+    fprintf(stderr, "Error connecting to %s.", socket_path);
+    return 0;
+  }
+
+  Serve_Request_Header request = {SERVE_FRAME_RAW, model, 0, IMAGE_UNIT_LEN};
+  Serve_Response_Header response;
+  float probabilities[DIGITS];
+  if (!serve_write_all(fd, &request, sizeof(request)) || !serve_write_all(fd, pixels, sizeof(pixels)) ||
+      !serve_read_all(fd, &response, sizeof(response)) || (response.status != SERVE_OK) ||
+      (response.count != DIGITS) || !serve_read_all(fd, probabilities, sizeof(probabilities))) {
+    fprintf(stderr, "The request failed.");
+    close(fd);
+    return 0;
+  }
+  close(fd);
+
+  nn_print_probabilities(probabilities);
+  return 1;
+}
+
+typedef struct {
+  char *socket_path;
+  size_t requests;
+  uint64_t *latencies;
+  int failed;
+} Serve_Loadgen;
+
+static uint64_t serve_now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void *serve_loadgen_worker(void *arg)
+{
+  Serve_Loadgen *worker = arg;
+  int fd = serve_connect(worker->socket_path);
+  if (fd == -1) {
+    worker->failed = 1;
+    return NULL;
+  }
+
+  uint8_t frame[sizeof(Serve_Request_Header) + IMAGE_UNIT_LEN];
+  Serve_Request_Header request = {SERVE_FRAME_RAW, 0, 0, IMAGE_UNIT_LEN};
+  memcpy(frame, &request, sizeof(request));
+  unsigned int seed = (unsigned int) (uintptr_t) worker;
+  for (size_t i = 0; i < IMAGE_UNIT_LEN; ++i) {
+    frame[sizeof(request) + i] = (rand_r(&seed) % 4) == 0 ? (uint8_t) rand_r(&seed) : 0;
+  }
+
+  Serve_Response_Header response;
+  float probabilities[DIGITS];
+  for (size_t r = 0; r < worker->requests; ++r) {
+    uint64_t start = serve_now_ns();
+    if (!serve_write_all(fd, frame, sizeof(frame)) || !serve_read_all(fd, &response, sizeof(response)) ||
+        (response.status != SERVE_OK) || !serve_read_all(fd, probabilities, sizeof(probabilities))) {
+      worker->failed = 1;
+      break;
+    }
+    worker->latencies[r] = serve_now_ns() - start;
+  }
+  close(fd);
+  return NULL;
+}
+
+static int serve_compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+int serve_loadgen(char *socket_path, size_t requests, size_t connections)
+{
+  size_t per_connection = requests / connections;
+  if (per_connection == 0) {
+    fprintf(stderr, "Fewer requests than connections.");
+    return 0;
+  }
+  size_t total = per_connection * connections;
+  uint64_t *latencies = malloc(sizeof(*latencies) * total);
+  assert(latencies != NULL);
+  Serve_Loadgen *workers = calloc(connections, sizeof(*workers));
+  pthread_t *threads = malloc(sizeof(*threads) * connections);
+  assert((workers != NULL) && (threads != NULL));
+
+  printf("Sending %zu requests over %zu connection(s)...\n", total, connections);
+  uint64_t start = serve_now_ns();
+  for (size_t c = 0; c < connections; ++c) {
+    workers[c].socket_path = socket_path;
+    workers[c].requests = per_connection;
+    workers[c].latencies = &latencies[c * per_connection];
+    if (pthread_create(&threads[c], NULL, serve_loadgen_worker, &workers[c]) != 0) {
+      fprintf(stderr, "Error creating a thread.");
+      return 0;
+    }
+  }
+  int failed = 0;
+  for (size_t c = 0; c < connections; ++c) {
+    pthread_join(threads[c], NULL);
+    failed |= workers[c].failed;
+  }
+  double seconds = (serve_now_ns() - start) / 1e9;
+  if (failed) {
+    fprintf(stderr, "Some requests failed.");
+    return 0;
+  }
+
+  qsort(latencies, total, sizeof(*latencies), serve_compare_u64);
+  printf("Throughput: %.0f requests/s\n", total / seconds);
+  printf("Latency: p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+         latencies[total * 50 / 100] / 1e3, latencies[total * 90 / 100] / 1e3, latencies[total * 99 / 100] / 1e3,
+         latencies[total * 999 / 1000] / 1e3, latencies[total - 1] / 1e3);
+
+  free(threads);
+  free(workers);
+  free(latencies);
+  return 1;
+}
+
+#endif // SERVE_IMPLEMENTATION
@@ -0,0 +1,568 @@
+#ifndef SNN_H_
+#define SNN_H_
+
+// A pruned NN for inference. The weights of a layer keep the NN layout, one row per input, cut in strips of
+// SNN_STRIP outputs, and each strip of a row has a mask of the weights left. Saved, only those weights are kept, packed
+// one after the other. Loaded, the strips of a row that still hold a weight are kept whole as blocks and the others
+// dropped, so a forward pass reads only the inputs of the blocks left, skips those that are zero like the sparse gemm
+// kernels, and runs the fp32 gather kernel over the rest. A layer with more blocks left than the crossover is expanded
+// back to fp32 rows, as looking the blocks up costs more there than skipping them saves.
+// SNN_DENSITY is that crossover, timed with -test on the 784x48x24x10 model pruned from 80 to 97 %: with 19 % of the
+// blocks of layer 0 left (95 % of the weights pruned) the sparse layout ran at 1.08x of fp32, with 24 % (93 %) at 0.96x
+// and with 33 % (90 %) at 0.93x, where the dense one is no slower.
+typedef struct {
+  size_t count;
+  size_t *widths;
+  size_t *strips;
+  uint64_t **masks;
+  float **values;
+  size_t *nonzeros;
+  uint32_t **rows;
+  size_t **starts;
+  float **kept;
+  float **dense;
+  float **bs;
+} SNN;
+
+// The weights pruned from an NN, as indices into its params.
+typedef struct {
+  size_t count;
+  uint32_t *indices;
+} SNN_Mask;
+
+#define SNN_STRIP 64
+#define SNN_DENSITY 0.2f
+
+void snn_init(void);
+SNN_Mask snn_prune(NN nn, Dataset calibration, float sparsity);
+void snn_mask_apply(void *context, NN nn, const Optimizer *optimizer);
+void snn_mask_free(SNN_Mask mask);
+SNN snn_from_nn(NN nn);
+void snn_free(SNN snn);
+size_t snn_bytes(SNN snn);
+void snn_print_layers(SNN snn);
+Matrix *snn_alloc_batch(SNN snn, size_t rows);
+void snn_free_batch(SNN snn, Matrix *batch);
+void snn_forward(SNN snn, Matrix *batch, size_t rows);
+NN_Model snn_model(const SNN *snn);
+SNN snn_load(char *save_path, char *filename);
+void snn_save(SNN snn, char *save_path, char *filename);
+
+#endif // SNN_H_
+
+#ifdef SNN_IMPLEMENTATION
+
+static float snn_density = SNN_DENSITY;
+
+// NN_SNN_DENSITY sets the fraction of blocks left below which a layer runs sparse, 0 keeping every layer dense.
+void snn_init(void)
+{
+  static int done = 0;
+  if (done) {
+    return;
+  }
+  gemm_init();
+  const char *density = getenv("NN_SNN_DENSITY");
+  if (density != NULL) {
+    snn_density = strtof(density, NULL);
+  }
+  done = 1;
+}
+
+typedef struct {
+  float score;
+  uint32_t index;
+} Snn_Score;
+
+static int snn_score_compare(const void *a, const void *b)
+{
+  const Snn_Score *x = a;
+  const Snn_Score *y = b;
+  if (x->score != y->score) {
+    return x->score < y->score ? -1 : 1;
+  }
+  return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+static int snn_index_compare(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = *(const uint32_t *) b;
+  return x < y ? -1 : (x > y);
+}
+
+// Zeroes the given fraction of the weights of nn, the biases being kept, and returns which. A weight is ranked by its
+// magnitude times the mean input it gets over the calibration images: the weights of the border pixels never move
+// from their random start, as those pixels are blank and give them no gradient, so their magnitude alone says
+// nothing. Every layer is ranked together, so the small last layers keep more of their weights.
+SNN_Mask snn_prune(NN nn, Dataset calibration, float sparsity)
+{
+  printf("Pruning %.1f %% of the weights on %zu images...\n", sparsity * MAX_PERCENT, calibration.count);
+  assert(calibration.image_len == NN_INPUT(nn).cols);
+  assert((sparsity >= 0.0f) && (sparsity < 1.0f));
+  assert(nn.param_count <= UINT32_MAX);
+
+  float **activity = malloc(sizeof(*activity) * nn.count);
+  assert(activity != NULL);
+  for (size_t l = 0; l < nn.count; ++l) {
+    activity[l] = calloc(nn.ws[l].rows, sizeof(*activity[l]));
+    assert(activity[l] != NULL);
+  }
+  NN batch = nn_alloc_activations(nn, EVALUATION_BATCH);
+  for (size_t start = 0; start < calibration.count; start += EVALUATION_BATCH) {
+    size_t count = calibration.count - start;
+    if (count > EVALUATION_BATCH) {
+      count = EVALUATION_BATCH;
+    }
+    NN view = nn_rows(batch, 0, count);
+    matrix_from_bytes(NN_INPUT(view), &calibration.images[start * calibration.image_len]);
+    nn_forward(view);
+    for (size_t l = 0; l < nn.count; ++l) {
+      for (size_t i = 0; i < count; ++i) {
+        for (size_t p = 0; p < nn.ws[l].rows; ++p) {
+          activity[l][p] += fabsf(MATRIX_AT(view.as[l], i, p));
+        }
+      }
+    }
+    free(view.as);
+  }
+  nn_free_activations(batch);
+
+  size_t total = 0;
+  for (size_t l = 0; l < nn.count; ++l) {
+    total += nn.ws[l].rows * nn.ws[l].cols;
+  }
+  Snn_Score *scores = malloc(sizeof(*scores) * total);
+  assert(scores != NULL);
+  size_t next = 0;
+  for (size_t l = 0; l < nn.count; ++l) {
+    for (size_t p = 0; p < nn.ws[l].rows; ++p) {
+      for (size_t j = 0; j < nn.ws[l].cols; ++j) {
+        float *w = &MATRIX_AT(nn.ws[l], p, j);
+        scores[next++] = (Snn_Score) {fabsf(*w) * activity[l][p], w - nn.params};
+      }
+    }
+  }
+  qsort(scores, total, sizeof(*scores), snn_score_compare);
+
+  SNN_Mask mask;
+  mask.count = lrintf(sparsity * total);
+  mask.indices = malloc(sizeof(*mask.indices) * (mask.count > 0 ? mask.count : 1));
+  assert(mask.indices != NULL);
+  for (size_t i = 0; i < mask.count; ++i) {
+    mask.indices[i] = scores[i].index;
+  }
+  qsort(mask.indices, mask.count, sizeof(*mask.indices), snn_index_compare);
+  snn_mask_apply(&mask, nn, NULL);
+
+  for (size_t l = 0; l < nn.count; ++l) {
+    size_t kept = 0;
+    for (size_t i = 0; i < nn.ws[l].rows * nn.ws[l].cols; ++i) {
+      kept += nn.ws[l].items[i] != 0.0f;
+    }
+    printf("Layer %zu: %zu of %zu weights kept.\n", l, kept, nn.ws[l].rows * nn.ws[l].cols);
+    free(activity[l]);
+  }
+  free(activity);
+  free(scores);
+
+  printf("The model has been pruned.\n");
+  return mask;
+}
+
+// An on_step hook that keeps the pruned weights at zero while the rest is fine tuned.
+void snn_mask_apply(void *context, NN nn, const Optimizer *optimizer)
+{
+  (void) optimizer;
+  const SNN_Mask *mask = context;
+  for (size_t i = 0; i < mask->count; ++i) {
+    nn.params[mask->indices[i]] = 0.0f;
+  }
+}
+
+void snn_mask_free(SNN_Mask mask)
+{
+  free(mask.indices);
+}
+
+static SNN snn_alloc(size_t *widths, size_t layer_count)
+{
+  SNN snn;
+  memset(&snn, 0, sizeof(snn));
+  snn.count = layer_count - 1;
+  snn.widths = malloc(sizeof(*snn.widths) * layer_count);
+  assert(snn.widths != NULL);
+  snn.strips = malloc(sizeof(*snn.strips) * snn.count);
+  assert(snn.strips != NULL);
+  snn.masks = malloc(sizeof(*snn.masks) * snn.count);
+  assert(snn.masks != NULL);
+  snn.values = malloc(sizeof(*snn.values) * snn.count);
+  assert(snn.values != NULL);
+  snn.nonzeros = malloc(sizeof(*snn.nonzeros) * snn.count);
+  assert(snn.nonzeros != NULL);
+  snn.rows = malloc(sizeof(*snn.rows) * snn.count);
+  assert(snn.rows != NULL);
+  snn.starts = malloc(sizeof(*snn.starts) * snn.count);
+  assert(snn.starts != NULL);
+  snn.kept = malloc(sizeof(*snn.kept) * snn.count);
+  assert(snn.kept != NULL);
+  snn.dense = malloc(sizeof(*snn.dense) * snn.count);
+  assert(snn.dense != NULL);
+  snn.bs = malloc(sizeof(*snn.bs) * snn.count);
+  assert(snn.bs != NULL);
+  for (size_t l = 0; l < layer_count; ++l) {
+    snn.widths[l] = widths[l];
+  }
+  for (size_t l = 0; l < snn.count; ++l) {
+    snn.strips[l] = (widths[l+1] + SNN_STRIP - 1) / SNN_STRIP;
+    snn.masks[l] = calloc(widths[l] * snn.strips[l], sizeof(*snn.masks[l]));
+    assert(snn.masks[l] != NULL);
+    snn.bs[l] = malloc(sizeof(*snn.bs[l]) * widths[l+1]);
+    assert(snn.bs[l] != NULL);
+    snn.values[l] = NULL;
+    snn.nonzeros[l] = 0;
+    snn.rows[l] = NULL;
+    snn.starts[l] = NULL;
+    snn.kept[l] = NULL;
+    snn.dense[l] = NULL;
+  }
+  return snn;
+}
+
+// Lays out the packed weights of layer l for the forward pass, as dense rows or as blocks. The blocks are SNN_STRIP
+// floats each, those of strip s being blocks starts[s] to starts[s + 1] - 1, and block i belongs to row rows[i].
+static void snn_layout(SNN snn, size_t l)
+{
+  size_t k = snn.widths[l];
+  size_t n = snn.widths[l+1];
+  size_t strips = snn.strips[l];
+  const uint64_t *masks = snn.masks[l];
+  size_t kept_count = 0;
+  for (size_t i = 0; i < k * strips; ++i) {
+    kept_count += masks[i] != 0;
+  }
+
+  if ((kept_count > 0) && (kept_count >= snn_density * k * strips)) {
+    snn.dense[l] = calloc(k * n, sizeof(*snn.dense[l]));
+    assert(snn.dense[l] != NULL);
+    const float *wp = snn.values[l];
+    for (size_t p = 0; p < k; ++p) {
+      for (size_t s = 0; s < strips; ++s) {
+        for (uint64_t mask = masks[p * strips + s]; mask != 0; mask &= mask - 1) {
+          snn.dense[l][p * n + s * SNN_STRIP + __builtin_ctzll(mask)] = *wp++;
+        }
+      }
+    }
+    return;
+  }
+
+  // Where the packed weights of each strip of each row start.
+  size_t *offsets = malloc(sizeof(*offsets) * (k * strips + 1));
+  assert(offsets != NULL);
+  offsets[0] = 0;
+  for (size_t i = 0; i < k * strips; ++i) {
+    offsets[i + 1] = offsets[i] + __builtin_popcountll(masks[i]);
+  }
+  snn.rows[l] = malloc(sizeof(*snn.rows[l]) * (kept_count + 1));
+  assert(snn.rows[l] != NULL);
+  snn.starts[l] = malloc(sizeof(*snn.starts[l]) * (strips + 1));
+  assert(snn.starts[l] != NULL);
+  snn.kept[l] = calloc(kept_count * SNN_STRIP + 1, sizeof(*snn.kept[l]));
+  assert(snn.kept[l] != NULL);
+  size_t next = 0;
+  for (size_t s = 0; s < strips; ++s) {
+    snn.starts[l][s] = next;
+    for (size_t p = 0; p < k; ++p) {
+      uint64_t mask = masks[p * strips + s];
+      if (mask == 0) {
+        continue;
+      }
+      const float *wp = snn.values[l] + offsets[p * strips + s];
+      for (; mask != 0; mask &= mask - 1) {
+        snn.kept[l][next * SNN_STRIP + __builtin_ctzll(mask)] = *wp++;
+      }
+      snn.rows[l][next++] = p;
+    }
+  }
+  snn.starts[l][strips] = next;
+  free(offsets);
+}
+
+// Keeps the weights of nn that are not zero.
+SNN snn_from_nn(NN nn)
+{
+  snn_init();
+  size_t *widths = malloc(sizeof(*widths) * (nn.count + 1));
+  assert(widths != NULL);
+  widths[0] = nn.ws[0].rows;
+  for (size_t l = 0; l < nn.count; ++l) {
+    widths[l+1] = nn.ws[l].cols;
+  }
+  SNN snn = snn_alloc(widths, nn.count + 1);
+  free(widths);
+
+  for (size_t l = 0; l < snn.count; ++l) {
+    size_t k = snn.widths[l];
+    size_t n = snn.widths[l+1];
+    size_t strips = snn.strips[l];
+    snn.values[l] = malloc(sizeof(*snn.values[l]) * (k * n + 1));
+    assert(snn.values[l] != NULL);
+    for (size_t p = 0; p < k; ++p) {
+      for (size_t j = 0; j < n; ++j) {
+        float w = MATRIX_AT(nn.ws[l], p, j);
+        if (w != 0.0f) {
+          snn.masks[l][p * strips + j / SNN_STRIP] |= 1ULL << (j % SNN_STRIP);
+          snn.values[l][snn.nonzeros[l]++] = w;
+        }
+      }
+    }
+    snn_layout(snn, l);
+    memcpy(snn.bs[l], nn.bs[l].items, sizeof(*snn.bs[l]) * n);
+  }
+  return snn;
+}
+
+void snn_free(SNN snn)
+{
+  for (size_t l = 0; l < snn.count; ++l) {
+    free(snn.masks[l]);
+    free(snn.values[l]);
+    free(snn.rows[l]);
+    free(snn.starts[l]);
+    free(snn.kept[l]);
+    free(snn.dense[l]);
+    free(snn.bs[l]);
+  }
+  free(snn.masks);
+  free(snn.values);
+  free(snn.nonzeros);
+  free(snn.rows);
+  free(snn.starts);
+  free(snn.kept);
+  free(snn.dense);
+  free(snn.bs);
+  free(snn.strips);
+  free(snn.widths);
+}
+
+// The bytes of parameters a forward pass reads: the dense rows of the dense layers, the rows and the blocks of the
+// others, and the biases.
+size_t snn_bytes(SNN snn)
+{
+  size_t bytes = 0;
+  for (size_t l = 0; l < snn.count; ++l) {
+    size_t k = snn.widths[l];
+    size_t n = snn.widths[l+1];
+    if (snn.dense[l] != NULL) {
+      bytes += k * n * sizeof(float);
+    } else {
+      size_t kept_count = snn.starts[l][snn.strips[l]];
+      bytes += kept_count * (sizeof(uint32_t) + SNN_STRIP * sizeof(float));
+    }
+    bytes += n * sizeof(float);
+  }
+  return bytes;
+}
+
+void snn_print_layers(SNN snn)
+{
+  for (size_t l = 0; l < snn.count; ++l) {
+    size_t weights = snn.widths[l] * snn.widths[l+1];
+    size_t blocks = snn.widths[l] * snn.strips[l];
+    size_t kept_count = 0;
+    for (size_t i = 0; i < blocks; ++i) {
+      kept_count += snn.masks[l][i] != 0;
+    }
+    printf("Layer %zu: %zu of %zu weights (%.1f %%), %zu of %zu blocks (%.1f %%), %s.\n", l, snn.nonzeros[l],
+           weights, (float) snn.nonzeros[l] * MAX_PERCENT / weights, kept_count, blocks,
+           (float) kept_count * MAX_PERCENT / blocks, snn.dense[l] != NULL ? "dense" : "sparse");
+  }
+}
+
+// The activations of every layer, as[0] being the input.
+Matrix *snn_alloc_batch(SNN snn, size_t rows)
+{
+  Matrix *batch = malloc(sizeof(*batch) * (snn.count + 1));
+  assert(batch != NULL);
+  for (size_t l = 0; l <= snn.count; ++l) {
+    batch[l] = matrix_alloc(rows, snn.widths[l]);
+  }
+  return batch;
+}
+
+void snn_free_batch(SNN snn, Matrix *batch)
+{
+  for (size_t l = 0; l <= snn.count; ++l) {
+    free(batch[l].items);
+  }
+  free(batch);
+}
+
+// Forwards the first rows of batch[0]; the last layer is left as logits. Dense layers run like in nn_forward. In a
+// sparse one, for each strip only the inputs of the rows that kept a block are read, those that are zero dropped
+// without a branch as it would be mispredicted about as often as taken, and the others gathered with their blocks.
+void snn_forward(SNN snn, Matrix *batch, size_t rows)
+{
+  static __thread float *live_values = NULL;
+  static __thread uint32_t *live_columns = NULL;
+  static __thread size_t cap = 0;
+  assert(rows <= batch[0].rows);
+  for (size_t l = 0; l < snn.count; ++l) {
+    size_t k = snn.widths[l];
+    size_t n = snn.widths[l+1];
+    if (k > cap) {
+      free(live_values);
+      free(live_columns);
+      live_values = malloc(sizeof(*live_values) * k);
+      assert(live_values != NULL);
+      live_columns = malloc(sizeof(*live_columns) * k);
+      assert(live_columns != NULL);
+      cap = k;
+    }
+    int activation = (l + 1) < snn.count ? GEMM_SIGMOID : GEMM_LINEAR;
+    if (snn.dense[l] != NULL) {
+      const float *a = batch[l].items;
+      float *c = batch[l+1].items;
+      if ((l > 0) || !gemm_sparse(rows, n, k, a, k, snn.dense[l], n, c, n, snn.bs[l], activation)) {
+        gemm_fused(rows, n, k, a, k, 1, snn.dense[l], n, c, n, snn.bs[l], activation);
+      }
+      continue;
+    }
+    size_t strips = snn.strips[l];
+    for (size_t i = 0; i < rows; ++i) {
+      const float *a = &MATRIX_AT(batch[l], i, 0);
+      float *c = &MATRIX_AT(batch[l+1], i, 0);
+      for (size_t s = 0; s < strips; ++s) {
+        size_t live = 0;
+        for (size_t q = snn.starts[l][s]; q < snn.starts[l][s + 1]; ++q) {
+          float x = a[snn.rows[l][q]];
+          live_values[live] = x;
+          live_columns[live] = q;
+          live += x != 0;
+        }
+        size_t j = s * SNN_STRIP;
+        gemm_gather_kernel(n - j < SNN_STRIP ? n - j : SNN_STRIP, live_values, live_columns, live, snn.kept[l],
+                           SNN_STRIP, c + j, snn.bs[l] + j, activation);
+      }
+    }
+  }
+}
+
+static void *snn_model_alloc_batch(const void *model, size_t rows)
+{
+  return snn_alloc_batch(*(const SNN *) model, rows);
+}
+
+static void snn_model_free_batch(const void *model, void *batch)
+{
+  snn_free_batch(*(const SNN *) model, batch);
+}
+
+static Matrix snn_model_forward(const void *model, void *batch, const uint8_t *images, size_t count)
+{
+  const SNN *snn = model;
+  Matrix *matrices = batch;
+  matrix_from_bytes(matrix_rows(matrices[0], 0, count), images);
+  snn_forward(*snn, matrices, count);
+  return matrix_rows(matrices[snn->count], 0, count);
+}
+
+// The FLOPs per image count every weight left, as if no input were zero.
+NN_Model snn_model(const SNN *snn)
+{
+  NN_Model model = {snn, "sparse", gemm_kernel_name(), snn->widths[0], snn->widths[snn->count], snn_bytes(*snn), 0, 0,
+                    snn_model_alloc_batch, snn_model_free_batch, snn_model_forward};
+  for (size_t l = 0; l < snn->count; ++l) {
+    model.flops += 2 * snn->nonzeros[l];
+  }
+  return model;
+}
+
+// Tensors per layer: the strip masks, the packed weights and the biases. The model is copied out of the file, as
+// every layer is laid out again anyway.
+SNN snn_load(char *save_path, char *filename)
+{
+  NN_Model_File file = nn_model_open(save_path, filename, 1u << NN_DTYPE_SPARSE, 3, 0);
+  NN_Model_Header header = file.header;
+  const NN_Model_Tensor *tensors = file.tensors;
+  uint8_t *map = file.map;
+  snn_init();
+  SNN snn = snn_alloc(file.widths, header.layer_count);
+  free(file.widths);
+
+  for (size_t l = 0; l < snn.count; ++l) {
+    const NN_Model_Tensor *t = &tensors[3 * l];
+    size_t k = snn.widths[l];
+    size_t n = snn.widths[l+1];
+    size_t strips = snn.strips[l];
+    if (!nn_model_tensor_check(header, &t[0], NN_DTYPE_U64, k, strips, sizeof(uint64_t)) ||
+        !nn_model_tensor_check(header, &t[1], NN_DTYPE_F32, 1, t[1].cols, sizeof(float)) ||
+        !nn_model_tensor_check(header, &t[2], NN_DTYPE_F32, 1, n, sizeof(float))) {
+      fprintf(stderr, "Invalid model tensor.");
+      exit(1);
+    }
+    memcpy(snn.masks[l], map + t[0].offset, t[0].size);
+    // The masks must not reach past the last output, and must hold as many weights as there are.
+    uint64_t tail = (n % SNN_STRIP) != 0 ? ~0ULL << (n % SNN_STRIP) : 0;
+    size_t nonzeros = 0;
+    int overflow = 0;
+    for (size_t p = 0; p < k; ++p) {
+      for (size_t s = 0; s < strips; ++s) {
+        nonzeros += __builtin_popcountll(snn.masks[l][p * strips + s]);
+      }
+      overflow |= (snn.masks[l][p * strips + strips - 1] & tail) != 0;
+    }
+    if (overflow || (nonzeros != t[1].cols)) {
+      fprintf(stderr, "Invalid model tensor.");
+      exit(1);
+    }
+    snn.values[l] = malloc(sizeof(*snn.values[l]) * (nonzeros + 1));
+    assert(snn.values[l] != NULL);
+    memcpy(snn.values[l], map + t[1].offset, t[1].size);
+    snn.nonzeros[l] = nonzeros;
+    snn_layout(snn, l);
+    memcpy(snn.bs[l], map + t[2].offset, t[2].size);
+  }
+  munmap(map, file.map_len);
+  return snn;
+}
+
+void snn_save(SNN snn, char *save_path, char *filename)
+{
+  printf("Saving the model...\n");
+
+  char fullname[MAX_FILEPATH_LEN];
+  snprintf(fullname, sizeof(fullname), "%s%s", save_path, filename);
+
+  uint32_t *arch = malloc(sizeof(*arch) * (snn.count + 1));
+  assert(arch != NULL);
+  for (size_t l = 0; l <= snn.count; ++l) {
+    arch[l] = snn.widths[l];
+  }
+
+  size_t tensor_count = 3 * snn.count;
+  NN_Model_Tensor *tensors = calloc(tensor_count, sizeof(*tensors));
+  assert(tensors != NULL);
+  const void **data = malloc(sizeof(*data) * tensor_count);
+  assert(data != NULL);
+  for (size_t l = 0; l < snn.count; ++l) {
+    NN_Model_Tensor *t = &tensors[3 * l];
+    size_t k = snn.widths[l];
+    size_t n = snn.widths[l+1];
+    size_t strips = snn.strips[l];
+    t[0] = (NN_Model_Tensor) {NN_DTYPE_U64, k, strips, 0, 0, k * strips * sizeof(uint64_t)};
+    t[1] = (NN_Model_Tensor) {NN_DTYPE_F32, 1, snn.nonzeros[l], 0, 0, snn.nonzeros[l] * sizeof(float)};
+    t[2] = (NN_Model_Tensor) {NN_DTYPE_F32, 1, n, 0, 0, n * sizeof(float)};
+    data[3 * l] = snn.masks[l];
+    data[3 * l + 1] = snn.values[l];
+    data[3 * l + 2] = snn.bs[l];
+  }
+  nn_model_write(fullname, NN_DTYPE_SPARSE, arch, snn.count + 1, tensors, data, tensor_count);
+
+  free(data);
+  free(tensors);
+  free(arch);
+  printf("The model has been saved as %s.\n", filename);
+}
+
+#endif // SNN_IMPLEMENTATION
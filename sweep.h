@@ -0,0 +1,541 @@
+#ifndef SWEEP_H_
+#define SWEEP_H_
+
+// Hyperparameter sweeps: many trainings run concurrently in one process, sharing the training and test sets mapped
+// once. The config file has one "key value value ..." line per hyperparameter, # starting a comment; every
+// combination of the values is a run unless samples picks some of them at random:
+//
+//   hidden 48,24 128,64 256   hidden layer widths of each architecture
+//   optimizer sgd adam
+//   lr 0.03 0.1               the optimizer's default when missing
+//   schedule constant cosine
+//   epochs 30
+//   warmup 0
+//   seed 1 2                  weight initialization and shuffling
+//   samples 20                number of random combinations to train, 0 for all of them
+//   target 0.97               test accuracy whose time to reach is reported
+//   abandon 0.9               a run below this fraction of the best accuracy after as many epochs stops, 0 never
+//   grace 2                   epochs before a run can be abandoned
+//   eval-every 1              epochs between test evaluations
+#define SWEEP_ABANDON 0.9f
+#define SWEEP_GRACE 2
+#define SWEEP_LINE_LEN 1024
+#define SWEEP_MAX_CONFIGS 4096
+#define SWEEP_MAX_LAYERS 8
+#define SWEEP_MAX_VALUES 32
+#define SWEEP_TARGET 0.95f
+
+typedef struct {
+  size_t arch[SWEEP_MAX_LAYERS + 2];
+  size_t arch_count;
+  int optimizer;
+  int schedule;
+  float learning_rate;
+  size_t epochs;
+  size_t warmup;
+  uint64_t seed;
+} Sweep_Config;
+
+// accuracy is the test accuracy at the last evaluation, target_seconds the training time until an evaluation first
+// reached the target, -1 if none did.
+typedef struct {
+  Sweep_Config config;
+  float accuracy;
+  size_t epochs;
+  double seconds;
+  double target_seconds;
+  int abandoned;
+} Sweep_Result;
+
+void sweep_run(char *config_path, size_t threads);
+
+#endif // SWEEP_H_
+
+#ifdef SWEEP_IMPLEMENTATION
+
+typedef struct {
+  size_t hidden[SWEEP_MAX_VALUES][SWEEP_MAX_LAYERS];
+  size_t hidden_lens[SWEEP_MAX_VALUES];
+  size_t hidden_count;
+  int optimizers[SWEEP_MAX_VALUES];
+  size_t optimizer_count;
+  float learning_rates[SWEEP_MAX_VALUES];
+  size_t learning_rate_count;
+  int schedules[SWEEP_MAX_VALUES];
+  size_t schedule_count;
+  size_t epochs[SWEEP_MAX_VALUES];
+  size_t epochs_count;
+  size_t warmups[SWEEP_MAX_VALUES];
+  size_t warmup_count;
+  uint64_t seeds[SWEEP_MAX_VALUES];
+  size_t seed_count;
+  size_t samples;
+  float target;
+  float abandon;
+  size_t grace;
+  size_t eval_every;
+} Sweep_Grid;
+
+typedef struct {
+  Sweep_Result *results;
+  size_t count;
+  size_t next;
+  size_t finished;
+  size_t run_threads;
+  Dataset training;
+  Dataset test;
+  float target;
+  float abandon;
+  size_t grace;
+  size_t eval_every;
+  // The best test accuracy any run had after each number of epochs, the bar for abandoning the others.
+  float *best_at;
+  NN best;
+  float best_accuracy;
+  size_t best_index;
+  pthread_mutex_t mutex;
+} Sweep;
+
+typedef struct {
+  Sweep *sweep;
+  Sweep_Result *result;
+  NN_Evaluator evaluator;
+  double start;
+} Sweep_Run;
+
+static void sweep_invalid(char *path, size_t line_number, const char *key)
+{
+  fprintf(stderr, "Invalid %s in %s line %zu.", key, path, line_number);
+  exit(1);
+}
+
+// Parses one value of key into the grid, returns 0 when it is not valid or the key has too many values.
+static int sweep_parse_value(Sweep_Grid *grid, const char *key, char *value)
+{
+  const char *lists[] = {"hidden", "optimizer", "lr", "schedule", "epochs", "warmup", "seed"};
+  size_t counts[] = {grid->hidden_count, grid->optimizer_count, grid->learning_rate_count, grid->schedule_count,
+                     grid->epochs_count, grid->warmup_count, grid->seed_count};
+  for (size_t c = 0; c < ARRAY_LEN(lists); ++c) {
+    if ((strcmp(key, lists[c]) == 0) && (counts[c] == SWEEP_MAX_VALUES)) {
+      return 0;
+    }
+  }
+
+  char *end;
+  if (strcmp(key, "hidden") == 0) {
+    size_t *widths = grid->hidden[grid->hidden_count];
+    size_t len = 0;
+    for (char *width = value; len < SWEEP_MAX_LAYERS; width = end + 1) {
+      widths[len] = strtoul(width, &end, 10);
+      if ((end == width) || (widths[len] == 0) || ((*end != ',') && (*end != '\0'))) {
+        return 0;
+      }
+      len += 1;
+      if (*end == '\0') {
+        grid->hidden_lens[grid->hidden_count++] = len;
+        return 1;
+      }
+    }
+    return 0;
+  } else if (strcmp(key, "optimizer") == 0) {
+    grid->optimizers[grid->optimizer_count] = optim_parse(value, optim_kinds, ARRAY_LEN(optim_kinds));
+    return grid->optimizers[grid->optimizer_count++] != -1;
+  } else if (strcmp(key, "lr") == 0) {
+    grid->learning_rates[grid->learning_rate_count] = strtof(value, &end);
+    return (*end == '\0') && (grid->learning_rates[grid->learning_rate_count++] > 0.0f);
+  } else if (strcmp(key, "schedule") == 0) {
+    grid->schedules[grid->schedule_count] = optim_parse(value, optim_schedules, ARRAY_LEN(optim_schedules));
+    return grid->schedules[grid->schedule_count++] != -1;
+  } else if (strcmp(key, "epochs") == 0) {
+    grid->epochs[grid->epochs_count] = strtoul(value, &end, 10);
+    return (*end == '\0') && (grid->epochs[grid->epochs_count++] > 0);
+  } else if (strcmp(key, "warmup") == 0) {
+    grid->warmups[grid->warmup_count++] = strtoul(value, &end, 10);
+    return *end == '\0';
+  } else if (strcmp(key, "seed") == 0) {
+    grid->seeds[grid->seed_count++] = strtoull(value, &end, 10);
+    return *end == '\0';
+  } else if (strcmp(key, "samples") == 0) {
+    grid->samples = strtoul(value, &end, 10);
+    return *end == '\0';
+  } else if (strcmp(key, "target") == 0) {
+    grid->target = strtof(value, &end);
+    return (*end == '\0') && (grid->target > 0.0f) && (grid->target <= 1.0f);
+  } else if (strcmp(key, "abandon") == 0) {
+    grid->abandon = strtof(value, &end);
+    return (*end == '\0') && (grid->abandon >= 0.0f) && (grid->abandon <= 1.0f);
+  } else if (strcmp(key, "grace") == 0) {
+    grid->grace = strtoul(value, &end, 10);
+    return *end == '\0';
+  } else if (strcmp(key, "eval-every") == 0) {
+    grid->eval_every = strtoul(value, &end, 10);
+    return (*end == '\0') && (grid->eval_every > 0);
+  }
+  return 0;
+}
+
+static void sweep_parse(char *path, Sweep_Grid *grid)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Error opening %s.", path);
+    exit(1);
+  }
+  memset(grid, 0, sizeof(*grid));
+  grid->target = SWEEP_TARGET;
+  grid->abandon = SWEEP_ABANDON;
+  grid->grace = SWEEP_GRACE;
+  grid->eval_every = 1;
+
+  char line[SWEEP_LINE_LEN];
+  for (size_t line_number = 1; fgets(line, sizeof(line), file) != NULL; ++line_number) {
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    char *save;
+    char *key = strtok_r(line, " \t\r\n", &save);
+    if (key == NULL) {
+      continue;
+    }
+    size_t values = 0;
+    for (char *value = strtok_r(NULL, " \t\r\n", &save); value != NULL; value = strtok_r(NULL, " \t\r\n", &save)) {
+      if (!sweep_parse_value(grid, key, value)) {
+        sweep_invalid(path, line_number, key);
+      }
+      values += 1;
+    }
+    if (values == 0) {
+      sweep_invalid(path, line_number, key);
+    }
+  }
+  fclose(file);
+
+  size_t default_hidden[] = {HIDDEN_LAYERS};
+  if (grid->hidden_count == 0) {
+    memcpy(grid->hidden[0], default_hidden, sizeof(default_hidden));
+    grid->hidden_lens[grid->hidden_count++] = ARRAY_LEN(default_hidden);
+  }
+  if (grid->optimizer_count == 0) {
+    grid->optimizers[grid->optimizer_count++] = OPTIM_SGD;
+  }
+  if (grid->schedule_count == 0) {
+    grid->schedules[grid->schedule_count++] = OPTIM_CONSTANT;
+  }
+  if (grid->epochs_count == 0) {
+    grid->epochs[grid->epochs_count++] = EPOCHS;
+  }
+  if (grid->warmup_count == 0) {
+    grid->warmups[grid->warmup_count++] = 0;
+  }
+  if (grid->seed_count == 0) {
+    grid->seeds[grid->seed_count++] = 1;
+  }
+}
+
+// The index-th combination of the grid, counting through the hidden widths fastest.
+static Sweep_Config sweep_config(const Sweep_Grid *grid, size_t index)
+{
+  Sweep_Config config;
+  memset(&config, 0, sizeof(config));
+  size_t hidden = index % grid->hidden_count;
+  index /= grid->hidden_count;
+  config.optimizer = grid->optimizers[index % grid->optimizer_count];
+  index /= grid->optimizer_count;
+  size_t learning_rate_count = grid->learning_rate_count > 0 ? grid->learning_rate_count : 1;
+  if (grid->learning_rate_count > 0) {
+    config.learning_rate = grid->learning_rates[index % learning_rate_count];
+  } else {
+    config.learning_rate = config.optimizer == OPTIM_ADAM ? ADAM_LEARNING_RATE : LEARNING_RATE;
+  }
+  index /= learning_rate_count;
+  config.schedule = grid->schedules[index % grid->schedule_count];
+  index /= grid->schedule_count;
+  config.epochs = grid->epochs[index % grid->epochs_count];
+  index /= grid->epochs_count;
+  config.warmup = grid->warmups[index % grid->warmup_count];
+  index /= grid->warmup_count;
+  config.seed = grid->seeds[index % grid->seed_count];
+
+  config.arch[config.arch_count++] = IMAGE_UNIT_LEN;
+  for (size_t l = 0; l < grid->hidden_lens[hidden]; ++l) {
+    config.arch[config.arch_count++] = grid->hidden[hidden][l];
+  }
+  config.arch[config.arch_count++] = DIGITS;
+  return config;
+}
+
+// Lists the runs of the grid: all combinations, or grid->samples distinct ones drawn with the first seed.
+static Sweep_Result *sweep_expand(const Sweep_Grid *grid, size_t *count)
+{
+  size_t learning_rate_count = grid->learning_rate_count > 0 ? grid->learning_rate_count : 1;
+  size_t counts[] = {grid->hidden_count, grid->optimizer_count, learning_rate_count, grid->schedule_count,
+                     grid->epochs_count, grid->warmup_count, grid->seed_count};
+  size_t total = 1;
+  for (size_t c = 0; c < ARRAY_LEN(counts); ++c) {
+    if (total > SIZE_MAX / SWEEP_MAX_VALUES) {
+      total = SIZE_MAX;
+      break;
+    }
+    total *= counts[c];
+  }
+  *count = (grid->samples > 0) && (grid->samples < total) ? grid->samples : total;
+  if (*count > SWEEP_MAX_CONFIGS) {
+    fprintf(stderr, "The sweep has %zu runs, more than %d; use samples.", *count, SWEEP_MAX_CONFIGS);
+    exit(1);
+  }
+
+  size_t *indices = malloc(sizeof(*indices) * *count);
+  assert(indices != NULL);
+  uint64_t state = grid->seeds[0];
+  for (size_t r = 0; r < *count; ++r) {
+    indices[r] = r;
+    while (*count < total) {
+      indices[r] = nn_splitmix64(&state) % total;
+      size_t other = 0;
+      while ((other < r) && (indices[other] != indices[r])) {
+        other += 1;
+      }
+      if (other == r) {
+        break;
+      }
+    }
+  }
+
+  Sweep_Result *results = calloc(*count, sizeof(*results));
+  assert(results != NULL);
+  for (size_t r = 0; r < *count; ++r) {
+    results[r].config = sweep_config(grid, indices[r]);
+    results[r].target_seconds = -1;
+  }
+  free(indices);
+  return results;
+}
+
+static void sweep_format_config(char *buf, size_t len, const Sweep_Config *config)
+{
+  size_t n = 0;
+  for (size_t l = 1; (l + 1 < config->arch_count) && (n < len); ++l) {
+    n += snprintf(buf + n, len - n, l > 1 ? ",%zu" : "%zu", config->arch[l]);
+  }
+  if (n < len) {
+    snprintf(buf + n, len - n, " %s lr %g %s epochs %zu warmup %zu seed %llu", optim_kinds[config->optimizer],
+             config->learning_rate, optim_schedules[config->schedule], config->epochs, config->warmup,
+             (unsigned long long) config->seed);
+  }
+}
+
+// Evaluates the run on the test set every eval_every epochs and after the last one, and stops it when it is too far
+// behind the best run at the same epoch.
+static int sweep_epoch(void *context, NN nn, size_t epoch)
+{
+  (void) nn;
+  Sweep_Run *run = context;
+  Sweep *sweep = run->sweep;
+  Sweep_Result *result = run->result;
+  result->epochs = epoch + 1;
+  int last = (epoch + 1) == result->config.epochs;
+  if (!last && (((epoch + 1) % sweep->eval_every) != 0)) {
+    return 1;
+  }
+
+  NN_Evaluation evaluation;
+  nn_evaluate(&run->evaluator, sweep->test, &evaluation);
+  result->accuracy = (float) evaluation.correct / evaluation.count;
+  result->seconds = prof_now() - run->start;
+  if ((result->target_seconds < 0) && (result->accuracy >= sweep->target)) {
+    result->target_seconds = result->seconds;
+  }
+
+  pthread_mutex_lock(&sweep->mutex);
+  float best = sweep->best_at[epoch];
+  if (result->accuracy > best) {
+    sweep->best_at[epoch] = result->accuracy;
+  }
+  pthread_mutex_unlock(&sweep->mutex);
+  if (!last && ((epoch + 1) >= sweep->grace) && (result->accuracy < sweep->abandon * best)) {
+    result->abandoned = 1;
+    return 0;
+  }
+  return 1;
+}
+
+static void *sweep_worker(void *arg)
+{
+  Sweep *sweep = arg;
+  // One pool serves every run of this worker, as the thread-local scratch buffers of the kernels are lost, not freed,
+  // when a pool thread exits.
+  Pool *pool = pool_create(sweep->run_threads);
+  for (;;) {
+    size_t index = __atomic_fetch_add(&sweep->next, 1, __ATOMIC_RELAXED);
+    if (index >= sweep->count) {
+      pool_destroy(pool);
+      return NULL;
+    }
+    Sweep_Result *result = &sweep->results[index];
+    Sweep_Config *config = &result->config;
+
+    NN nn = nn_alloc(config->arch, config->arch_count);
+    nn_rng_seed(config->seed);
+    nn_init(nn);
+    NN gradient = nn_alloc_batch(config->arch, config->arch_count, TRAINING_BATCH);
+    Optimizer optimizer = optim_alloc(config->optimizer, config->schedule, config->learning_rate, config->epochs,
+                                      config->warmup, nn.param_count, sweep->training.count / TRAINING_BATCH);
+    Sweep_Run run = {sweep, result, nn_evaluator_alloc(nn_model(&nn), pool), prof_now()};
+    NN_Train_Hook hook = {sweep_epoch, NULL, &run};
+    nn_train(nn, gradient, pool, sweep->training, &optimizer, &hook, 1);
+    nn_evaluator_free(run.evaluator);
+    optim_free(optimizer);
+    nn_free(gradient);
+
+    char config_string[SWEEP_LINE_LEN];
+    sweep_format_config(config_string, sizeof(config_string), config);
+    prof_emit("\"sweep_run\",\"config\":%s,\"accuracy\":%.6f,\"epochs\":%zu,\"seconds\":%.6f,"
+              "\"target_seconds\":%.6f,\"abandoned\":%d", prof_quote(config_string), result->accuracy,
+              result->epochs, result->seconds, result->target_seconds, result->abandoned);
+
+    pthread_mutex_lock(&sweep->mutex);
+    sweep->finished += 1;
+    printf("[%zu/%zu] %s: %.2f %% after %zu epochs in %.1f s%s\n", sweep->finished, sweep->count, config_string,
+           result->accuracy * MAX_PERCENT, result->epochs, result->seconds, result->abandoned ? " (abandoned)" : "");
+    if (!result->abandoned && ((sweep->best.params == NULL) || (result->accuracy > sweep->best_accuracy))) {
+      if (sweep->best.params != NULL) {
+        nn_free(sweep->best);
+      }
+      sweep->best = nn;
+      sweep->best_accuracy = result->accuracy;
+      sweep->best_index = index;
+    } else {
+      nn_free(nn);
+    }
+    pthread_mutex_unlock(&sweep->mutex);
+  }
+}
+
+// Finished runs first, then by accuracy, then by the time to the target.
+static int sweep_compare(const void *a, const void *b)
+{
+  const Sweep_Result *x = a;
+  const Sweep_Result *y = b;
+  if (x->abandoned != y->abandoned) {
+    return x->abandoned - y->abandoned;
+  }
+  if (x->accuracy != y->accuracy) {
+    return x->accuracy < y->accuracy ? 1 : -1;
+  }
+  double x_target = x->target_seconds < 0 ? INFINITY : x->target_seconds;
+  double y_target = y->target_seconds < 0 ? INFINITY : y->target_seconds;
+  return (x_target > y_target) - (x_target < y_target);
+}
+
+static void sweep_write(char *path, char *config_path, const Sweep *sweep, size_t threads)
+{
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Error opening the file.");
+    exit(1);
+  }
+  time_t current_time = time(NULL);
+  char date_string[32];
+  strftime(date_string, sizeof(date_string), "%Y-%m-%dT%H:%M:%S", localtime(&current_time));
+  fprintf(file, "{\"date\":\"%s\",\"config\":%s,\"threads\":%zu,\"target\":%g,\"runs\":[\n", date_string,
+          prof_quote(config_path), threads, sweep->target);
+  for (size_t r = 0; r < sweep->count; ++r) {
+    const Sweep_Result *result = &sweep->results[r];
+    const Sweep_Config *config = &result->config;
+    fprintf(file, "{\"rank\":%zu,\"hidden\":[", r + 1);
+    for (size_t l = 1; l + 1 < config->arch_count; ++l) {
+      fprintf(file, l > 1 ? ",%zu" : "%zu", config->arch[l]);
+    }
+    fprintf(file, "],\"optimizer\":\"%s\",\"lr\":%g,\"schedule\":\"%s\",\"epochs\":%zu,\"warmup\":%zu,\"seed\":%llu,"
+            "\"accuracy\":%.6f,\"epochs_run\":%zu,\"seconds\":%.3f,\"target_seconds\":", optim_kinds[config->optimizer],
+            config->learning_rate, optim_schedules[config->schedule], config->epochs, config->warmup,
+            (unsigned long long) config->seed, result->accuracy, result->epochs, result->seconds);
+    fprintf(file, result->target_seconds < 0 ? "null" : "%.3f", result->target_seconds);
+    fprintf(file, ",\"abandoned\":%s}%s\n", result->abandoned ? "true" : "false", (r + 1) < sweep->count ? "," : "");
+  }
+  fprintf(file, "]}\n");
+  if (fclose(file) != 0) {
+    fprintf(stderr, "Error writing the file.");
+    exit(1);
+  }
+}
+
+// Trains every run of the config, threads runs at a time on one thread each (or fewer runs on several threads each
+// when there are fewer runs than threads), prints the leaderboard, writes it to SWEEPS_PATH as JSON and saves the best
+// model.
+void sweep_run(char *config_path, size_t threads)
+{
+  Sweep_Grid grid;
+  sweep_parse(config_path, &grid);
+
+  Sweep sweep;
+  memset(&sweep, 0, sizeof(sweep));
+  sweep.results = sweep_expand(&grid, &sweep.count);
+  sweep.target = grid.target;
+  sweep.abandon = grid.abandon;
+  sweep.grace = grid.grace;
+  sweep.eval_every = grid.eval_every;
+  size_t max_epochs = 0;
+  for (size_t r = 0; r < sweep.count; ++r) {
+    if (sweep.results[r].config.epochs > max_epochs) {
+      max_epochs = sweep.results[r].config.epochs;
+    }
+  }
+  sweep.best_at = calloc(max_epochs, sizeof(*sweep.best_at));
+  assert(sweep.best_at != NULL);
+  pthread_mutex_init(&sweep.mutex, NULL);
+
+  sweep.training = dataset_load("training");
+  sweep.test = dataset_load("test");
+  size_t worker_count = sweep.count < threads ? sweep.count : threads;
+  sweep.run_threads = threads / worker_count;
+  printf("Sweeping %zu runs, %zu at a time on %zu thread(s) each...\n", sweep.count, worker_count, sweep.run_threads);
+
+  pthread_t *workers = malloc(sizeof(*workers) * worker_count);
+  assert(workers != NULL);
+  for (size_t w = 0; w < worker_count; ++w) {
+    if (pthread_create(&workers[w], NULL, sweep_worker, &sweep) != 0) {
+      fprintf(stderr, "Error creating a thread.");
+      exit(1);
+    }
+  }
+  for (size_t w = 0; w < worker_count; ++w) {
+    pthread_join(workers[w], NULL);
+  }
+  free(workers);
+
+  Sweep_Config best = sweep.results[sweep.best_index].config;
+  qsort(sweep.results, sweep.count, sizeof(*sweep.results), sweep_compare);
+  printf("\n%4s %9s %10s %9s %7s  %s\n", "rank", "accuracy", "to target", "seconds", "epochs", "config");
+  for (size_t r = 0; r < sweep.count; ++r) {
+    const Sweep_Result *result = &sweep.results[r];
+    char config_string[SWEEP_LINE_LEN];
+    char target[16];
+    sweep_format_config(config_string, sizeof(config_string), &result->config);
+    snprintf(target, sizeof(target), result->target_seconds < 0 ? "-" : "%.1f s", result->target_seconds);
+    printf("%4zu %7.2f %% %10s %7.1f s %7zu  %s%s\n", r + 1, result->accuracy * MAX_PERCENT, target, result->seconds,
+           result->epochs, config_string, result->abandoned ? " (abandoned)" : "");
+  }
+
+  char results_path[MAX_FILEPATH_LEN];
+  time_t current_time = time(NULL);
+  char date_string[32];
+  strftime(date_string, sizeof(date_string), "%Y%m%d%H%M%S", localtime(&current_time));
+  snprintf(results_path, sizeof(results_path), "%s%s.json", SWEEPS_PATH, date_string);
+  sweep_write(results_path, config_path, &sweep, threads);
+  printf("The leaderboard has been saved to %s.\n", results_path);
+
+  if (sweep.best.params != NULL) {
+    nn_save(sweep.best, SAVED_MODELS_PATH, best.learning_rate, best.epochs);
+    nn_free(sweep.best);
+  }
+
+  pthread_mutex_destroy(&sweep.mutex);
+  free(sweep.best_at);
+  free(sweep.results);
+  dataset_free(sweep.test);
+  dataset_free(sweep.training);
+}
+
+#endif // SWEEP_IMPLEMENTATION